@@ -39,34 +39,17 @@
 #include <assert.h>
 #include <float.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "activity.h"
+#include "geo.h"
+#include "index.h"
+#include "rolling.h"
+#include "summary.h"
 #include "util.h"
 
-/**
- * init_summary
- *
- * Description:
- *  Initializes the `Summary` object of the `Activity`.
- *
- * Parameters:
- *  s - a pointer to the `Summary` data for the activity.
- */
-static void init_summary(Summary *s) {
-  DataField i;
-  s->elapsed = s->moving = s->calories = s->ascent = s->descent = 0;
-
-  for (i = 0; i < DataFieldCount; i++) {
-    s->point[Minimum].data[i] = DBL_MAX;
-    s->point[Maximum].data[i] = DBL_MIN;
-    s->point[Total].data[i] = 0;
-    s->point[Average].data[i] = 0;
-    s->unset[i] = 0;
-  }
-}
-
 /**
  * activity_new
  *
@@ -88,14 +71,29 @@ Activity *activity_new(void) {
   a->sport = UnknownSport;
   a->format = UnknownFileFormat;
   a->start_time = 0;
-  a->laps = NULL;
-  a->breaks = NULL;
+  memset(&(a->laps), 0, sizeof(a->laps));
+  memset(&(a->breaks), 0, sizeof(a->breaks));
+  memset(&(a->pauses), 0, sizeof(a->pauses));
   a->data_points = NULL;
   a->num_points = 0;
+  a->points_alloc = 0;
+  a->lap_summaries = NULL;
+  a->break_summaries = NULL;
+  a->index = NULL;
+  a->time_index = NULL;
+  a->parent = NULL;
+  a->derived = 0;
+  elevation_filter_init(&(a->elevation));
+  /* the sport isn't known yet, `activity_add_point` follows it as it's set */
+  pause_detector_init(&(a->pause), a->sport);
+  a->order.policy = DEFAULT_ORDER_POLICY;
+  a->order.latest = UNSET_FIELD;
+  a->order.disordered = false;
+  a->order.stale = false;
 
-  memset(a->errors, 0, sizeof(*(a->errors)));
-  memset(a->last_set, 0, sizeof(*(a->last_set)));
-  init_summary(&(a->summary));
+  memset(a->errors, 0, sizeof(a->errors));
+  memset(a->last_set, 0, sizeof(a->last_set));
+  summary_init(&(a->summary));
 
   return a;
 }
@@ -113,21 +111,60 @@ Activity *activity_new(void) {
 void activity_destroy(Activity *a) {
   assert(a != NULL);
 
-  /* delete all data points */
+  /* delete all data points, unless they belong to the parent of a view */
   if (a->data_points) {
-    free(a->data_points);
+    if (!a->parent) free(a->data_points);
     a->data_points = NULL;
     a->num_points = 0;
   }
 
   /* delete all laps and breaks */
-  if (a->laps) vector_destroy(laps);
-  if (a->breaks) vector_destroy(breaks);
+  vector_destroy(&(a->laps));
+  vector_destroy(&(a->breaks));
+  vector_destroy(&(a->pauses));
+  if (a->lap_summaries) free(a->lap_summaries);
+  if (a->break_summaries) free(a->break_summaries);
+  if (a->index) range_index_destroy(a->index);
+  if (a->time_index) time_index_destroy(a->time_index);
 
   free(a);
   a = NULL;
 }
 
+/**
+ * grow_points
+ *
+ * Description:
+ *  Ensure the `Activity` has room for at least `nr` points, keeping the
+ *  `last_set` pointers valid if the points have to move.
+ *
+ * Return value:
+ *  0 - there is room for `nr` points.
+ *  1 - unable to allocate the points.
+ */
+static int grow_points(Activity *a, size_t nr) {
+  ptrdiff_t offsets[DataFieldCount];
+  DataField i;
+
+  /* views have to take a copy of their points before they can change */
+  if (a->parent && activity_materialize(a)) return 1;
+  if (nr <= a->points_alloc) return 0;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    offsets[i] = a->last_set[i] ? a->last_set[i] - a->data_points : -1;
+  }
+
+  ALLOC_GROW(a->data_points, nr, a->points_alloc);
+  if (!(a->data_points)) {
+    return 1;
+  }
+
+  for (i = 0; i < DataFieldCount; i++) {
+    a->last_set[i] = offsets[i] < 0 ? NULL : a->data_points + offsets[i];
+  }
+  return 0;
+}
+
 /**
  * derive_distance_position
  *
@@ -138,26 +175,21 @@ void activity_destroy(Activity *a) {
  * Parameters:
  *  prev - the previous `DataPoint` which has speed and distance paramters set.
  *  dp - the `DataPoint` to potentially dervice speed or distance for.
+ *  step - the distance between the positions of `prev` and `dp` if it has
+ *         already been computed, otherwise `UNSET_FIELD`.
  */
-static void derive_distance_position(DataPoint *prev, DataPoint *dp) {
-  double d_lat, d_lon, a, c, delta_d;
-
-  if (!SET(dp->data[Distance]) &&
-      (SET(dp->data[Latitude]) && SET(dp->data[Longitude]) &&
-       (SET(prev->data[Latitude]) && SET(prev->data[Longitude]))))
+static void derive_distance_position(DataPoint *prev, DataPoint *dp,
+                                     double step) {
+  if (SET(dp->data[Distance]) || !SET(prev->data[Distance]) ||
+      !(SET(dp->data[Latitude]) && SET(dp->data[Longitude]) &&
+        SET(prev->data[Latitude]) && SET(prev->data[Longitude])))
     return;
 
-  /* Use the Haversine formula to calculate distance from lat and lon */
-  d_lat = to_radians(dp->data[Latitude] - prev->data[Latitude]);
-  d_lon = to_radians(dp->data[Longitude] - prev->data[Longitude]);
-  a = sin(d_lat / 2) * sin(d_lat / 2) +
-      cos(to_radians(dp->data[Latitude])) *
-          cos(to_radians(prev->data[Latitude])) * sin(d_lon / 2) *
-          sin(d_lon / 2);
-  c = 4 * atan2(sqrt(a), 1 + sqrt(1 - fabs(a)));
-  delta_d = 6371 * c;
-
-  dp->data[Distance] = prev->data[Distance] + delta_d;
+  if (!SET(step)) {
+    step = geo_distance(prev->data[Latitude], prev->data[Longitude],
+                        dp->data[Latitude], dp->data[Longitude]);
+  }
+  dp->data[Distance] = prev->data[Distance] + step;
 }
 
 /**
@@ -176,76 +208,447 @@ static void derive_speed_distance(DataPoint *prev, DataPoint *dp) {
 
   /* return if distance and speed data is fine, or if prev values are bad */
   if ((SET(dp->data[Speed]) && SET(dp->data[Distance])) ||
-      (SET(prev->data[Timestamp]) && SET(prev->data[Distance])))
+      !SET(dp->data[Timestamp]) || !SET(prev->data[Timestamp]) ||
+      !SET(prev->data[Distance]))
     return;
 
   /* compute the elapsed time and distance traveled since the prev recorded
    * trackpoint */
   delta_t = dp->data[Timestamp] - prev->data[Timestamp];
 
-  /* derive speed from distance */
-  if (!SET(dp->data[Speed]) && !SET(dp->data[Distance])) {
-
+  if (SET(dp->data[Distance])) {
+    /* derive speed from distance */
     delta_d = dp->data[Distance] - prev->data[Distance];
-    if (delta_t > 0) dp->data[Speed] = delta_d / delta_t * SECS_IN_HOUR;
-  } else if (SET(dp->data[Distance])) {
+    if (delta_t > 0) dp->data[Speed] = delta_d / delta_t;
+  } else if (SET(dp->data[Speed])) {
     /* otherwise derive distance from speed */
-    delta_d = delta_t * dp->data[Speed] / SECS_IN_HOUR;
+    delta_d = delta_t * dp->data[Speed];
     dp->data[Distance] = prev->data[Distance] + delta_d;
   }
 }
 
 /**
- * recalc_summary
+ * derive_point
+ *
+ * Description:
+ *  Fill in whatever we can of the `DataPoint` from the point before it. The
+ *  first point starts off the distance if we'll be able to derive it later.
+ *
+ * Parameters:
+ *  prev - the previous `DataPoint`, or NULL if `dp` is the first point.
+ *  dp - the `DataPoint` to potentially dervice speed or distance for.
+ *  step - the precomputed distance between the positions of `prev` and `dp`,
+ *         or `UNSET_FIELD`.
+ */
+static void derive_point(DataPoint *prev, DataPoint *dp, double step) {
+  if (!prev) {
+    if (!SET(dp->data[Distance]) &&
+        ((SET(dp->data[Latitude]) && SET(dp->data[Longitude])) ||
+         SET(dp->data[Speed])))
+      dp->data[Distance] = 0;
+    return;
+  }
+
+  derive_distance_position(prev, dp, step);
+  derive_speed_distance(prev, dp);
+  /* HWM/garmin smart recording shit */
+}
+
+/* derive what we can of a point, and keep track of which fields were */
+static void derive(Activity *a, DataPoint *prev, DataPoint *dp, double step) {
+  unsigned unset = (!SET(dp->data[Distance]) << Distance) |
+                   (!SET(dp->data[Speed]) << Speed);
+
+  derive_point(prev, dp, step);
+  a->derived |= unset & ((SET(dp->data[Distance]) << Distance) |
+                         (SET(dp->data[Speed]) << Speed));
+}
+
+/**
+ * elevation_filter_init
+ *
+ * Description:
+ *  Start filtering a new sequence of altitudes.
+ *
+ * Parameters:
+ *  e - the `ElevationFilter` to initialize.
+ */
+void elevation_filter_init(ElevationFilter *e) {
+  e->altitude = e->timestamp = e->reference = UNSET_FIELD;
+}
+
+/**
+ * elevation_filter_add
+ *
+ * Description:
+ *  Add the next altitude and work out how much of a climb or descent it
+ *  completes. The altitude is smoothed by a low-pass filter with a time
+ *  constant of `ELEVATION_SMOOTHING` seconds, and only counts once it has
+ *  moved `ELEVATION_HYSTERESIS` meters from where the last change was
+ *  counted, at which point the whole change since then counts. Noise which
+ *  goes up and down by less than that is never counted at all.
+ *
+ * Parameters:
+ *  e - the `ElevationFilter` to update.
+ *  altitude - the next altitude.
+ *  timestamp - the time of the altitude, or `UNSET_FIELD`.
+ *
+ * Return value:
+ *  The ascent (positive) or descent (negative) counted, or 0.
+ */
+double elevation_filter_add(ElevationFilter *e, double altitude,
+                            double timestamp) {
+  double dt, change;
+
+  if (!SET(e->altitude)) {
+    e->altitude = e->reference = altitude;
+  } else if (ELEVATION_SMOOTHING > 0) {
+    dt = SET(timestamp) && SET(e->timestamp) ? timestamp - e->timestamp : 1;
+    dt = dt > 0 ? dt : 0;
+    e->altitude += (altitude - e->altitude) * dt / (ELEVATION_SMOOTHING + dt);
+  } else {
+    e->altitude = altitude;
+  }
+  e->timestamp = timestamp;
+
+  change = e->altitude - e->reference;
+  if (fabs(change) < ELEVATION_HYSTERESIS) return 0;
+  e->reference = e->altitude;
+  return change;
+}
+
+/* the speed at or below which we are stopped in `sport` */
+static double pause_speed(Sport sport) {
+  return sport == Running     ? PAUSE_SPEED_RUNNING
+         : sport == Bicycling ? PAUSE_SPEED_BICYCLING
+                              : PAUSE_SPEED;
+}
+
+/**
+ * pause_detector_init
+ *
+ * Description:
+ *  Start detecting pauses in a new sequence of points.
+ *
+ * Parameters:
+ *  p - the `PauseDetector` to initialize.
+ *  sport - the sport the points are from, which decides how slow stopped is.
+ */
+void pause_detector_init(PauseDetector *p, Sport sport) {
+  p->speed = pause_speed(sport);
+  p->timestamp = UNSET_FIELD;
+  p->stopped = 0;
+  p->resumed = false;
+}
+
+/**
+ * pause_detector_add
+ *
+ * Description:
+ *  Add the next point and work out how much moving time it completes. The
+ *  time up to a point with a speed at or below the pause speed, or a gap in
+ *  the recording of at least `PAUSE_MIN_TIME` seconds, is time stopped. Once
+ *  we are moving again, being stopped for at least `PAUSE_MIN_TIME` seconds
+ *  was a pause, otherwise it counts as moving time after all. Points without
+ *  a speed count as moving, so that activities without one still get a
+ *  moving time.
+ *
+ * Parameters:
+ *  p - the `PauseDetector` to update.
+ *  dp - the next `DataPoint`.
+ *
+ * Return value:
+ *  The moving time in seconds completed by the point.
+ */
+double pause_detector_add(PauseDetector *p, DataPoint *dp) {
+  double ts = dp->data[Timestamp], speed = dp->data[Speed], dt, moving = 0;
+  bool gap, stopped;
+
+  p->resumed = false;
+  /* a point from back in time has no time of its own */
+  if (!SET(ts) || (SET(p->timestamp) && ts < p->timestamp)) return 0;
+  dt = SET(p->timestamp) ? ts - p->timestamp : 0;
+  p->timestamp = ts;
+
+  gap = dt >= PAUSE_MIN_TIME;
+  stopped = SET(speed) && speed <= p->speed;
+  if (gap || stopped) p->stopped += dt;
+  if (stopped) return 0;
+
+  if (p->stopped >= PAUSE_MIN_TIME) {
+    p->resumed = true;
+  } else {
+    moving = p->stopped;
+  }
+  p->stopped = 0;
+  return moving + (gap ? 0 : dt);
+}
+
+/**
+ * pause_detector_finish
+ *
+ * Description:
+ *  Work out the moving time left at the end of the points, once it is known
+ *  whether we were stopped for long enough to have paused.
+ *
+ * Parameters:
+ *  p - the `PauseDetector` to finish.
+ *
+ * Return value:
+ *  The moving time in seconds left.
+ */
+double pause_detector_finish(PauseDetector *p) {
+  return p->stopped < PAUSE_MIN_TIME ? p->stopped : 0;
+}
+
+/**
+ * Ranges
+ *
+ * Description:
+ *  Accumulates a `Summary` for each of the consecutive ranges of points
+ *  beginning at `starts` (the laps or breaks of an `Activity`) as the points
+ *  are visited in order.
+ *
+ * Fields:
+ *  starts - the index of the first point of each range, in increasing order.
+ *  summaries - one `Summary` for each range, or NULL to skip the ranges.
+ *  owner - where the `Activity` keeps `summaries`.
+ *  tracker - the running values for the current range.
+ *  sport - the sport the points are from.
+ *  next - the index into `starts` of the next range to begin.
+ *  first - the first point of the current range.
+ */
+typedef struct {
+  Vector *starts;
+  Summary *summaries, **owner;
+  Tracker tracker;
+  Sport sport;
+  size_t next, first;
+} Ranges;
+
+static void ranges_init(Ranges *r, Vector *starts, Summary **summaries,
+                        Sport sport) {
+  size_t k;
+
+  r->starts = starts;
+  r->owner = summaries;
+  r->sport = sport;
+  r->next = r->first = 0;
+  tracker_init(&(r->tracker), NULL, sport);
+
+  /* going without range summaries is better than failing to finalize */
+  if (*summaries) free(*summaries);
+  if (starts->size && (*summaries = malloc(starts->size * sizeof(Summary)))) {
+    for (k = 0; k < starts->size; k++) summary_init(&((*summaries)[k]));
+  } else {
+    *summaries = NULL;
+  }
+  r->summaries = *summaries;
+}
+
+static void ranges_finish(Ranges *r, size_t j) {
+  Summary *s;
+
+  if (!r->next) return;
+  s = &(r->summaries[r->next - 1]);
+  s->moving += pause_detector_finish(&(r->tracker.pause));
+  summary_finish(s, &(r->tracker), j - r->first);
+  if (r->tracker.power) rolling_destroy(r->tracker.power);
+  r->tracker.power = NULL;
+}
+
+static void ranges_add(Ranges *r, size_t j, DataPoint *dp) {
+  if (!r->summaries) return;
+
+  while (r->next < r->starts->size && r->starts->data[r->next] <= j) {
+    ranges_finish(r, j);
+    tracker_init(&(r->tracker), rolling_new(Power, NP_WINDOW), r->sport);
+    r->first = j;
+    r->next++;
+  }
+  if (r->next) summary_add(&(r->summaries[r->next - 1]), &(r->tracker), dp);
+}
+
+/**
+ * ranges_insert
+ *
+ * Description:
+ *  Start a new range at point `j`, the point about to be added, while the
+ *  points are being visited, eg. for a pause which has just been found.
+ *
+ * Return value:
+ *  true - the range was inserted.
+ *  false - a range already starts at `j`, or there was no room for it.
+ */
+static bool ranges_insert(Ranges *r, size_t j) {
+  Vector *v = r->starts;
+  Summary *summaries;
+  size_t k = r->next;
+
+  if ((k < v->size && v->data[k] == j) || !r->summaries) return false;
+  if (!(summaries = realloc(r->summaries, (v->size + 1) * sizeof(Summary))))
+    return false;
+  *(r->owner) = r->summaries = summaries;
+  if (vector_add(v, 0)) return false;
+
+  memmove(&(v->data[k + 1]), &(v->data[k]),
+          (v->size - k - 1) * sizeof(*v->data));
+  memmove(&(summaries[k + 1]), &(summaries[k]),
+          (v->size - k - 1) * sizeof(*summaries));
+  v->data[k] = (uint32_t)j;
+  summary_init(&(summaries[k]));
+  return true;
+}
+
+/* any change to the points leaves the indices out of date */
+static void drop_index(Activity *a) {
+  if (a->index) range_index_destroy(a->index);
+  if (a->time_index) time_index_destroy(a->time_index);
+  a->index = NULL;
+  a->time_index = NULL;
+}
+
+/**
+ * activity_clear_derived
  *
  * Description:
- *  Recompute the summary data for the `Activity` to account for the new
- *  information in the `DataPoint`.
+ *  Unset the distance, and the speed and grade derived from it, which were
+ *  derived for the points from `from` onwards so that `activity_finalize`
+ *  derives them again, eg. after the positions have been fixed or points
+ *  have moved. The grades before `from` whose window reaches it go too,
+ *  which is all that clearing from `num_points` does, eg. before appending.
  *
  * Parameters:
- *  a - the `Activity` to update.
- *  dp - the newest `DataPoint` information to update the `Summary` with.
+ *  a - the `Activity` to clear the derived data of.
+ *  from - the index of the first point which changed.
  */
-static void recalc_summary(Activity *a, DataPoint *dp) {
+void activity_clear_derived(Activity *a, size_t from) {
+  unsigned fields =
+      a->derived & ((1u << Distance) | (1u << Speed) | (1u << Grade));
+  double d, end = UNSET_FIELD;
+  size_t j;
+
+  if (!(fields & (1u << Distance)) || from > a->num_points) return;
+  /* distances only increase, so the windows reaching `from` are together.
+   * A point without a distance has had it cleared already along with the
+   * grades before it, so they aren't looked at again. */
+  if (from) end = a->data_points[from - 1].data[Distance];
+  for (j = from; (fields & (1u << Grade)) && j > 0; j--) {
+    d = a->data_points[j - 1].data[Distance];
+    if (!SET(d) || d < end - GRADE_WINDOW / 2) break;
+    a->data_points[j - 1].data[Grade] = UNSET_FIELD;
+  }
+
+  for (j = from; j < a->num_points; j++) {
+    a->data_points[j].data[Distance] = UNSET_FIELD;
+    if (fields & (1u << Speed)) a->data_points[j].data[Speed] = UNSET_FIELD;
+    if (fields & (1u << Grade)) a->data_points[j].data[Grade] = UNSET_FIELD;
+  }
+  /* the points before `from` keep what was derived for them */
+  if (!from) a->derived &= ~fields;
+}
+
+/* whether the point has a timestamp at or before the latest one so far */
+static bool out_of_order(Activity *a, DataPoint *dp) {
+  return SET(dp->data[Timestamp]) && SET(a->order.latest) &&
+         dp->data[Timestamp] <= a->order.latest;
+}
+
+/* the values set in `from` take precedence over those in `to` */
+static void merge_point(DataPoint *to, DataPoint *from) {
   DataField i;
-  DataPoint **last_set = a->last_set;
-  double d_alt;
 
   for (i = 0; i < DataFieldCount; i++) {
-    if (!SET(dp->data[i])) {
-      a->summary.unset[i] += 1;
-      continue;
-    }
+    to->data[i] = SET(from->data[i]) ? from->data[i] : to->data[i];
+  }
+}
 
-    if (dp->data[i] < a->summary.point[Minimum].data[i])
-      a->summary.point[Minimum].data[i] = dp->data[i];
-    if (dp->data[i] > a->summary.point[Maximum].data[i])
-      a->summary.point[Maximum].data[i] = dp->data[i];
+/* keep `last_set` pointing at the same points once `dp` has gone in at `j`,
+ * moving the points from `j` on up by `shift` */
+static void shift_last_set(Activity *a, DataPoint *dp, size_t j, size_t shift) {
+  DataPoint *at = &(a->data_points[j]);
+  DataField i;
 
-    a->summary.point[Total].data[i] += dp->data[i];
-    a->summary.point[Average].data[i] =
-        a->summary.point[Total].data[i] / a->summary.unset[i];
+  for (i = 0; i < DataFieldCount; i++) {
+    if (a->last_set[i] && a->last_set[i] >= at) {
+      a->last_set[i] += shift;
+    } else if (SET(dp->data[i])) {
+      a->last_set[i] = at;
+    }
   }
+}
 
-  a->summary.elapsed = a->summary.point[Maximum].data[Timestamp] -
-                       a->summary.point[Minimum].data[Timestamp];
+/* keep the laps and breaks starting at the same points once a point has gone
+ * in at `j`. A range starting at the first point still does, so that it
+ * covers a point put in before it. */
+static void shift_starts(Activity *a, size_t j) {
+  uint32_t from = j ? (uint32_t)j : 1;
 
-  /* TODO calories */
+  vector_shift(&(a->laps), from);
+  vector_shift(&(a->breaks), from);
+  vector_shift(&(a->pauses), from);
+}
 
-  if (last_set[Altitude] && SET(dp->data[Altitude])) {
-    d_alt = dp->data[Altitude] - last_set[Altitude]->data[Altitude];
-    if (d_alt > 0) {
-      a->summary.ascent += d_alt;
-    } else {
-      a->summary.descent += -d_alt;
-    }
+/**
+ * order_point
+ *
+ * Description:
+ *  Handle a point which is out of order according to the `OrderPolicy`. The
+ *  place the point belongs is only looked for within the last `ORDER_WINDOW`
+ *  points, which is as far back as glitches usually go. Further back than
+ *  that, reordering appends the point and leaves the points to be sorted by
+ *  `activity_finalize`, and merging drops it. Anything derived for the
+ *  points from where it went in is cleared to be derived again, and the
+ *  laps and breaks after it are moved up.
+ *
+ * Parameters:
+ *  a - the `Activity` to add the point to.
+ *  dp - the out of order `DataPoint`.
+ *  index - set to the index of the point `dp` ended up in, or `num_points`
+ *          if it was dropped.
+ *
+ * Return value:
+ *  0 - the point was handled successfully, including being dropped.
+ *  1 - there was an issue adding the point.
+ */
+static int order_point(Activity *a, DataPoint *dp, size_t *index) {
+  double ts = dp->data[Timestamp], v = UNSET_FIELD;
+  size_t j, n = a->num_points, stop = n > ORDER_WINDOW ? n - ORDER_WINDOW : 0;
+
+  *index = n;
+  if (a->order.policy == OrderDrop) return 0;
+
+  /* find the last point at or before the timestamp */
+  for (j = n; j > stop; j--) {
+    v = a->data_points[j - 1].data[Timestamp];
+    if (SET(v) && v <= ts) break;
   }
 
-  if (last_set[Timestamp] && SET(dp->data[Timestamp]) &&
-      (dp->data[Speed] > MOVING_SPEED)) {
-    a->summary.moving +=
-        dp->data[Timestamp] - last_set[Timestamp]->data[Timestamp];
+  if (j > stop && v == ts) {
+    if (grow_points(a, n)) return 1; /* a view's points aren't its own */
+    activity_clear_derived(a, j - 1);
+    merge_point(&(a->data_points[j - 1]), dp);
+    shift_last_set(a, dp, j - 1, 0);
+    *index = j - 1;
+    return 0;
   }
+  if (a->order.policy == OrderMerge) return 0;
+
+  if (grow_points(a, n + 1)) return 1;
+  if (j == stop && stop) {
+    a->order.disordered = true;
+    j = n;
+  }
+  activity_clear_derived(a, j);
+  memmove(&(a->data_points[j + 1]), &(a->data_points[j]),
+          (n - j) * sizeof(DataPoint));
+  a->data_points[j] = *dp;
+  a->num_points++;
+  shift_last_set(a, dp, j, 1);
+  shift_starts(a, j);
+  if (ts < a->start_time) a->start_time = ts;
+  *index = j;
+  return 0;
 }
 
 /**
@@ -254,7 +657,15 @@ static void recalc_summary(Activity *a, DataPoint *dp) {
  * Description:
  *  Add a new `DataPoint` to the `Activity`. We assume the `DataPoint` is the
  *  next point chronologically and correct any information that might be
- *  missing or wrong within the point.
+ *  missing or wrong within the point, keeping the `Summary` up to date. A
+ *  point which isn't is handled by the `Activity`'s `OrderPolicy`. Redoing
+ *  everything for each such point would take quadratic time, so from then on
+ *  points are only appended, and the `Activity` has to be finalized once all
+ *  of them have been added.
+ *  Readers which add every point before using the `Activity` should use
+ *  `activity_append_point` and `activity_finalize` instead. Normalized power
+ *  and the lap and break summaries need the whole activity and are only
+ *  computed by `activity_finalize`.
  *
  * Parameters:
  *  a - the `Activity` to add the point to.
@@ -266,44 +677,773 @@ static void recalc_summary(Activity *a, DataPoint *dp) {
  */
 int activity_add_point(Activity *a, DataPoint *dp) {
   DataField i;
-  DataPoint *prev = NULL;
+  Tracker t;
+  size_t index;
 
-  if (!a->start_time && SET(dp->data[Timestamp])) {
-    a->start_time = dp->data[Timestamp];
+  if (a->order.stale || out_of_order(a, dp)) {
+    if (activity_ingest_point(a, dp, &index)) return 1;
+    /* a dropped point doesn't change anything */
+    if (index < a->num_points) a->order.stale = true;
+    return 0;
   }
+  if (grow_points(a, a->num_points + 1)) return 1;
 
-  ALLOC_GROW(a->data_points, a->num_points + 1, a->points_alloc);
-  if (!(a->data_points)) {
+  /* TODO - should we still run these functions to verify everything is
+   * correct? */
+  /* TODO set errors and correct if they are wrong? */
+  derive(a, a->num_points ? &(a->data_points[a->num_points - 1]) : NULL, dp,
+         UNSET_FIELD);
+
+  tracker_init(&t, NULL, a->sport);
+  t.elevation = a->elevation;
+  t.pause = a->pause;
+  /* the sport is often only set once some of the points have been added */
+  t.pause.speed = pause_speed(a->sport);
+  if (a->last_set[Timestamp]) {
+    t.timestamp = a->last_set[Timestamp]->data[Timestamp];
+  }
+  /* TODO eventually move to a lap based system */
+  summary_add(&(a->summary), &t, dp);
+  summary_finish(&(a->summary), &t, a->num_points + 1);
+
+  if (activity_append_point(a, dp)) return 1;
+  a->elevation = t.elevation;
+  a->pause = t.pause;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    if (SET(dp->data[i])) {
+      a->last_set[i] = &(a->data_points[a->num_points - 1]);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * activity_append_point
+ *
+ * Description:
+ *  Append a raw `DataPoint` to the `Activity` without deriving any data or
+ *  updating the `Summary`. Once all of the points have been appended
+ *  `activity_finalize` must be called before the `Activity` is used. A point
+ *  with a timestamp which isn't after every timestamp so far is handled by
+ *  the `Activity`'s `OrderPolicy`, but in order points only cost a compare.
+ *
+ * Parameters:
+ *  a - the `Activity` to append the point to.
+ *  dp - the `DataPoint` to append.
+ *
+ * Return value:
+ *  0 - if the point was appended successfully
+ *  1 - if there was an issue appending the `DataPoint`.
+ */
+int activity_append_point(Activity *a, DataPoint *dp) {
+  size_t index;
+
+  return activity_ingest_point(a, dp, &index);
+}
+
+/**
+ * activity_ingest_point
+ *
+ * Description:
+ *  Append a raw `DataPoint` to the `Activity` like `activity_append_point`,
+ *  reporting where it ended up. Readers which keep the indices of points, eg.
+ *  for laps, need this since a point which is out of order may be dropped,
+ *  merged into another point or inserted before some of the points already
+ *  there, which then move up by one.
+ *
+ * Parameters:
+ *  a - the `Activity` to append the point to.
+ *  dp - the `DataPoint` to append.
+ *  index - set to the index of the point `dp` ended up in, or `num_points`
+ *          if it was dropped.
+ *
+ * Return value:
+ *  0 - if the point was appended successfully
+ *  1 - if there was an issue appending the `DataPoint`.
+ */
+int activity_ingest_point(Activity *a, DataPoint *dp, size_t *index) {
+  double ts = dp->data[Timestamp];
+
+  drop_index(a);
+  if (out_of_order(a, dp)) return order_point(a, dp, index);
+  if (!a->start_time && SET(ts)) a->start_time = ts;
+
+  if (grow_points(a, a->num_points + 1)) return 1;
+  /* the grades at the end were worked out without the points to come */
+  if (a->derived & (1u << Grade)) activity_clear_derived(a, a->num_points);
+
+  a->data_points[a->num_points] = *dp;
+  *index = a->num_points++;
+  if (SET(ts)) a->order.latest = ts;
+  return 0;
+}
+
+/**
+ * activity_reserve
+ *
+ * Description:
+ *  Make room for `n` points up front, so that appending them takes a single
+ *  allocation when the number of points is known in advance.
+ *
+ * Parameters:
+ *  a - the `Activity` to make room in.
+ *  n - the total number of points it will hold.
+ *
+ * Return value:
+ *  0 - there is room for `n` points.
+ *  1 - unable to allocate the points.
+ */
+int activity_reserve(Activity *a, size_t n) {
+  return grow_points(a, n);
+}
+
+/**
+ * position_steps
+ *
+ * Description:
+ *  Compute the distance between the positions of every pair of consecutive
+ *  points in one batch, so that deriving distance for GPS only activities
+ *  doesn't evaluate the Haversine formula a point at a time. Points without a
+ *  position get a meaningless step which `derive_distance_position` ignores.
+ *
+ * Return value:
+ *  NULL - no distance needs to be derived from position, or we were unable to
+ *         allocate the columns.
+ *  valid pointer - the distance from the previous point to each point. The
+ *                  caller must free it.
+ */
+static double *position_steps(Activity *a) {
+  double *lat, *lon, *steps;
+  DataPoint *dp;
+  size_t j, n = a->num_points;
+  bool needed = false;
+
+  for (j = 0; j < n && !needed; j++) {
+    dp = &(a->data_points[j]);
+    needed = !SET(dp->data[Distance]) && SET(dp->data[Latitude]) &&
+             SET(dp->data[Longitude]);
+  }
+  if (!needed || !(lat = malloc(3 * n * sizeof(*lat)))) return NULL;
+  lon = lat + n;
+  steps = lon + n;
+
+  for (j = 0; j < n; j++) {
+    dp = &(a->data_points[j]);
+    lat[j] = SET(dp->data[Latitude]) ? to_radians(dp->data[Latitude]) : 0;
+    lon[j] = SET(dp->data[Longitude]) ? to_radians(dp->data[Longitude]) : 0;
+  }
+
+  if (geo_distances(lat, lon, n, steps)) {
+    free(lat);
+    return NULL;
+  }
+  /* keep just the steps at the start of the block so it can be freed */
+  memmove(lat, steps, n * sizeof(*steps));
+  return lat;
+}
+
+static bool needs_grade(Activity *a) {
+  size_t j;
+
+  for (j = 0; j < a->num_points; j++) {
+    if (SET(a->data_points[j].data[Altitude]) &&
+        !SET(a->data_points[j].data[Grade]))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * derive_grades
+ *
+ * Description:
+ *  Fill in the grade of every point which has an altitude and distance but
+ *  no grade, from the altitude and distance columns of the points which have
+ *  both (see `geo_grades`).
+ *
+ * Parameters:
+ *  a - the `Activity` with derived distances to derive the grades of.
+ *
+ * Return value:
+ *  0 - the grades were derived.
+ *  1 - unable to allocate the columns, no grades were derived.
+ */
+static int derive_grades(Activity *a) {
+  double *altitude, *distance, *grade;
+  uint32_t *points;
+  DataPoint *dp;
+  size_t j, k, n = 0;
+  int err;
+
+  if (!(altitude = malloc(a->num_points * 3 * sizeof(*altitude)))) return 1;
+  if (!(points = malloc(a->num_points * sizeof(*points)))) {
+    free(altitude);
     return 1;
   }
+  distance = altitude + a->num_points;
+  grade = distance + a->num_points;
 
-  /* if this isn't the first time */
-  if (a->num_points > 0) {
-    prev = &(a->data_points[a->num_points - 1]);
-    /* TODO - should we still run these functions to verify everything is
-     * correct? */
-    /* TODO set errors and correct if they are wrong? */
-    derive_distance_position(prev, dp);
-    derive_speed_distance(prev, dp);
-    /* HWM/garmin smart recording shit */
-  } else {
-    /* TODO add lap? should ensure always at least start lap? */
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    if (!SET(dp->data[Altitude]) || !SET(dp->data[Distance])) continue;
+    altitude[n] = dp->data[Altitude];
+    distance[n] = dp->data[Distance];
+    points[n++] = (uint32_t)j;
   }
 
-  /* TODO eventually move to a lap based system */
-  recalc_summary(a, dp);
+  err = geo_grades(altitude, distance, n, GRADE_WINDOW, grade);
+  for (k = 0; !err && k < n; k++) {
+    dp = &(a->data_points[points[k]]);
+    if (SET(dp->data[Grade])) continue;
+    dp->data[Grade] = grade[k];
+    a->derived |= 1u << Grade;
+  }
+
+  free(points);
+  free(altitude);
+  return err;
+}
+
+/**
+ * SortKey
+ *
+ * Description:
+ *  The timestamp a point is sorted by and where it was. Points without a
+ *  timestamp are sorted by the timestamp of the point before them so that
+ *  they stay with it, and ties keep their order.
+ */
+typedef struct {
+  double timestamp;
+  size_t index;
+} SortKey;
+
+static int compare_keys(const void *x, const void *y) {
+  const SortKey *a = x, *b = y;
+
+  if (a->timestamp != b->timestamp) return a->timestamp < b->timestamp ? -1 : 1;
+  return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static int compare_starts(const void *x, const void *y) {
+  const uint32_t *a = x, *b = y;
+
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* move the starts of the ranges in `v` through the `n` + 1 entry `map` to
+ * where their points went, keeping them in order and collapsing any which
+ * now start at the same point. A range starting at the first point still
+ * does, so that it covers any points sorted in before it. */
+static void remap_starts(Vector *v, const uint32_t *map, size_t n) {
+  size_t j, k = 0;
+
+  if (!v->size) return;
+  for (j = 0; j < v->size; j++) {
+    if (v->data[j]) v->data[j] = map[v->data[j] < n ? v->data[j] : n];
+  }
+  qsort(v->data, v->size, sizeof(*v->data), compare_starts);
+  for (j = 0; j < v->size; j++) {
+    if (!k || v->data[j] != v->data[k - 1]) v->data[k++] = v->data[j];
+  }
+  v->size = k;
+}
 
+/**
+ * sort_points
+ *
+ * Description:
+ *  Sort the points of an `Activity` which were appended too far out of order
+ *  to be put in their place, merging any points with the same timestamp.
+ *  The laps and breaks move with the points they start at. Failing to sort
+ *  just leaves the points as they were appended.
+ *
+ * Parameters:
+ *  a - the `Activity` to sort the points of.
+ */
+static void sort_points(Activity *a) {
+  SortKey *keys;
+  DataPoint *points, *dp;
+  uint32_t *map;
+  double ts = -DBL_MAX;
+  size_t j, n = 0, moved = a->num_points;
+
+  if (!(keys = malloc(a->num_points * sizeof(*keys)))) return;
+  /* where each point went, and one past the end for starts past it */
+  if (!(map = malloc((a->num_points + 1) * sizeof(*map)))) {
+    free(keys);
+    return;
+  }
+  if (!(points = malloc(a->points_alloc * sizeof(*points)))) {
+    free(map);
+    free(keys);
+    return;
+  }
+
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    ts = SET(dp->data[Timestamp]) ? dp->data[Timestamp] : ts;
+    keys[j].timestamp = ts;
+    keys[j].index = j;
+  }
+  qsort(keys, a->num_points, sizeof(*keys), compare_keys);
+
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[keys[j].index]);
+    if (n && SET(dp->data[Timestamp]) &&
+        points[n - 1].data[Timestamp] == dp->data[Timestamp]) {
+      if (moved > n - 1) moved = n - 1;
+      merge_point(&(points[n - 1]), dp);
+    } else {
+      if (moved > n && keys[j].index != n) moved = n;
+      points[n++] = *dp;
+    }
+    map[keys[j].index] = (uint32_t)(n - 1);
+  }
+  map[a->num_points] = (uint32_t)n;
+  remap_starts(&(a->laps), map, a->num_points);
+  remap_starts(&(a->breaks), map, a->num_points);
+  remap_starts(&(a->pauses), map, a->num_points);
+
+  free(map);
+  free(keys);
+  free(a->data_points);
+  a->data_points = points;
+  a->num_points = n;
+  activity_clear_derived(a, moved);
+  a->order.disordered = false;
+  memset(a->last_set, 0, sizeof(a->last_set));
+}
+
+/**
+ * reset_pauses
+ *
+ * Description:
+ *  Drop the breaks which were added by pause detection the last time the
+ *  `Activity` was finalized so that they can be found again. If there are
+ *  no other breaks, a first segment is started at the first point in case
+ *  there are any pauses, and recorded as a pause itself so that it goes
+ *  again if there aren't.
+ */
+static void reset_pauses(Activity *a) {
+  size_t j, k = 0, n = 0;
+
+  for (j = 0; j < a->breaks.size; j++) {
+    while (k < a->pauses.size && a->pauses.data[k] < a->breaks.data[j]) k++;
+    if (k < a->pauses.size && a->pauses.data[k] == a->breaks.data[j]) continue;
+    a->breaks.data[n++] = a->breaks.data[j];
+  }
+  a->breaks.size = n;
+  a->pauses.size = 0;
+
+  if (!n && a->num_points && !vector_add(&(a->pauses), 0) &&
+      vector_add(&(a->breaks), 0))
+    a->pauses.size = 0;
+}
+
+/**
+ * activity_finalize
+ *
+ * Description:
+ *  Derive the missing distance, speed and grade data for every point and
+ *  compute the `Summary` (including normalized power), the summaries of each
+ *  lap and each segment between breaks, and `last_set` for the `Activity` in
+ *  a single pass, or two if there is grade to derive. Pauses are detected in
+ *  the same pass and a break is added wherever we get going again after one,
+ *  unless there is a break there already. Used after the points have been
+ *  loaded with `activity_append_point`, and can be run again at any time to
+ *  recompute everything from scratch.
+ *
+ * Parameters:
+ *  a - the `Activity` to finalize.
+ */
+void activity_finalize(Activity *a) {
+  DataField i;
+  DataPoint *dp, *prev = NULL;
+  size_t j, last[DataFieldCount];
+  Tracker t;
+  Ranges laps, breaks;
+  double *steps;
+  bool derived = a->parent != NULL;
+
+  if (a->order.disordered) sort_points(a);
+  a->order.stale = false;
+  /* a view's points were derived with its parent's, and aren't its own */
+  steps = a->parent ? NULL : position_steps(a);
+  /* deriving data doesn't touch the timestamps the `TimeIndex` is built on */
+  if (a->index) range_index_destroy(a->index);
+  a->index = NULL;
+  summary_init(&(a->summary));
+  /* without the rolling window we just go without normalized power */
+  tracker_init(&t, rolling_new(Power, NP_WINDOW), a->sport);
+  ranges_init(&laps, &(a->laps), &(a->lap_summaries), a->sport);
+  reset_pauses(a);
+  ranges_init(&breaks, &(a->breaks), &(a->break_summaries), a->sport);
+  for (i = 0; i < DataFieldCount; i++) last[i] = a->num_points;
+
+  /* grade needs the distance ahead of each point, so the points have to be
+   * derived before the summary pass when there is grade to derive */
+  if (!a->parent && needs_grade(a)) {
+    for (j = 0; j < a->num_points; j++) {
+      dp = &(a->data_points[j]);
+      derive(a, prev, dp, steps ? steps[j] : UNSET_FIELD);
+      prev = dp;
+    }
+    /* going without grade is better than failing to finalize */
+    derive_grades(a);
+    derived = true;
+  }
+
+  for (j = 0, prev = NULL; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    if (!derived) derive(a, prev, dp, steps ? steps[j] : UNSET_FIELD);
+    summary_add(&(a->summary), &t, dp);
+    /* if it can't be recorded as a pause it's kept as if it was recorded */
+    if (t.pause.resumed && ranges_insert(&breaks, j)) {
+      vector_add(&(a->pauses), (uint32_t)j);
+    }
+    ranges_add(&laps, j, dp);
+    ranges_add(&breaks, j, dp);
+    for (i = 0; i < DataFieldCount; i++) {
+      last[i] = SET(dp->data[i]) ? j : last[i];
+    }
+    prev = dp;
+  }
+
+  if (steps) free(steps);
+  a->summary.moving += pause_detector_finish(&(t.pause));
+  summary_finish(&(a->summary), &t, a->num_points);
+  if (t.power) rolling_destroy(t.power);
+  a->elevation = t.elevation;
+  a->pause = t.pause;
+  ranges_finish(&laps, a->num_points);
+  ranges_finish(&breaks, a->num_points);
+  if (a->pauses.size == 1 && !a->pauses.data[0]) {
+    /* without any pauses there was only ever the one segment */
+    a->breaks.size = a->pauses.size = 0;
+    if (a->break_summaries) free(a->break_summaries);
+    a->break_summaries = NULL;
+  }
   for (i = 0; i < DataFieldCount; i++) {
-    a->data_points[a->num_points].data[i] = dp->data[i];
-    if (SET(dp->data[i])) {
-      a->last_set[i] = &(a->data_points[a->num_points]);
+    a->last_set[i] =
+        last[i] < a->num_points ? &(a->data_points[last[i]]) : NULL;
+  }
+}
+
+/**
+ * activity_range_summary
+ *
+ * Description:
+ *  Work out the `Summary` of any range of points, eg. a climb or an interval.
+ *  The first query builds a `RangeIndex` over the `Activity` so that every
+ *  query after it takes O(1) time instead of rescanning the points. The index
+ *  is thrown away when the points change.
+ *
+ * Parameters:
+ *  a - the finalized `Activity` to summarize part of.
+ *  start - the index of the first point in the range.
+ *  end - the index after the last point in the range.
+ *  s - set to the `Summary` of the range.
+ *
+ * Return value:
+ *  0 - successfully summarized the range.
+ *  1 - the range is empty or out of bounds, or the index couldn't be built.
+ */
+int activity_range_summary(Activity *a, size_t start, size_t end, Summary *s) {
+  assert(a != NULL && s != NULL);
+
+  if (start >= end || end > a->num_points) return 1;
+  if (!a->index && !(a->index = range_index_new(a))) return 1;
+
+  range_index_summary(a->index, a, start, end, s);
+  return 0;
+}
+
+/**
+ * activity_point_at_time
+ *
+ * Description:
+ *  Find the first point at or after `timestamp` in O(log n) time. The first
+ *  lookup by time builds a `TimeIndex` over the `Activity`, which is thrown
+ *  away when the points change.
+ *
+ * Parameters:
+ *  a - the `Activity` to search.
+ *  timestamp - the time to look for.
+ *  point - set to the index of the point, or `a->num_points` if there isn't
+ *          one.
+ *
+ * Return value:
+ *  0 - successfully looked up the point.
+ *  1 - unable to build the index.
+ */
+int activity_point_at_time(Activity *a, double timestamp, size_t *point) {
+  assert(a != NULL && point != NULL);
+
+  if (!a->time_index && !(a->time_index = time_index_new(a))) return 1;
+  *point = time_index_at(a->time_index, timestamp);
+  return 0;
+}
+
+/**
+ * activity_range_by_time
+ *
+ * Description:
+ *  Find the range of points recorded from `from` up to (but not including)
+ *  `to`, eg. for cropping or splitting at a time, in O(log n) time.
+ *
+ * Parameters:
+ *  a - the `Activity` to search.
+ *  from - the start of the time range.
+ *  to - the end of the time range.
+ *  start - set to the index of the first point in the range.
+ *  end - set to the index after the last point in the range.
+ *
+ * Return value:
+ *  0 - successfully looked up the range, which is empty if `start == end`.
+ *  1 - unable to build the index.
+ */
+int activity_range_by_time(Activity *a, double from, double to, size_t *start,
+                           size_t *end) {
+  assert(a != NULL && start != NULL && end != NULL);
+
+  if (activity_point_at_time(a, from, start) ||
+      activity_point_at_time(a, to, end))
+    return 1;
+  *end = *end > *start ? *end : *start;
+  return 0;
+}
+
+/**
+ * activity_recorded_breaks
+ *
+ * Description:
+ *  Collect the breaks of `a` which weren't added by its pause detection, eg.
+ *  to carry them over to a new `Activity` whose own pauses will be found
+ *  again when it is finalized.
+ *
+ * Parameters:
+ *  a - the `Activity` to collect the breaks of.
+ *  breaks - the `Vector` to add the breaks to.
+ *
+ * Return value:
+ *  0 - successfully collected the breaks.
+ *  1 - unable to add to `breaks`.
+ */
+int activity_recorded_breaks(Activity *a, Vector *breaks) {
+  size_t j, k = 0;
+
+  assert(a != NULL && breaks != NULL);
+
+  for (j = 0; j < a->breaks.size; j++) {
+    while (k < a->pauses.size && a->pauses.data[k] < a->breaks.data[j]) k++;
+    if (k < a->pauses.size && a->pauses.data[k] == a->breaks.data[j]) continue;
+    if (vector_add(breaks, a->breaks.data[j])) return 1;
+  }
+  return 0;
+}
+
+/* copy the laps or breaks of `from` which fall in [start, end) over to `to`,
+ * with the one in progress at `start` beginning the view */
+static int view_starts(Vector *from, size_t start, size_t end, Vector *to) {
+  size_t k;
+
+  if (!from->size) return 0;
+  if (vector_add(to, 0)) return 1;
+  for (k = 0; k < from->size; k++) {
+    if (from->data[k] <= start || from->data[k] >= end) continue;
+    if (vector_add(to, (uint32_t)(from->data[k] - start))) return 1;
+  }
+  return 0;
+}
+
+/**
+ * activity_view
+ *
+ * Description:
+ *  Create a lightweight view of the points of `a` from `start` up to (but
+ *  not including) `end`, eg. to crop or split it. The view shares the points
+ *  of `a` rather than copying them and gets its own laps, breaks and
+ *  summaries, with its pauses found again over its own points. Views of
+ *  views share the original points. The original must outlive its views and
+ *  not change while they are in use. A view takes its own copy of the points
+ *  (see `activity_materialize`) before it changes them. If a valid pointer
+ *  is returned it must be free'd with a call to `activity_destroy`.
+ *
+ * Parameters:
+ *  a - the finalized `Activity` to create a view of.
+ *  start - the index of the first point in the view.
+ *  end - the index after the last point in the view.
+ *
+ * Return value:
+ *  NULL - the range is empty or out of bounds, or we were unable to create
+ *         the view.
+ *  valid pointer - the pointer to the view.
+ */
+Activity *activity_view(Activity *a, size_t start, size_t end) {
+  Activity *v;
+  Vector breaks = {0};
+  size_t j;
+
+  assert(a != NULL);
+
+  if (start >= end || end > a->num_points || !(v = activity_new()))
+    return NULL;
+
+  v->sport = a->sport;
+  v->format = a->format;
+  v->parent = a->parent ? a->parent : a;
+  v->derived = a->derived;
+  v->data_points = a->data_points + start;
+  v->num_points = end - start;
+  for (j = 0; j < v->num_points && !v->start_time; j++) {
+    if (SET(v->data_points[j].data[Timestamp])) {
+      v->start_time = v->data_points[j].data[Timestamp];
     }
   }
 
-  a->num_points++;
+  /* the view finds its own pauses when it is finalized */
+  if (activity_recorded_breaks(a, &breaks) ||
+      view_starts(&(a->laps), start, end, &(v->laps)) ||
+      view_starts(&breaks, start, end, &(v->breaks))) {
+    vector_destroy(&breaks);
+    activity_destroy(v);
+    return NULL;
+  }
+  vector_destroy(&breaks);
+
+  activity_finalize(v);
+  return v;
+}
+
+/**
+ * activity_materialize
+ *
+ * Description:
+ *  Give a view created by `activity_view` its own copy of its points, so that
+ *  it no longer depends on the `Activity` it is a view of. Does nothing for an
+ *  `Activity` which already owns its points.
+ *
+ * Parameters:
+ *  a - the `Activity` to materialize.
+ *
+ * Return value:
+ *  0 - the `Activity` owns its points.
+ *  1 - unable to copy the points.
+ */
+int activity_materialize(Activity *a) {
+  DataPoint *points;
+  DataField i;
+
+  assert(a != NULL);
+
+  if (!a->parent) return 0;
+  if (!(points = malloc(a->num_points * sizeof(*points)))) return 1;
+  memcpy(points, a->data_points, a->num_points * sizeof(*points));
+
+  for (i = 0; i < DataFieldCount; i++) {
+    if (a->last_set[i]) {
+      a->last_set[i] = points + (a->last_set[i] - a->data_points);
+    }
+  }
+  a->data_points = points;
+  a->points_alloc = a->num_points;
+  a->parent = NULL;
   return 0;
 }
 
+/* whether the point has a position which could be on a map */
+static bool has_position(DataPoint *dp) {
+  double lat = dp->data[Latitude], lon = dp->data[Longitude];
+
+  return lat >= -90 && lat <= 90 && lon >= -180 && lon <= 180 && (lat || lon);
+}
+
+/* the square of the distance in meters from `p` to the segment from `a` to
+ * `b`, on a flat projection around `a` which is plenty accurate over the
+ * length of a segment */
+static double segment_distance2(DataPoint *a, DataPoint *b, DataPoint *p) {
+  double scale = cos(to_radians(a->data[Latitude])), bx, by, px, py, t, len2;
+
+  bx = (b->data[Longitude] - a->data[Longitude]) * scale;
+  by = b->data[Latitude] - a->data[Latitude];
+  px = (p->data[Longitude] - a->data[Longitude]) * scale;
+  py = p->data[Latitude] - a->data[Latitude];
+
+  len2 = bx * bx + by * by;
+  t = len2 > 0 ? (px * bx + py * by) / len2 : 0;
+  t = t < 0 ? 0 : t > 1 ? 1 : t;
+  px -= t * bx;
+  py -= t * by;
+  /* meters per degree */
+  t = to_radians(1) * EARTH_RADIUS;
+  return (px * px + py * py) * t * t;
+}
+
+/**
+ * activity_simplify
+ *
+ * Description:
+ *  Simplify the track of the `Activity` with the Douglas-Peucker algorithm,
+ *  keeping only the points needed for the track to stay within `tolerance`
+ *  meters of every position, eg. to draw it on a map. Instead of recursing
+ *  or keeping a stack of segments, the points kept so far mark out the
+ *  segments left to check: the segment from the current point to the next
+ *  kept point is split at its farthest point until it is within tolerance,
+ *  and then the next segment is checked. Nothing is allocated. Points
+ *  without a valid position are never kept.
+ *
+ * Parameters:
+ *  a - the `Activity` to simplify.
+ *  tolerance - the furthest in meters a position may be from the track.
+ *  keep - set to whether each of the `num_points` points is kept.
+ *
+ * Return value:
+ *  The number of points kept.
+ */
+size_t activity_simplify(Activity *a, double tolerance, unsigned char *keep) {
+  DataPoint *from, *to;
+  double d, max, tolerance2 = tolerance * tolerance;
+  size_t j, far, first, last, cur, next, kept = 0;
+
+  assert(a != NULL && keep != NULL);
+
+  memset(keep, 0, a->num_points);
+  for (first = 0; first < a->num_points; first++) {
+    if (has_position(&(a->data_points[first]))) break;
+  }
+  for (last = a->num_points; last > first; last--) {
+    if (has_position(&(a->data_points[last - 1]))) break;
+  }
+  if (first == a->num_points) return 0;
+  keep[first] = keep[--last] = 1;
+
+  for (cur = first; cur < last;) {
+    for (next = cur + 1; !keep[next]; next++) continue;
+    from = &(a->data_points[cur]);
+    to = &(a->data_points[next]);
+
+    for (max = tolerance2, far = next, j = cur + 1; j < next; j++) {
+      if (!has_position(&(a->data_points[j]))) continue;
+      d = segment_distance2(from, to, &(a->data_points[j]));
+      if (d > max) {
+        max = d;
+        far = j;
+      }
+    }
+
+    if (far < next) {
+      keep[far] = 1;
+    } else {
+      cur = next;
+    }
+  }
+
+  for (j = first; j <= last; j++) kept += keep[j];
+  return kept;
+}
+
 /**
  * activity_equal
  *
@@ -46,10 +46,41 @@
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 #define SECS_IN_HOUR 3600
-#define MOVING_SPEED 0
+/* at or below these speeds in m/s we are stopped, eg. at a junction */
+#define PAUSE_SPEED 0.3
+#define PAUSE_SPEED_RUNNING 0.5
+#define PAUSE_SPEED_BICYCLING 1
+/* stops, or gaps in the recording, shorter than this many seconds still
+ * count as moving time */
+#define PAUSE_MIN_TIME 10
+/* normalized power is the fourth-power mean of the rolling average over this
+ * many seconds, with no point weighted by more than NP_MAX_GAP seconds */
+#define NP_WINDOW 30
+#define NP_MAX_GAP 5
+/* no point counts for more than this many seconds of work or heart beats, so
+ * that gaps in the recording don't add energy */
+#define ENERGY_MAX_GAP 5
+/* a point from back in time is put in its place if it belongs within this
+ * many points of the end, which is as far back as glitches usually go */
+#define ORDER_WINDOW 8
+#define DEFAULT_ORDER_POLICY OrderReorder
+/* altitude has to change by this many meters from where it last did before
+ * it counts towards the ascent or descent, which keeps noise out of them */
+#define ELEVATION_HYSTERESIS 2
+/* the time constant in seconds of the low-pass filter altitude goes through
+ * before the hysteresis, or 0 for no filter */
+#define ELEVATION_SMOOTHING 10
+/* grade is derived over this many meters centered on each point */
+#define GRADE_WINDOW 50
 
 typedef enum { false, true } bool;
 
+typedef struct {
+  uint32_t *data;
+  size_t size;
+  size_t alloc;
+} Vector;
+
 typedef enum { CSV, GPX, TCX, FIT, UnknownFileFormat } FileFormat;
 
 typedef enum {
@@ -148,31 +179,133 @@ typedef struct {
   DataPoint point[SummaryPointCount];
   unsigned unset[DataFieldCount];
   double elapsed, moving, calories, ascent, descent;
+  double normalized_power;
+  double work;        /* kJ of work from the power */
+  double heart_beats; /* beats over the time with a heart rate */
+  double heart_time;  /* seconds with a heart rate */
 } Summary;
 
+/**
+ * ElevationFilter
+ *
+ * Description:
+ *  The state of the streaming filter used to work out the ascent and descent
+ *  from a sequence of altitudes.
+ *
+ * Fields:
+ *  altitude - the filtered altitude, or `UNSET_FIELD` before the first.
+ *  timestamp - the time of the last altitude, or `UNSET_FIELD`.
+ *  reference - the filtered altitude the last change was counted at.
+ */
+typedef struct {
+  double altitude;
+  double timestamp;
+  double reference;
+} ElevationFilter;
+
+/**
+ * PauseDetector
+ *
+ * Description:
+ *  The state of the streaming auto-pause detection used to work out the
+ *  moving time, in the same way a device's auto-pause would.
+ *
+ * Fields:
+ *  speed - the speed at or below which we are stopped.
+ *  timestamp - the last timestamp, or `UNSET_FIELD`.
+ *  stopped - the time we have been stopped for, which isn't known to be
+ *            moving time or a pause until we get going again.
+ *  resumed - whether the last point ended a pause.
+ */
+typedef struct {
+  double speed;
+  double timestamp;
+  double stopped;
+  bool resumed;
+} PauseDetector;
+
+typedef enum {
+  OrderDrop,    /* drop the point */
+  OrderMerge,   /* merge duplicates into the point with the same timestamp */
+  OrderReorder  /* merge duplicates and put earlier points in their place */
+} OrderPolicy;
+
+/**
+ * Ordering
+ *
+ * Description:
+ *  How points which are appended with a timestamp at or before the latest
+ *  one so far are handled, and what has been appended so far.
+ *
+ * Fields:
+ *  policy - the `OrderPolicy` for points which are out of order.
+ *  latest - the latest timestamp appended so far, or `UNSET_FIELD`.
+ *  disordered - whether a point is out of order by more than `ORDER_WINDOW`
+ *               points, and the points need sorting by `activity_finalize`.
+ *  stale - whether a point out of order has been added with
+ *          `activity_add_point`, and the `Summary` is out of date until the
+ *          `Activity` is finalized.
+ */
+typedef struct {
+  OrderPolicy policy;
+  double latest;
+  bool disordered;
+  bool stale;
+} Ordering;
+
+/* defined in index.h */
+typedef struct RangeIndex RangeIndex;
+typedef struct TimeIndex TimeIndex;
+
 /*****************
  * TODO Read all individual points and compare it to summary data
  */
-typedef struct {
+typedef struct Activity {
   Sport sport;
   FileFormat format; /* the original format it was read in from */
   uint32_t start_time;
-  Vector *laps;
-  Vector *breaks;
+  Vector laps;
+  Vector breaks;
+  Vector pauses; /* the `breaks` added by pause detection */
   DataPoint *data_points;
   DataPoint *last_set[DataFieldCount];
   Summary summary;
   size_t num_points;
   size_t points_alloc;
   unsigned errors[DataErrorCount];
-  /*
-  //Summary *summaries; // laps + total can include derived statistics
-  */
+  Summary *lap_summaries;    /* one for each of `laps` */
+  Summary *break_summaries;  /* one for the segment started by each `breaks` */
+  RangeIndex *index;         /* built on demand by `activity_range_summary` */
+  TimeIndex *time_index;     /* built on demand by the lookups by time */
+  struct Activity *parent;   /* owns the points if this is a view, or NULL */
+  unsigned derived;          /* bit per `DataField` derived for any point */
+  ElevationFilter elevation; /* where `activity_add_point` picks up from */
+  PauseDetector pause;       /* where `activity_add_point` picks up from */
+  Ordering order;            /* what happens to points which are out of order */
 } Activity;
 
+void elevation_filter_init(ElevationFilter *e);
+double elevation_filter_add(ElevationFilter *e, double altitude,
+                            double timestamp);
+void pause_detector_init(PauseDetector *p, Sport sport);
+double pause_detector_add(PauseDetector *p, DataPoint *dp);
+double pause_detector_finish(PauseDetector *p);
 Activity *activity_new(void);
 void activity_destroy(Activity *a);
 int activity_add_point(Activity *a, DataPoint *dp);
+int activity_append_point(Activity *a, DataPoint *dp);
+int activity_ingest_point(Activity *a, DataPoint *dp, size_t *index);
+int activity_reserve(Activity *a, size_t n);
+int activity_recorded_breaks(Activity *a, Vector *breaks);
+Activity *activity_view(Activity *a, size_t start, size_t end);
+int activity_materialize(Activity *a);
+size_t activity_simplify(Activity *a, double tolerance, unsigned char *keep);
+void activity_finalize(Activity *a);
+void activity_clear_derived(Activity *a, size_t from);
+int activity_range_summary(Activity *a, size_t start, size_t end, Summary *s);
+int activity_point_at_time(Activity *a, double timestamp, size_t *point);
+int activity_range_by_time(Activity *a, double from, double to, size_t *start,
+                           size_t *end);
 int activity_add_lap(Activity *a, uint32_t lap);
 bool activity_equal(Activity *a, Activity *b);
 
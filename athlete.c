@@ -34,4 +34,116 @@
  *     51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-void dummy(int foo) { return; }
+#include <assert.h>
+
+#include "athlete.h"
+
+/**
+ * athlete_intensity_factor
+ *
+ * Description:
+ *  The intensity factor (IF) - normalized power as a fraction of FTP.
+ *
+ * Parameters:
+ *  athlete - the athlete who recorded the activity.
+ *  s - the `Summary` of the activity, or of part of it.
+ *
+ * Return value:
+ *  UNSET_FIELD - the FTP or the normalized power is unknown.
+ *  double - the intensity factor.
+ */
+double athlete_intensity_factor(Athlete *athlete, Summary *s) {
+  assert(athlete != NULL && s != NULL);
+
+  if (!athlete->ftp || !SET(s->normalized_power)) return UNSET_FIELD;
+  return s->normalized_power / athlete->ftp;
+}
+
+/**
+ * athlete_tss
+ *
+ * Description:
+ *  The training stress score (TSS) - an hour at FTP scores 100. The moving
+ *  time is used as the duration when it is known, otherwise the elapsed time.
+ *
+ * Parameters:
+ *  athlete - the athlete who recorded the activity.
+ *  s - the `Summary` of the activity, or of part of it.
+ *
+ * Return value:
+ *  UNSET_FIELD - the FTP or the normalized power is unknown.
+ *  double - the training stress score.
+ */
+double athlete_tss(Athlete *athlete, Summary *s) {
+  double intensity, duration;
+
+  assert(athlete != NULL && s != NULL);
+
+  duration = s->moving ? s->moving : s->elapsed;
+  if (!SET(intensity = athlete_intensity_factor(athlete, s)))
+    return UNSET_FIELD;
+  return duration * intensity * intensity / SECS_IN_HOUR * 100;
+}
+
+/**
+ * athlete_watts_per_kg
+ *
+ * Description:
+ *  Average power relative to the athlete's weight.
+ *
+ * Parameters:
+ *  athlete - the athlete who recorded the activity.
+ *  s - the `Summary` of the activity, or of part of it.
+ *
+ * Return value:
+ *  UNSET_FIELD - the weight or the average power is unknown.
+ *  double - the average watts per kilogram.
+ */
+double athlete_watts_per_kg(Athlete *athlete, Summary *s) {
+  assert(athlete != NULL && s != NULL);
+
+  /* the maximum is only raised by values which are set */
+  if (athlete->weight <= 0 || s->point[Maximum].data[Power] == -DBL_MAX)
+    return UNSET_FIELD;
+  return s->point[Average].data[Power] / athlete->weight;
+}
+
+/**
+ * athlete_calories
+ *
+ * Description:
+ *  The energy burned. With power this is the `calories` of the `Summary`,
+ *  which come from the work done. Otherwise it is estimated from the heart
+ *  rate with the model of Keytel et al. (2005), which is linear in the heart
+ *  rate and so only needs the beats and the time they were counted over.
+ *
+ * Parameters:
+ *  athlete - the athlete who recorded the activity.
+ *  s - the `Summary` of the activity, or of part of it.
+ *
+ * Return value:
+ *  UNSET_FIELD - there is no power, and the heart rate, weight or age is
+ *                unknown.
+ *  double - the calories burned in kcal.
+ */
+double athlete_calories(Athlete *athlete, Summary *s) {
+  double minutes, kj;
+
+  assert(athlete != NULL && s != NULL);
+
+  if (s->calories) return s->calories;
+  if (!s->heart_time || athlete->weight <= 0 || !athlete->age)
+    return UNSET_FIELD;
+
+  minutes = s->heart_time / 60;
+  if (athlete->gender == Female) {
+    kj = (-20.4022 - 0.1263 * athlete->weight + 0.074 * athlete->age) *
+             minutes +
+         0.4472 * s->heart_beats;
+  } else {
+    kj = (-55.0969 + 0.1988 * athlete->weight + 0.2017 * athlete->age) *
+             minutes +
+         0.6309 * s->heart_beats;
+  }
+  return kj > 0 ? kj / 4.184 : 0;
+}
@@ -34,6 +34,11 @@
  *     51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef _ATHLETE_H_
+#define _ATHLETE_H_
+
+#include "activity.h"
+
 /* Athlete:
  *
  * name
@@ -44,6 +49,7 @@
  * critical power
  * FTP
  * weight (kg/lbs)
+ * age
  */
 
 /* should be in inih file format? */
@@ -51,3 +57,37 @@
 
 typedef enum { Male, Female } Gender;
 typedef enum { Metric, Imperial } Units;
+
+#define DEFAULT_ATHLETE \
+  { Male, Metric, 0, 0, 0, 0 }
+
+/**
+ * Athlete
+ *
+ * Description:
+ *  The settings of the athlete who recorded an activity which are needed to
+ *  compute training load metrics. Zero means the setting is unknown.
+ *
+ * Fields:
+ *  gender - the athlete's gender.
+ *  units - the units the athlete prefers to see data in.
+ *  ftp - functional threshold power in watts.
+ *  hr_max - maximum heart rate in beats per minute.
+ *  weight - weight in kilograms.
+ *  age - age in years.
+ */
+typedef struct {
+  Gender gender;
+  Units units;
+  unsigned ftp;
+  unsigned hr_max;
+  double weight;
+  unsigned age;
+} Athlete;
+
+double athlete_intensity_factor(Athlete *athlete, Summary *s);
+double athlete_tss(Athlete *athlete, Summary *s);
+double athlete_watts_per_kg(Athlete *athlete, Summary *s);
+double athlete_calories(Athlete *athlete, Summary *s);
+
+#endif /* _ATHLETE_H_ */
@@ -21,19 +21,24 @@
 
 #include "fitparse.h"
 #include "activity.h"
+#include "fix.h"
+#include "pipeline.h"
+#include "resample.h"
 #include "util.h"
+#include "zones.h"
 
 #define CLIENT_VERSION "0.0.1"
 #define MAX_INPUT 32
 
 typedef struct {
   int format;
-  unsigned input_count, hr, ftp;
+  unsigned input_count, hr, ftp, age;
+  double weight, crop_from, crop_to, split_gap, interval;
   char **input, *output, *config;
-  int merge, split, crop, summary, laps;
+  int merge, split, crop, resample, summary, laps;
   Gender gender;
   Units units;
-  /* TODO fix */
+  unsigned fixes;
 } Options;
 
 static int version(void) {
@@ -60,13 +65,21 @@ static int usage(char *name) {
       "    --hr=<bpm>             the HR max in BPM to use for summary data\n"
       "    --gender=<m,f>         the gender to use for summary data\n"
       "    --ftp=<watts>          the FTP in watts to use for summary data\n"
+      "    --weight=<kg>          the weight in kg to use for summary data\n"
+      "    --age=<years>          the age in years to use for summary data\n"
       "    --units=<units>        the units to use for summary data (defaults "
       "to 'metric')\n");
   fprintf(stderr,
           "    --merge                merge all the input files into output\n"
-          "    --split                TODO\n"
-          "    --crop                 TODO\n"
-          "    --fix=<type>           TODO\n"
+          "    --split=<seconds>      split wherever there is a gap this long, "
+          "writing\n"
+          "                           each part to <output>-<n>\n"
+          "    --crop=<from>,<to>     crop to between these seconds since the "
+          "start\n"
+          "    --fix=<fixes>          run the comma separated fixes: gps, "
+          "power, hr, all\n"
+          "    --resample=<seconds>   resample to a point every this many "
+          "seconds\n"
           "    --summary              print summary data for the input files\n"
           "    --laps                 print lap summary data for the input "
           "files\n");
@@ -78,22 +91,333 @@ static int validate_options(Options *options) {
   return 0;
 }
 
+static int parse_fixes(char *list, unsigned *fixes) {
+  char *name;
+
+  for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    if (!strcmp("gps", name)) {
+      *fixes |= FIX(InvalidGPS);
+    } else if (!strcmp("power", name)) {
+      *fixes |= FIX(PowerSpikes);
+    } else if (!strcmp("hr", name)) {
+      *fixes |= FIX(HeartRateSpikes) | FIX(HeartRateDropouts);
+    } else if (!strcmp("all", name)) {
+      *fixes |= FIX_ALL;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static void destroy_options(Options *options) {
   if (options->output) free(options->output);
   if (options->config) free(options->config);
   if (options->input) free(options->input);
 }
 
+/**
+ * run_batch
+ *
+ * Description:
+ *  Convert each input file to the output format, writing the result next to
+ *  the input. Output flags are ignored since there is more than one output.
+ */
+static int run_batch(Options *options) {
+  PipelineOptions o = DEFAULT_PIPELINE_OPTIONS;
+  PipelineStatus *status;
+  unsigned i, errors;
+
+  if (!(status = malloc(options->input_count * sizeof(*status)))) return 1;
+
+  o.format = options->format;
+  o.fixes = options->fixes;
+  errors = pipeline_run(options->input, options->input_count, &o, status);
+
+  for (i = 0; errors && i < options->input_count; i++) {
+    if (status[i] == PipelineReadError || status[i] == PipelineParseError) {
+      fprintf(stderr, "Error reading file %s\n", options->input[i]);
+    } else if (status[i] == PipelineWriteError) {
+      fprintf(stderr, "Error writing file for %s\n", options->input[i]);
+    } else if (status[i] == PipelineOutputConflict) {
+      fprintf(stderr, "Another input would be written to the same file as %s\n",
+              options->input[i]);
+    }
+  }
+
+  free(status);
+  return errors ? 1 : 0;
+}
+
+static void print_duration(const char *label, double seconds) {
+  unsigned long s = (unsigned long)seconds;
+  printf("  %-12s%lu:%02lu:%02lu\n", label, s / SECS_IN_HOUR, s / 60 % 60,
+         s % 60);
+}
+
+static void print_zones(const char *label, Activity *a, Zones *z) {
+  ZoneHistogram h;
+  unsigned i;
+  unsigned long t;
+
+  zones_histograms(a, z, &h, NULL);
+  printf("  %s\n", label);
+  for (i = 0; i < z->count; i++) {
+    t = (unsigned long)h.seconds[i];
+    printf("    Z%u %4.0f+  %lu:%02lu:%02lu\n", i + 1, z->lower[i],
+           t / SECS_IN_HOUR, t / 60 % 60, t % 60);
+  }
+}
+
+/**
+ * print_summary
+ *
+ * Description:
+ *  Print the summary data for the `Activity`, including the training load
+ *  metrics which can be worked out from the athlete's settings.
+ */
+static void print_summary(const char *name, Activity *a, Athlete *athlete) {
+  Summary *s = &(a->summary);
+  Zones z;
+  bool imperial = athlete->units == Imperial;
+  double distance = imperial ? 1609.344 : 1000, height = imperial ? 0.3048 : 1,
+         speed = imperial ? 0.44704 : 1000.0 / SECS_IN_HOUR, v;
+  const char *d_unit = imperial ? "mi" : "km", *h_unit = imperial ? "ft" : "m",
+             *s_unit = imperial ? "mph" : "km/h";
+
+  printf("%s\n", name);
+  print_duration("Elapsed:", s->elapsed);
+  print_duration("Moving:", s->moving);
+  if (s->point[Maximum].data[Distance] != -DBL_MAX) {
+    printf("  %-12s%.2f %s\n", "Distance:",
+           (s->point[Maximum].data[Distance] -
+            s->point[Minimum].data[Distance]) / distance,
+           d_unit);
+  }
+  if (s->point[Maximum].data[Speed] != -DBL_MAX) {
+    printf("  %-12s%.1f %s (max %.1f)\n", "Speed:",
+           s->point[Average].data[Speed] / speed, s_unit,
+           s->point[Maximum].data[Speed] / speed);
+  }
+  if (s->point[Maximum].data[Altitude] != -DBL_MAX) {
+    printf("  %-12s%.0f %s (descent %.0f)\n", "Ascent:", s->ascent / height,
+           h_unit, s->descent / height);
+  }
+  if (s->point[Maximum].data[HeartRate] != -DBL_MAX) {
+    printf("  %-12s%.0f bpm (max %.0f)\n", "Heart rate:",
+           s->point[Average].data[HeartRate],
+           s->point[Maximum].data[HeartRate]);
+    if (!zones_heart_rate(&z, athlete)) print_zones("HR zones:", a, &z);
+  }
+  if (s->point[Maximum].data[Power] != -DBL_MAX) {
+    printf("  %-12s%.0f W (max %.0f)\n", "Power:",
+           s->point[Average].data[Power], s->point[Maximum].data[Power]);
+    if (SET(s->normalized_power)) {
+      printf("  %-12s%.0f W\n", "NP:", s->normalized_power);
+    }
+    if (SET(v = athlete_intensity_factor(athlete, s))) {
+      printf("  %-12s%.2f\n", "IF:", v);
+      printf("  %-12s%.0f\n", "TSS:", athlete_tss(athlete, s));
+    }
+    if (SET(v = athlete_watts_per_kg(athlete, s))) {
+      printf("  %-12s%.2f\n", "W/kg:", v);
+    }
+    printf("  %-12s%.0f kJ\n", "Work:", s->work);
+    if (!zones_power(&z, athlete)) print_zones("Power zones:", a, &z);
+  }
+  if (SET(v = athlete_calories(athlete, s))) {
+    printf("  %-12s%.0f kcal\n", "Calories:", v);
+  }
+}
+
+/**
+ * print_laps
+ *
+ * Description:
+ *  Print a line of summary data for each lap of the `Activity`.
+ */
+static void print_laps(const char *name, Activity *a, Athlete *athlete) {
+  Summary *s;
+  bool imperial = athlete->units == Imperial;
+  double distance = imperial ? 1609.344 : 1000,
+         speed = imperial ? 0.44704 : 1000.0 / SECS_IN_HOUR;
+  unsigned long t;
+  size_t i;
+
+  printf("%s\n", name);
+  if (!a->lap_summaries) return;
+
+  printf("  %-4s %-9s %-9s %-7s %-5s %-5s %-5s\n", "Lap", "Time",
+         imperial ? "Miles" : "Km", imperial ? "Mph" : "Km/h", "HR", "Power",
+         "NP");
+  for (i = 0; i < a->laps.size; i++) {
+    s = &(a->lap_summaries[i]);
+    t = (unsigned long)s->elapsed;
+    printf("  %-4lu %lu:%02lu:%02lu   ", (unsigned long)i + 1, t / SECS_IN_HOUR,
+           t / 60 % 60, t % 60);
+    if (s->point[Maximum].data[Distance] != -DBL_MAX) {
+      printf("%-9.2f ", (s->point[Maximum].data[Distance] -
+                         s->point[Minimum].data[Distance]) / distance);
+    } else {
+      printf("%-9s ", "-");
+    }
+    if (s->point[Maximum].data[Speed] != -DBL_MAX) {
+      printf("%-7.1f ", s->point[Average].data[Speed] / speed);
+    } else {
+      printf("%-7s ", "-");
+    }
+    if (s->point[Maximum].data[HeartRate] != -DBL_MAX) {
+      printf("%-5.0f ", s->point[Average].data[HeartRate]);
+    } else {
+      printf("%-5s ", "-");
+    }
+    if (s->point[Maximum].data[Power] != -DBL_MAX) {
+      printf("%-5.0f ", s->point[Average].data[Power]);
+    } else {
+      printf("%-5s ", "-");
+    }
+    if (SET(s->normalized_power)) {
+      printf("%.0f\n", s->normalized_power);
+    } else {
+      printf("-\n");
+    }
+  }
+}
+
+/**
+ * part_name
+ *
+ * Description:
+ *  Derive the name of the file to write part `part` of a split to, eg.
+ *  "ride-2.gpx" for "ride.gpx".
+ *
+ * Return value:
+ *  NULL - unable to allocate the name.
+ *  valid pointer - the name of the part. The caller must free it.
+ */
+static char *part_name(const char *output, unsigned part) {
+  char *name;
+  const char *ext = strrchr(output, '.'), *dir = strrchr(output, '/');
+  size_t len;
+
+  if (!ext || (dir && dir > ext)) ext = output + strlen(output);
+  len = (size_t)(ext - output);
+  if (!(name = malloc(len + strlen(ext) + 12))) return NULL;
+  memcpy(name, output, len);
+  sprintf(name + len, "-%u%s", part, ext);
+  return name;
+}
+
+/**
+ * output_activity
+ *
+ * Description:
+ *  Print the summaries of the `Activity` or write it out, depending on the
+ *  options. `part` is the number of the part of a split, or 0.
+ */
+static int output_activity(Options *options, const char *name, Activity *a,
+                           Athlete *athlete, unsigned part) {
+  char label[256], *filename;
+  int err;
+
+  if (options->summary || options->laps) {
+    if (part) {
+      snprintf(label, sizeof(label), "%s (part %u)", name, part);
+      name = label;
+    }
+    if (options->summary) print_summary(name, a, athlete);
+    if (options->laps) print_laps(name, a, athlete);
+    return 0;
+  }
+
+  if (!options->output || !*(options->output)) {
+    /* no output file name, output to stdout */
+    return fitparse_write_format_file(stdout, options->format, a);
+  }
+
+  filename = options->output;
+  if (part && !(filename = part_name(options->output, part))) return 1;
+  if (options->format != UnknownFileFormat) {
+    err = fitparse_write_format(filename, options->format, a);
+  } else {
+    err = fitparse_write(filename, a);
+  }
+  if (err) fprintf(stderr, "Error writing file %s\n", filename);
+  if (part) free(filename);
+  return err;
+}
+
+/**
+ * run_activity
+ *
+ * Description:
+ *  Crop, split and resample the `Activity` as asked for and output the
+ *  result. Cropping and splitting work on views of the points of `a`, so
+ *  nothing is copied for them.
+ */
+static int run_activity(Options *options, const char *name, Activity *a,
+                        Athlete *athlete) {
+  Activity *cropped = NULL, *resampled = NULL, *part, **parts = NULL;
+  size_t k, n = 1;
+  int err = 0;
+
+  if (options->crop) {
+    if (!(cropped = fitparse_crop(a, a->start_time + options->crop_from,
+                                  a->start_time + options->crop_to))) {
+      fprintf(stderr, "Unable to crop %s\n", name);
+      return 1;
+    }
+    a = cropped;
+  }
+
+  if (options->split && !(parts = fitparse_split(a, options->split_gap, &n))) {
+    fprintf(stderr, "Unable to split %s\n", name);
+    err = 1;
+    n = 0;
+  }
+
+  for (k = 0; !err && k < n; k++) {
+    part = parts ? parts[k] : a;
+    /* resample each part so the gaps between them aren't filled */
+    if (options->resample &&
+        !(part = resampled = resample_activity(part, options->interval))) {
+      fprintf(stderr, "Unable to resample %s\n", name);
+      err = 1;
+      break;
+    }
+    err = output_activity(options, name, part, athlete,
+                          parts ? (unsigned)k + 1 : 0);
+    if (resampled) activity_destroy(resampled);
+    resampled = NULL;
+  }
+
+  if (parts) {
+    for (k = 0; k < n; k++) activity_destroy(parts[k]);
+    free(parts);
+  }
+  if (cropped) activity_destroy(cropped);
+  return err;
+}
+
 static int run(Options *options) {
-  unsigned i, j;
-  Activity **activities;
-  Activity *a;
+  unsigned i, j, count;
+  Activity **activities, *merged = NULL;
+  Athlete athlete = DEFAULT_ATHLETE;
+  const char *name;
+  int err = 0;
+
+  /* ignore output flags, just rename files */
+  if (options->input_count > 1 && !options->merge && !options->summary &&
+      !options->laps)
+    return run_batch(options);
 
-  if (!(activities = malloc(sizeof(*activities) * (options->input_count || 1))))
+  if (!(activities = malloc(sizeof(*activities) *
+                            (options->input_count ? options->input_count : 1))))
     return 1;
 
   if (!options->input_count) { /* no input files, read from stdin */
     if (!(activities[0] = fitparse_read_file(stdin))) {
+      free(activities);
       return 1;
     }
     options->input_count = 1;
@@ -102,31 +426,43 @@ static int run(Options *options) {
       if (!(activities[i] = fitparse_read(options->input[i]))) {
         fprintf(stderr, "Error reading file %s\n", options->input[i]);
         for (j = 0; j < i; j++) activity_destroy(activities[j]);
+        free(activities);
         return 1;
       }
     }
   }
 
-  if (options->input_count > 1) { /* ignore output flags, just rename files */
-    for (i = 0; i < options->input_count; i++) {
-      /* TODO rename change_extension crap */
-      /*if (options->format) */
-      /*fitparse_write_format_file(name, options->format, activities[0]);*/
-      activity_destroy(activities[i]);
-    }
-  } else if (*(options->output)) {
-    if (options->format != UnknownFileFormat) {
-      fitparse_write_format(options->output, options->format, activities[0]);
-    } else {
-      fitparse_write(options->output, activities[0]);
+  count = options->input_count;
+  if (options->merge && count > 1) {
+    merged = fitparse_merge(activities, count);
+    for (i = 0; i < count; i++) activity_destroy(activities[i]);
+    if (!merged) {
+      fprintf(stderr, "Error merging files\n");
+      free(activities);
+      return 1;
     }
-    activity_destroy(activities[0]);
-  } else { /* no output file name, output to stdout */
-    fitparse_write_format_file(stdout, options->format, activities[0]);
-    activity_destroy(activities[0]);
+    activities[0] = merged;
+    count = 1;
   }
 
-  return 0;
+  for (i = 0; options->fixes && i < count; i++) {
+    if (fix_activity(activities[i], options->fixes) < 0) err = 1;
+  }
+
+  athlete.gender = options->gender;
+  athlete.units = options->units;
+  athlete.ftp = options->ftp;
+  athlete.hr_max = options->hr;
+  athlete.weight = options->weight;
+  athlete.age = options->age;
+  for (i = 0; i < count; i++) {
+    name = merged ? "merged" : options->input ? options->input[i] : "stdin";
+    err = run_activity(options, name, activities[i], &athlete) || err;
+    activity_destroy(activities[i]);
+  }
+
+  free(activities);
+  return err;
 }
 
 int main(int argc, char *argv[]) {
@@ -149,12 +485,15 @@ int main(int argc, char *argv[]) {
       {"merge", no_argument, &options.merge, true},
       {"split", required_argument, &options.split, true},
       {"crop", required_argument, &options.crop, true},
+      {"resample", required_argument, &options.resample, true},
       {"format", required_argument, NULL, 0},
       {"fix", required_argument, NULL, 0},
       {"gender", required_argument, NULL, 0},
       {"units", required_argument, NULL, 0},
       {"hr", required_argument, NULL, 0},
       {"ftp", required_argument, NULL, 0},
+      {"weight", required_argument, NULL, 0},
+      {"age", required_argument, NULL, 0},
       {0, 0, 0, 0}};
 
   while ((c = getopt_long(argc, argv, "vho:c:", longopts, &longindex)) != -1) {
@@ -169,7 +508,10 @@ int main(int argc, char *argv[]) {
         }
         if (!strcmp("fix", longopts[longindex].name)) {
           downcase(optarg);
-          /* TODO */
+          if (parse_fixes(optarg, &(options.fixes))) {
+            fprintf(stderr, "Unknown fix: %s\n", optarg);
+            goto usage;
+          }
         }
         if (!strcmp("gender", longopts[longindex].name)) {
           options.gender = (tolower(*optarg) == 'f') ? Female : Male;
@@ -191,11 +533,41 @@ int main(int argc, char *argv[]) {
             goto usage;
           }
         }
+        if (!strcmp("weight", longopts[longindex].name)) {
+          options.weight = strtod(optarg, &end);
+          if (*end || options.weight < 0) {
+            fprintf(stderr, "Invalid argument for weight: %s\n", optarg);
+            goto usage;
+          }
+        }
+        if (!strcmp("age", longopts[longindex].name)) {
+          options.age = (unsigned)strtoul(optarg, &end, 10);
+          if (*end) {
+            fprintf(stderr, "Invalid argument for age: %s\n", optarg);
+            goto usage;
+          }
+        }
         if (!strcmp("split", longopts[longindex].name)) {
-          /* TODO */
+          options.split_gap = strtod(optarg, &end);
+          if (*end || options.split_gap <= 0) {
+            fprintf(stderr, "Invalid argument for split: %s\n", optarg);
+            goto usage;
+          }
+        }
+        if (!strcmp("resample", longopts[longindex].name)) {
+          options.interval = strtod(optarg, &end);
+          if (*end || options.interval <= 0) {
+            fprintf(stderr, "Invalid argument for resample: %s\n", optarg);
+            goto usage;
+          }
         }
         if (!strcmp("crop", longopts[longindex].name)) {
-          /* TODO */
+          options.crop_from = strtod(optarg, &end);
+          if (*end == ',') options.crop_to = strtod(end + 1, &end);
+          if (*end || options.crop_to <= options.crop_from) {
+            fprintf(stderr, "Invalid argument for crop: %s\n", optarg);
+            goto usage;
+          }
         }
         break;
       case 'v':
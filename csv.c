@@ -16,23 +16,14 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "csv.h"
 #include "util.h"
 
-/**
- * DATA_FIELDS
- *
- * Description:
- *  Mapping from `DataField` to field name string.
- */
-static const char *DATA_FIELDS[DataFieldCount] = {
-    "timestamp",  "latitude", "longitude",  "altitude",
-    "distance",   "speed",    "power",      "grade",
-    "heart_rate", "cadence",  "lr_balance", "temperature"};
-
 /**
  * name_to_field
  *
@@ -145,10 +136,118 @@ static int read_csv_header(FILE *f, DataField data_fields[]) {
   return count;
 }
 
+/**
+ * read_csv_line
+ *
+ * Description:
+ *  Parse a single line of CSV data into `dp` using the `DataField` mapping
+ *  built by `read_csv_header`.
+ *
+ * Parameters:
+ *  line - a NUL terminated line of CSV without its newline.
+ *  data_fields - the array built by `read_csv_headers` mapping CSV field to
+ *                `DataField`.
+ *  count - the number of `DataField`s in `data_fields`.
+ *  dp - the `DataPoint` to fill in. Fields not in the line are left as is.
+ */
+static void read_csv_line(char *line, DataField data_fields[], unsigned count,
+                          DataPoint *dp) {
+  char *comma, *last;
+  unsigned i, j;
+
+  for (i = 0, j = 0, last = line, comma = strchr(line, ',');
+       j < count && i < CSV_MAX_FIELDS && comma;
+       comma = strchr(last, ','), i++) {
+
+    if (data_fields[i] != DataFieldCount) {
+      /* terminate the field in place, the line is ours to modify */
+      *comma = '\0';
+      parse_field(data_fields[i], dp, last);
+      j++;
+    }
+
+    last = comma + 1;
+  }
+  /* grab the last field (no trailing comma) */
+  if (j < count && i < CSV_MAX_FIELDS && data_fields[i] != DataFieldCount) {
+    parse_field(data_fields[i], dp, last);
+  }
+}
+
+/**
+ * Chunk
+ *
+ * Description:
+ *  A run of complete lines of CSV data and the points parsed from them.
+ *
+ * Fields:
+ *  start - the first character of the chunk.
+ *  end - one past the last character of the chunk.
+ *  data_fields - the mapping from CSV field to `DataField`.
+ *  count - the number of `DataField`s in `data_fields`.
+ *  points - the points parsed from the chunk, in order.
+ *  num_points - the number of points in `points`.
+ *  points_alloc - the number of points allocated for `points`.
+ *  err - set if we ran out of memory parsing the chunk.
+ */
+typedef struct {
+  char *start, *end;
+  DataField *data_fields;
+  unsigned count;
+  DataPoint *points;
+  size_t num_points;
+  size_t points_alloc;
+  int err;
+} Chunk;
+
+/**
+ * read_csv_chunk
+ *
+ * Description:
+ *  Parse every line in the `Chunk` into its point buffer. Rows are
+ *  independent once the header is known, so chunks can be parsed on
+ *  separate threads and stitched back together afterwards.
+ *
+ * Parameters:
+ *  data - a pointer to the `Chunk` to parse.
+ */
+static void *read_csv_chunk(void *data) {
+  Chunk *c = (Chunk *)data;
+  char *line, *nl;
+  size_t len;
+
+  for (line = c->start; line < c->end; line = nl + 1) {
+    if (!(nl = memchr(line, '\n', c->end - line))) nl = c->end;
+    *nl = '\0';
+
+    /* strip carriage returns and skip blank lines */
+    len = nl - line;
+    if (len && line[len - 1] == '\r') line[--len] = '\0';
+    if (!len) continue;
+
+    ALLOC_GROW(c->points, c->num_points + 1, c->points_alloc);
+    if (!c->points) {
+      c->err = 1;
+      return NULL;
+    }
+
+    unset_data_point(&(c->points[c->num_points]));
+    read_csv_line(line, c->data_fields, c->count,
+                  &(c->points[c->num_points]));
+    c->num_points++;
+  }
+
+  return NULL;
+}
+
 /**
  * read_csv_data
  *
  * Description:
+ *  Read in the data points of the CSV following the header. Large inputs are
+ *  split at newline boundaries into chunks which are parsed in parallel and
+ *  then appended to the `Activity` in order. The caller must finalize the
+ *  `Activity` afterwards.
  *
  * Parameters:
  *  f - the file descriptor for the CSV file to read.
@@ -156,46 +255,76 @@ static int read_csv_header(FILE *f, DataField data_fields[]) {
  *                `DataField`.
  *  count - the number of `DataField`s in `data_fields`.
  *  a - the `Activity` to read the data into.
+ *
+ * Return value:
+ *  0 - successfully read the data.
+ *  1 - unable to read the data.
  */
-static void read_csv_data(FILE *f, DataField data_fields[], unsigned count,
-                          Activity *a) {
-  char buf[CSV_BUFSIZ], *comma, *last, field_str[CSV_FIELD_SIZE];
-  unsigned i, j;
-  DataPoint dp;
-
-  /* initialize */
-  unset_data_point(&dp);
-
-  /* read in data points */
-  while (fgets(buf, sizeof(buf), f)) {
-    for (i = 0, j = 0, last = buf, comma = strchr(buf, ',');
-         j < count && i < CSV_MAX_FIELDS && comma;
-         comma = strchr(last, ','), i++) {
-
-      if (data_fields[i] != DataFieldCount) {
-        strncpy(field_str, last, comma - last);
-        field_str[comma - last] = '\0';
-        parse_field(data_fields[i], &dp, field_str);
-        memset(field_str, '\0', CSV_FIELD_SIZE);
-        j++;
-      }
+static int read_csv_data(FILE *f, DataField data_fields[], unsigned count,
+                         Activity *a) {
+  Chunk *chunks;
+  pthread_t *threads;
+  char *buf, *split;
+  size_t len, i, j, spawned, n = 1;
+  int err = 0;
 
-      last = comma + 1;
+  if (!(buf = read_all(f, &len))) return 1;
+
+  if (len >= CSV_PARALLEL_SIZE) {
+    n = len / CSV_CHUNK_SIZE;
+    if (n > online_cpus()) n = online_cpus();
+  }
+
+  if (!(chunks = calloc(n, sizeof(*chunks))) ||
+      !(threads = malloc(n * sizeof(*threads)))) {
+    if (chunks) free(chunks);
+    free(buf);
+    return 1;
+  }
+
+  /* split evenly, then push each boundary forward past the next newline */
+  for (i = 0, split = buf; i < n; i++) {
+    chunks[i].start = split;
+    if (i == n - 1) {
+      split = buf + len;
+    } else {
+      split = buf + (i + 1) * (len / n);
+      if (split < chunks[i].start) split = chunks[i].start;
+      if (!(split = memchr(split, '\n', buf + len - split))) {
+        split = buf + len;
+      } else {
+        split++;
+      }
     }
-    /* strip newline */
-    if ((comma = strrchr(last, '\n')) != NULL) *comma = '\0';
-    /* grab the last header field (no trailing comma) */
-    if (j < count && i < CSV_MAX_FIELDS && data_fields[i] != DataFieldCount) {
-      strncpy(field_str, last, comma - last);
-      field_str[comma - last] = '\0';
-      parse_field(data_fields[i], &dp, field_str);
-      memset(field_str, '\0', CSV_FIELD_SIZE);
+    chunks[i].end = split;
+    chunks[i].data_fields = data_fields;
+    chunks[i].count = count;
+  }
+
+  if (n == 1) {
+    read_csv_chunk(&chunks[0]);
+  } else {
+    for (i = 0; i < n; i++) {
+      if (pthread_create(&threads[i], NULL, read_csv_chunk, &chunks[i])) break;
     }
+    /* if we couldn't start a thread parse the remaining chunks ourselves */
+    for (spawned = i; i < n; i++) read_csv_chunk(&chunks[i]);
+    for (i = 0; i < spawned; i++) pthread_join(threads[i], NULL);
+  }
 
-    activity_add_point(a, &dp);
-    unset_data_point(&dp);
-    memset(buf, '\0', CSV_BUFSIZ);
+  /* stitch the chunks back together in order */
+  for (i = 0; i < n; i++) {
+    err |= chunks[i].err;
+    for (j = 0; !err && j < chunks[i].num_points; j++) {
+      err |= activity_append_point(a, &(chunks[i].points[j]));
+    }
+    if (chunks[i].points) free(chunks[i].points);
   }
+
+  free(threads);
+  free(chunks);
+  free(buf);
+  return err;
 }
 
 /**
@@ -217,12 +346,17 @@ static void read_csv_data(FILE *f, DataField data_fields[], unsigned count,
 Activity *csv_read(FILE *f) {
   DataField data_fields[CSV_MAX_FIELDS];
   Activity *a;
-  unsigned count;
+  unsigned i, count;
 
+  for (i = 0; i < CSV_MAX_FIELDS; i++) data_fields[i] = DataFieldCount;
   if (!(count = read_csv_header(f, data_fields))) return NULL;
 
-  a = activity_new();
-  read_csv_data(f, data_fields, count, a);
+  if (!(a = activity_new())) return NULL;
+  if (read_csv_data(f, data_fields, count, a)) {
+    activity_destroy(a);
+    return NULL;
+  }
+  activity_finalize(a);
   a->format = CSV;
 
   return a;
@@ -247,12 +381,12 @@ Activity *csv_read(FILE *f) {
 static void write_field(FILE *f, const char *format, size_t i, DataField field,
                         Activity *a, CSVOptions *o, bool *first) {
   double d = a->data_points[i].data[field];
-  if (!o->remove_unset || a->last[field]) {
+  if (!o->remove_unset || a->last_set[field]) {
     if (!*first) {
       fprintf(f, ",");
     }
     if (!SET(d)) {
-      fprintf(f, "%s", o.unset_value);
+      fprintf(f, "%s", o->unset_value);
     } else {
       fprintf(f, format, d);
     }
@@ -278,12 +412,18 @@ static void write_field(FILE *f, const char *format, size_t i, DataField field,
 int csv_write_options(FILE *f, Activity *a, CSVOptions *o) {
   unsigned i;
   bool first = true;
+  unsigned char *keep = NULL;
 
   assert(a != NULL);
 
+  if (o->simplify > 0) {
+    if (!(keep = malloc(a->num_points))) return 1;
+    activity_simplify(a, o->simplify, keep);
+  }
+
   /* print header */
   for (i = 0; i < DataFieldCount; i++) {
-    if (!o.remove_unset || a->last[i]) {
+    if (!o->remove_unset || a->last_set[i]) {
       if (first) {
         fprintf(f, "%s", DATA_FIELDS[i]);
         first = false;
@@ -296,6 +436,7 @@ int csv_write_options(FILE *f, Activity *a, CSVOptions *o) {
 
   /* print data points - must be at least one non empty */
   for (i = 0, first = true; i < a->num_points; i++, first = true) {
+    if (keep && !keep[i]) continue;
     write_field(f, "%.0f", i, Timestamp, a, o, &first);
     write_field(f, "%.7f", i, Latitude, a, o, &first);
     write_field(f, "%.7f", i, Longitude, a, o, &first);
@@ -311,5 +452,6 @@ int csv_write_options(FILE *f, Activity *a, CSVOptions *o) {
     fprintf(f, "\n");
   }
 
+  if (keep) free(keep);
   return 0;
 }
@@ -21,10 +21,13 @@
 #include "activity.h"
 
 #define DEFAULT_CSV_OPTIONS \
-  { false, "NA" }
+  { false, "NA", 0 }
 #define CSV_BUFSIZ 4096
 #define CSV_FIELD_SIZE 32
 #define CSV_MAX_FIELDS 1024
+/* inputs at least this large are split into chunks parsed in parallel */
+#define CSV_PARALLEL_SIZE (1 << 20)
+#define CSV_CHUNK_SIZE (256 << 10)
 
 /**
  * CSVOptions
@@ -35,10 +38,13 @@
  * Fields:
  *  remove_unset - whether or not to write unset fields.
  *  unset_value - the string to use to denote an unset field.
+ *  simplify - if positive, only write the points needed to keep the track
+ *             within this many meters, see `activity_simplify`.
  */
 typedef struct {
   bool remove_unset;
   char *unset_value;
+  double simplify;
   /* TODO Something Lap related? */
 } CSVOptions;
 
@@ -61,7 +67,7 @@ int csv_write_options(FILE *f, Activity *a, CSVOptions *o);
  *  1 - unable to write CSV.
  */
 static inline int csv_write(FILE *f, Activity *a) {
-  CSVOptions &options = DEFAULT_CSV_OPTIONS;
+  CSVOptions o = DEFAULT_CSV_OPTIONS;
   return csv_write_options(f, a, &o);
 }
 
@@ -15,6 +15,7 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -99,3 +100,250 @@ int fitparse_write_format_file(FILE *f, FileFormat format, Activity *a) {
   if (format == UnknownFileFormat) format = DEFAULT_WRITE_FORMAT;
   return writers[format](f, a);
 }
+
+/**
+ * MergeCursor
+ *
+ * Description:
+ *  The next point to be merged from one of the activities.
+ *
+ * Fields:
+ *  timestamp - the time of the point, or of the last point before it with a
+ *              timestamp so that points without one stay where they are.
+ *  activity - the index of the activity the point is from.
+ *  point - the index of the point.
+ */
+typedef struct {
+  double timestamp;
+  size_t activity, point;
+} MergeCursor;
+
+/* ties go to the activity given first so that its fields win when fused */
+static bool cursor_before(MergeCursor *x, MergeCursor *y) {
+  return x->timestamp < y->timestamp ||
+         (x->timestamp == y->timestamp && x->activity < y->activity);
+}
+
+static void sift_down(MergeCursor *heap, size_t size, size_t i) {
+  MergeCursor c = heap[i];
+  size_t child;
+
+  while ((child = 2 * i + 1) < size) {
+    if (child + 1 < size && cursor_before(&heap[child + 1], &heap[child]))
+      child++;
+    if (!cursor_before(&heap[child], &c)) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = c;
+}
+
+static double cursor_time(Activity *a, size_t point, double prev) {
+  double ts = a->data_points[point].data[Timestamp];
+  return SET(ts) ? ts : prev;
+}
+
+/* the point with anything `a` derived for it unset, since the distances of
+ * different activities don't line up and are derived again once merged */
+static void underived_point(Activity *a, DataPoint *dp, DataPoint *copy) {
+  const DataField derived[] = {Distance, Speed, Grade};
+  size_t i;
+
+  *copy = *dp;
+  for (i = 0; i < ARRAY_SIZE(derived); i++) {
+    if (a->derived & (1u << derived[i])) copy->data[derived[i]] = UNSET_FIELD;
+  }
+}
+
+/* carry the lap or break starting at `point` over to the merged `index` */
+static int map_starts(Vector *from, size_t *next, size_t point, Vector *to,
+                      size_t index) {
+  if (*next >= from->size || from->data[*next] > point) return 0;
+  while (*next < from->size && from->data[*next] <= point) (*next)++;
+  if (to->size && to->data[to->size - 1] == index) return 0;
+  return vector_add(to, (uint32_t)index);
+}
+
+/**
+ * fitparse_merge
+ *
+ * Description:
+ *  Merge the points of several activities recorded at the same time, eg. a
+ *  GPS head unit and a separate heart rate strap, into a new `Activity` in
+ *  timestamp order. The activities are merged with a heap in
+ *  O(total log n) time into a single allocation. Points which share a
+ *  timestamp are fused into one, with the activities given first winning
+ *  any fields they both have. The distance, speed and grade each activity
+ *  derived are left out, to be derived again over the merged points. The
+ *  laps and breaks are taken from the first activity, apart from the breaks
+ *  found by pause detection, which are found again over the merged points.
+ *  None of the activities are modified.
+ *
+ * Parameters:
+ *  activities - the activities to merge.
+ *  n - the number of activities.
+ *
+ * Return value:
+ *  NULL - there were no activities or we were unable to merge them.
+ *  valid pointer - the merged `Activity`, which must be free'd with a call
+ *                  to `activity_destroy`.
+ */
+Activity *fitparse_merge(Activity **activities, size_t n) {
+  Activity *merged, *a;
+  MergeCursor *heap, *top;
+  DataPoint dp, *last;
+  DataField f;
+  Vector breaks = {0};
+  size_t i, index, size = 0, total = 0, lap = 0, brk = 0;
+
+  assert(activities != NULL);
+
+  if (!n || !(heap = malloc(n * sizeof(*heap)))) return NULL;
+  if (!(merged = activity_new())) {
+    free(heap);
+    return NULL;
+  }
+  if (activity_recorded_breaks(activities[0], &breaks)) goto error;
+  merged->sport = activities[0]->sport;
+  merged->format = activities[0]->format;
+
+  for (i = 0; i < n; i++) {
+    total += activities[i]->num_points;
+    if (!activities[i]->num_points) continue;
+    heap[size].timestamp = cursor_time(activities[i], 0, -DBL_MAX);
+    heap[size].activity = i;
+    heap[size].point = 0;
+    size++;
+  }
+  for (i = size / 2; i-- > 0;) sift_down(heap, size, i);
+  if (activity_reserve(merged, total)) goto error;
+
+  while (size) {
+    top = &heap[0];
+    a = activities[top->activity];
+    underived_point(a, &(a->data_points[top->point]), &dp);
+    last = merged->num_points
+               ? &(merged->data_points[merged->num_points - 1])
+               : NULL;
+
+    if (last && SET(dp.data[Timestamp]) &&
+        last->data[Timestamp] == dp.data[Timestamp]) {
+      for (f = 0; f < DataFieldCount; f++) {
+        last->data[f] = SET(last->data[f]) ? last->data[f] : dp.data[f];
+      }
+      index = merged->num_points - 1;
+    } else if (activity_ingest_point(merged, &dp, &index)) {
+      goto error;
+    }
+
+    /* a point which was dropped leaves its laps to the next one */
+    if (!top->activity && index < merged->num_points &&
+        (map_starts(&(a->laps), &lap, top->point, &(merged->laps), index) ||
+         map_starts(&breaks, &brk, top->point, &(merged->breaks), index)))
+      goto error;
+
+    if (++(top->point) < a->num_points) {
+      top->timestamp = cursor_time(a, top->point, top->timestamp);
+    } else {
+      *top = heap[--size];
+    }
+    if (size) sift_down(heap, size, 0);
+  }
+  free(heap);
+  vector_destroy(&breaks);
+
+  /* the first lap and segment also cover anything recorded before them */
+  if (merged->laps.size) merged->laps.data[0] = 0;
+  if (merged->breaks.size) merged->breaks.data[0] = 0;
+
+  activity_finalize(merged);
+  return merged;
+
+error:
+  free(heap);
+  vector_destroy(&breaks);
+  activity_destroy(merged);
+  return NULL;
+}
+
+/**
+ * fitparse_crop
+ *
+ * Description:
+ *  Crop the `Activity` to the points recorded from `from` up to (but not
+ *  including) `to`. The result is a view sharing the points of `a` (see
+ *  `activity_view`), so `a` must outlive it.
+ *
+ * Parameters:
+ *  a - the `Activity` to crop.
+ *  from - the timestamp to crop from.
+ *  to - the timestamp to crop to.
+ *
+ * Return value:
+ *  NULL - there are no points in the range or we were unable to crop.
+ *  valid pointer - the cropped view, which must be free'd with a call to
+ *                  `activity_destroy`.
+ */
+Activity *fitparse_crop(Activity *a, double from, double to) {
+  size_t start, end;
+
+  assert(a != NULL);
+
+  if (activity_range_by_time(a, from, to, &start, &end)) return NULL;
+  return activity_view(a, start, end);
+}
+
+/**
+ * fitparse_split
+ *
+ * Description:
+ *  Split the `Activity` wherever there is a gap of at least `gap` seconds
+ *  between points, eg. to split a multi-day tour into days. Each part is a
+ *  view sharing the points of `a` (see `activity_view`), so `a` must outlive
+ *  them.
+ *
+ * Parameters:
+ *  a - the `Activity` to split.
+ *  gap - the shortest gap in seconds to split at.
+ *  n - set to the number of parts.
+ *
+ * Return value:
+ *  NULL - there are no points or we were unable to split.
+ *  valid pointer - the `n` parts. Each must be free'd with a call to
+ *                  `activity_destroy` and the array with a call to `free`.
+ */
+Activity **fitparse_split(Activity *a, double gap, size_t *n) {
+  Activity **parts = NULL;
+  Vector starts = {0};
+  double ts, prev = UNSET_FIELD;
+  size_t j, k;
+
+  assert(a != NULL && n != NULL);
+
+  if (!a->num_points || vector_add(&starts, 0)) return NULL;
+  for (j = 0; j < a->num_points; j++) {
+    ts = a->data_points[j].data[Timestamp];
+    if (!SET(ts)) continue;
+    if (SET(prev) && ts - prev >= gap && vector_add(&starts, (uint32_t)j))
+      goto error;
+    prev = ts;
+  }
+  if (vector_add(&starts, (uint32_t)a->num_points)) goto error;
+
+  *n = starts.size - 1;
+  if (!(parts = malloc(*n * sizeof(*parts)))) goto error;
+  for (k = 0; k < *n; k++) {
+    if (!(parts[k] = activity_view(a, starts.data[k], starts.data[k + 1]))) {
+      while (k--) activity_destroy(parts[k]);
+      goto error;
+    }
+  }
+
+  vector_destroy(&starts);
+  return parts;
+
+error:
+  vector_destroy(&starts);
+  if (parts) free(parts);
+  return NULL;
+}
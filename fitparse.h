@@ -34,17 +34,14 @@ Activity *fitparse_read_format(char *filename, FileFormat format);
 Activity *fitparse_read_format_file(FILE *file, FileFormat format);
 int fitparse_write_format(char *filename, FileFormat format, Activity *a);
 int fitparse_write_format_file(FILE *file, FileFormat format, Activity *a);
+Activity *fitparse_merge(Activity **activities, size_t n);
+Activity *fitparse_crop(Activity *a, double from, double to);
+Activity **fitparse_split(Activity *a, double gap, size_t *n);
 
 /*
 //// TODO some things need athlete or options file...
 
 //[> TODO these will also change how much memory is needed <]
-//[> Creates new activity, doesnt erase old ones <]
-//Activity *fitparse_merge(Actvity *a, Activity *b);
-//[> Modifies old activity <]
-//int fitparse_crop(Activity *a, int *TODO);
-//[> Modifies old activity and returns new one <]
-//Activity *fitparse_split(Activity *a, int TODO);
 //[> Performs one or more fixes -> should use masks? <]
 //int fitparse_fix(Activity *a, Fix TODO);
 */
@@ -35,87 +35,504 @@
  *     51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
 
 #include "activity.h"
 #include "fix.h"
+#include "geo.h"
+#include "rolling.h"
+
+/* what a channel makes of a point, other than the `DataError` it has */
+#define FIX_VALID -1
+#define FIX_ABSENT -2
+
+/* scales the median absolute deviation to the standard deviation of normally
+ * distributed readings */
+#define MAD_SCALE 1.4826
+
+/**
+ * FixChannel
+ *
+ * Description:
+ *  The state of the fixes for one group of fields during the fused pass.
+ *  Invalid readings are replaced once the next valid one is seen, by
+ *  interpolating back over the points since the last valid reading while
+ *  they are still in cache.
+ *
+ *  Channels which look for spikes judge each reading against the median of
+ *  the `window` valid readings centered on it, so a reading can't be
+ *  stepped over until `window / 2` more valid readings have been seen. A
+ *  reading is a spike if it is more than `threshold` times the spread of the
+ *  readings (the rolling median absolute deviation, but no less than
+ *  `floor`) above the median. Only readings above the median count, since a
+ *  sudden drop in power is usually real, eg. freewheeling.
+ *
+ * Fields:
+ *  fields - the fields fixed together, eg. latitude and longitude.
+ *  count - the number of `fields`.
+ *  classify - returns the `DataError` of a point, `FIX_VALID` or
+ *             `FIX_ABSENT` if the point doesn't have the fields at all.
+ *  kinds - what `classify` or the spike detection made of each point.
+ *  next - the first point which hasn't been stepped over yet.
+ *  last - the last point with a valid reading, or `num_points` if none yet.
+ *  pending - whether there are invalid readings since `last`.
+ *  spike - the `DataError` of a spike, or `FIX_VALID` if the channel doesn't
+ *          look for them.
+ *  median - the median of the last `window` valid readings.
+ *  spread - the median of the deviations of the judged readings from their
+ *           median.
+ *  recent - the last `window` points with valid readings.
+ *  seen - the number of valid readings seen.
+ *  judged - the number of valid readings judged.
+ *  threshold - how many times the spread a spike is above the median.
+ *  floor - the smallest spread used, so flat readings aren't all spikes.
+ */
+typedef struct {
+  DataField fields[2];
+  unsigned count;
+  int (*classify)(DataPoint *dp, unsigned fixes);
+  signed char *kinds;
+  size_t next;
+  size_t last;
+  bool pending;
+  int spike;
+  RollingMedian *median, *spread;
+  size_t *recent;
+  size_t seen, judged;
+  double threshold, floor;
+} FixChannel;
+
+/**
+ * GPSFilter
+ *
+ * Description:
+ *  The state of the GPS outlier filter, which runs ahead of the channels in
+ *  the fused pass. Each point is judged once `FIX_GPS_LOOKAHEAD` points after
+ *  it have been seen, and fixed in place, so the GPS channel only ever sees
+ *  positions which have been moved back onto the track.
+ *
+ * Fields:
+ *  next - the first point which hasn't been judged yet.
+ *  anchor - the last point with a position which was accepted.
+ *  anchored - whether there is an `anchor` yet.
+ *  speed - the speed from the point before `anchor` to it, or `UNSET_FIELD`.
+ */
+typedef struct {
+  size_t next;
+  size_t anchor;
+  bool anchored;
+  double speed;
+} GPSFilter;
 
 /* Remove GPS errors and interpolate positional data where the GPS device
  * did not record any data, or the data that was recorded is invalid. */
+static int classify_gps(DataPoint *dp, unsigned fixes) {
+  double lat = dp->data[Latitude], lon = dp->data[Longitude];
+  (void)fixes;
 
-/* used to handle gaps in recording by inserting interpolated/zero samples to
- * ensure dataPoints are contiguous in time */
-int fix_invalid_gps(Activity *a) {
-  DataPoint dp, good;
-  double delta_latitude, delta_longitude;
-  int errors = 0, last_good = -1;
-  unsigned i, j;
+  return (lat >= -90 && lat <= 90 && lon >= -180 && lon <= 180 &&
+          (lat || lon))
+             ? FIX_VALID
+             : InvalidGPS;
+}
+
+static int classify_power(DataPoint *dp, unsigned fixes) {
+  double power = dp->data[Power];
+  (void)fixes;
 
-  assert(a != NULL);
+  if (!SET(power)) return FIX_ABSENT;
+  return (power >= 0 && power <= FIX_MAX_POWER) ? FIX_VALID : PowerSpikes;
+}
 
-  /* ignore files without GPS data */
-  if (!a->last[Latitude] || !a->last[Longitude]) return -1;
+static int classify_heart_rate(DataPoint *dp, unsigned fixes) {
+  double hr = dp->data[HeartRate];
 
-  for (i = 0; i < a->num_points; i++) {
-    dp = a->data_points[i];
-    /* is this one decent? */
-    if (!(dp.data[Latitude] >= -90 && dp.data[Latitude] <= 90 &&
-          dp.data[Longitude] >= -180 && dp.data[Longitude] <= 180))
-      continue;
+  if (!SET(hr)) return FIX_ABSENT;
+  if ((fixes & FIX(HeartRateSpikes)) && hr > FIX_MAX_HEART_RATE)
+    return HeartRateSpikes;
+  if ((fixes & FIX(HeartRateDropouts)) && hr < FIX_MIN_HEART_RATE)
+    return HeartRateDropouts;
+  return FIX_VALID;
+}
 
-    if (last_good != -1 && (unsigned)(last_good + 1) != i) {
-      good = a->data_points[last_good];
-
-      /* interpolate from last good to here then set last_good to here */
-      delta_latitude =
-          (dp.data[Latitude] - good.data[Latitude]) / (double)(i - last_good);
-      delta_longitude =
-          (dp.data[Longitude] - good.data[Latitude]) / (double)(i - last_good);
-
-      for (j = last_good + 1; j < i; j++) {
-        a->data_points[j].data[Latitude] =
-            good.data[Latitude] + ((j - last_good) * delta_latitude);
-        a->data_points[j].data[Longitude] =
-            good.data[Longitude] + ((j - last_good) * delta_longitude);
-        errors++;
-      }
+static void destroy_channel(FixChannel *c) {
+  if (c->kinds) free(c->kinds);
+  if (c->median) rolling_median_destroy(c->median);
+  if (c->spread) rolling_median_destroy(c->spread);
+  if (c->recent) free(c->recent);
+}
 
-    } else if (last_good == -1) {
-      /* fill to front */
-      for (j = 0; j < i; j++) {
-        a->data_points[j].data[Latitude] = dp.data[Latitude];
-        a->data_points[j].data[Longitude] = dp.data[Longitude];
-        errors++;
-      }
+/**
+ * init_channel
+ *
+ * Description:
+ *  Set up a channel for `a`. If `spike` is a `DataError` the channel also
+ *  looks for spikes in its first field with the settings in `o`.
+ *
+ * Return value:
+ *  0 - successfully set up the channel.
+ *  1 - unable to allocate the state for the channel.
+ */
+static int init_channel(FixChannel *c, Activity *a, DataField first,
+                        DataField second, unsigned count,
+                        int (*classify)(DataPoint *, unsigned), int spike,
+                        FixOptions *o, double floor) {
+  c->fields[0] = first;
+  c->fields[1] = second;
+  c->count = count;
+  c->classify = classify;
+  c->next = 0;
+  c->last = a->num_points;
+  c->pending = false;
+  c->spike = spike;
+  c->median = c->spread = NULL;
+  c->recent = NULL;
+  c->seen = c->judged = 0;
+  c->threshold = o->threshold;
+  c->floor = floor;
+
+  c->kinds = malloc(a->num_points * sizeof(*c->kinds));
+  if (spike != FIX_VALID) {
+    c->median = rolling_median_new(o->window);
+    c->spread = rolling_median_new(o->window);
+    c->recent = malloc(o->window * sizeof(*c->recent));
+  }
+
+  if ((a->num_points && !c->kinds) ||
+      (spike != FIX_VALID && (!c->median || !c->spread || !c->recent))) {
+    destroy_channel(c);
+    return 1;
+  }
+  return 0;
+}
+
+/* how far point `k` is between `from` and `to`, by time if we can */
+static double weight(Activity *a, size_t from, size_t k, size_t to) {
+  double t0 = a->data_points[from].data[Timestamp],
+         t = a->data_points[k].data[Timestamp],
+         t1 = a->data_points[to].data[Timestamp];
+
+  if (SET(t0) && SET(t) && SET(t1) && t1 > t0) return (t - t0) / (t1 - t0);
+  return (double)(k - from) / (double)(to - from);
+}
+
+/**
+ * fill_channel
+ *
+ * Description:
+ *  Replace the invalid readings between the valid readings at `from` and
+ *  `to`. Either may be `num_points`, in which case the readings at the start
+ *  or end are held at the nearest valid reading instead.
+ *
+ * Return value:
+ *  The number of points fixed.
+ */
+static int fill_channel(FixChannel *c, Activity *a, size_t from, size_t to) {
+  DataPoint *dp;
+  double w, v0, v1;
+  size_t k, n = a->num_points;
+  unsigned f;
+  int e, errors = 0;
+
+  for (k = from < n ? from + 1 : 0; k < to; k++) {
+    dp = &(a->data_points[k]);
+    if ((e = c->kinds[k]) < 0) continue;
+    w = (from < n && to < n) ? weight(a, from, k, to) : 0;
+    for (f = 0; f < c->count; f++) {
+      v0 = a->data_points[from < n ? from : to].data[c->fields[f]];
+      v1 = a->data_points[to < n ? to : from].data[c->fields[f]];
+      dp->data[c->fields[f]] = v0 + w * (v1 - v0);
+    }
+    a->errors[e]++;
+    errors++;
+  }
+  return errors;
+}
+
+/* step over the points before `end`, whose kinds are all final */
+static int channel_step(FixChannel *c, Activity *a, size_t end) {
+  int errors = 0;
+
+  for (; c->next < end; c->next++) {
+    if (c->kinds[c->next] == FIX_ABSENT) continue;
+    if (c->kinds[c->next] != FIX_VALID) {
+      c->pending = true;
+      continue;
     }
 
-    last_good = i;
+    if (c->pending) errors += fill_channel(c, a, c->last, c->next);
+    c->pending = false;
+    c->last = c->next;
   }
+  return errors;
+}
+
+/* judge the next valid reading against the median of the window */
+static void judge_reading(FixChannel *c, Activity *a) {
+  size_t k = c->recent[c->judged++ % c->median->window];
+  double d, spread;
+
+  d = a->data_points[k].data[c->fields[0]] - rolling_median(c->median);
+  spread = rolling_median(c->spread);
+  spread = SET(spread) ? MAD_SCALE * spread : 0;
+  spread = spread > c->floor ? spread : c->floor;
+
+  if (d > c->threshold * spread) c->kinds[k] = c->spike;
+  rolling_median_add(c->spread, fabs(d));
+}
+
+static int channel_add(FixChannel *c, Activity *a, size_t j, unsigned fixes) {
+  size_t w, half;
+
+  c->kinds[j] = c->classify(&(a->data_points[j]), fixes);
+  if (!c->median) return channel_step(c, a, j + 1);
 
+  w = c->median->window;
+  half = w / 2;
+  if (c->kinds[j] == FIX_VALID) {
+    c->recent[c->seen++ % w] = j;
+    rolling_median_add(c->median, a->data_points[j].data[c->fields[0]]);
+    /* the first readings are judged against the first full window */
+    while (c->seen >= w && c->judged + half < c->seen) judge_reading(c, a);
+  }
+
+  return channel_step(c, a,
+                      c->judged < c->seen ? c->recent[c->judged % w] : j + 1);
+}
+
+static int channel_finish(FixChannel *c, Activity *a) {
+  int errors;
+
+  while (c->median && c->judged < c->seen) judge_reading(c, a);
+  errors = channel_step(c, a, a->num_points);
   /* fill to end... */
-  if (last_good != -1 && (unsigned)last_good != (a->num_points - 1)) {
-    good = a->data_points[last_good];
-    /* fill from last_good to end with last_good */
-    for (j = last_good + 1; j < a->num_points; j++) {
-      a->data_points[j].data[Latitude] = good.data[Latitude];
-      a->data_points[j].data[Longitude] = good.data[Longitude];
-      errors++;
-    }
+  if (c->pending && c->last < a->num_points) {
+    errors += fill_channel(c, a, c->last, a->num_points);
+  }
+  return errors;
+}
+
+/**
+ * gps_filter_init
+ *
+ * Description:
+ *  Start filtering the points of an `Activity`.
+ *
+ * Parameters:
+ *  f - the `GPSFilter` to initialize.
+ */
+static void gps_filter_init(GPSFilter *f) {
+  f->next = 0;
+  f->anchor = 0;
+  f->anchored = false;
+  f->speed = UNSET_FIELD;
+}
+
+/* the speed needed to get from point `i` to point `j`, or `UNSET_FIELD` if
+ * either of them is missing a position or time */
+static double implied_speed(Activity *a, size_t i, size_t j) {
+  DataPoint *p = &(a->data_points[i]), *q = &(a->data_points[j]);
+  double dt;
+
+  if (classify_gps(q, 0) != FIX_VALID || !SET(p->data[Timestamp]) ||
+      !SET(q->data[Timestamp]) ||
+      (dt = q->data[Timestamp] - p->data[Timestamp]) <= 0)
+    return UNSET_FIELD;
+  return geo_distance(p->data[Latitude], p->data[Longitude],
+                      q->data[Latitude], q->data[Longitude]) /
+         dt;
+}
+
+/* whether moving at `v` after `f->speed`, `dt` seconds after the anchor, is
+ * something a real activity could do */
+static bool plausible(GPSFilter *f, double v, double dt) {
+  return v <= FIX_MAX_SPEED &&
+         (!SET(f->speed) || fabs(v - f->speed) / dt <= FIX_MAX_ACCELERATION);
+}
+
+/**
+ * judge_point
+ *
+ * Description:
+ *  Decide whether the position of point `j` is plausible given the last
+ *  accepted position. An implausible jump is only treated as an outlier if a
+ *  later point within the lookahead agrees with the accepted position, in
+ *  which case it is moved onto the line between them. Otherwise the track
+ *  really did jump, eg. the GPS reacquired after a tunnel, and the point is
+ *  accepted.
+ *
+ * Return value:
+ *  The number of points fixed, 0 or 1.
+ */
+static int judge_point(GPSFilter *f, Activity *a, size_t j) {
+  DataPoint *dp = &(a->data_points[j]), *anchor, *good;
+  double v, w, dt;
+  size_t k, end = j + 1 + FIX_GPS_LOOKAHEAD;
+
+  end = end < a->num_points ? end : a->num_points;
+  if (classify_gps(dp, 0) != FIX_VALID) return 0;
+  if (!f->anchored || !SET(v = implied_speed(a, f->anchor, j))) {
+    f->anchored = true;
+    f->anchor = j;
+    f->speed = UNSET_FIELD;
+    return 0;
   }
 
-  if (errors) {
-    a->errors[InvalidGPS] = errors;
-    return errors;
-  } else {
+  anchor = &(a->data_points[f->anchor]);
+  dt = dp->data[Timestamp] - anchor->data[Timestamp];
+  if (plausible(f, v, dt)) {
+    f->anchor = j;
+    f->speed = v;
     return 0;
   }
+
+  for (k = j + 1; k < end; k++) {
+    v = implied_speed(a, f->anchor, k);
+    good = &(a->data_points[k]);
+    if (!SET(v) ||
+        !plausible(f, v, good->data[Timestamp] - anchor->data[Timestamp]))
+      continue;
+
+    w = dt / (good->data[Timestamp] - anchor->data[Timestamp]);
+    dp->data[Latitude] = anchor->data[Latitude] +
+                         w * (good->data[Latitude] - anchor->data[Latitude]);
+    dp->data[Longitude] = anchor->data[Longitude] +
+                          w * (good->data[Longitude] - anchor->data[Longitude]);
+    a->errors[InvalidGPS]++;
+    return 1;
+  }
+
+  f->anchor = j;
+  f->speed = UNSET_FIELD;
+  return 0;
 }
 
-/*
+/**
+ * gps_filter_add
+ *
+ * Description:
+ *  Judge the points whose lookahead lies within the first `n` points, which
+ *  are all that the fused pass has reached. Only the last
+ *  `FIX_GPS_LOOKAHEAD` points are ever looked at, so they are still in
+ *  cache. Once `n` is past the end, the points left are judged with
+ *  whatever lookahead remains.
+ *
+ * Parameters:
+ *  f - the `GPSFilter` for `a`.
+ *  a - the `Activity` being fixed.
+ *  n - the number of points the pass has reached.
+ *
+ * Return value:
+ *  The number of points fixed.
+ */
+static int gps_filter_add(GPSFilter *f, Activity *a, size_t n) {
+  int errors = 0;
+
+  for (; f->next < a->num_points && f->next + FIX_GPS_LOOKAHEAD < n;
+       f->next++) {
+    errors += judge_point(f, a, f->next);
+  }
+  return errors;
+}
+
+/**
+ * fix_activity_options
+ *
+ * Description:
+ *  Run the selected fixes over the `Activity` in a single fused pass over its
+ *  points, rather than a pass per fix. Invalid readings are interpolated
+ *  between the valid readings either side of them, or held at the nearest
+ *  valid reading at the start and end. Nothing is fixed for a field without
+ *  any valid readings, eg. an activity without GPS. Power and heart rate
+ *  readings are spikes if they are outside of the absolute limits or stand
+ *  out from the rolling median of the readings around them. Positions which
+ *  jump implausibly far are moved back onto the track a few points ahead of
+ *  the pass, see `judge_point`. The number of points fixed for each error is
+ *  recorded in `errors`, and anything derived from the old positions and the
+ *  summaries are recomputed if anything changed.
+ *
+ * Parameters:
+ *  a - the `Activity` to fix.
+ *  fixes - the fixes to run, eg. `FIX(InvalidGPS) | FIX(PowerSpikes)` or
+ *          `FIX_ALL`.
+ *  o - the `FixOptions` for spike detection.
+ *
+ * Return value:
+ *  -1 - unable to take a copy of the points of a view to fix, or to allocate
+ *       the state for the fixes.
+ *  int - the number of points which were fixed.
+ */
+int fix_activity_options(Activity *a, unsigned fixes, FixOptions *o) {
+  FixChannel channels[3];
+  GPSFilter gps;
+  unsigned c, count = 0;
+  DataError e;
+  size_t j, k = 0;
+  bool filter = (fixes & FIX(InvalidGPS)) != 0;
+  int errors = 0, err = 0;
+
+  assert(a != NULL && o != NULL && o->window > 0);
+
+  /* fixing a view would change the points of the activity it is a view of */
+  if (activity_materialize(a)) return -1;
+
+  for (e = 0; e < DataErrorCount; e++) {
+    if (fixes & FIX(e)) a->errors[e] = 0;
+  }
+
+  if (filter) {
+    gps_filter_init(&gps);
+    err = init_channel(&channels[count++], a, Latitude, Longitude, 2,
+                       classify_gps, FIX_VALID, o, 0);
+  }
+  if (!err && (fixes & FIX(PowerSpikes))) {
+    err = init_channel(&channels[count++], a, Power, Power, 1, classify_power,
+                       PowerSpikes, o, o->power_floor);
+  }
+  if (!err && (fixes & (FIX(HeartRateSpikes) | FIX(HeartRateDropouts)))) {
+    err = init_channel(
+        &channels[count++], a, HeartRate, HeartRate, 1, classify_heart_rate,
+        (fixes & FIX(HeartRateSpikes)) ? HeartRateSpikes : FIX_VALID, o,
+        o->heart_rate_floor);
+  }
+  /* a channel which failed to set up has already been destroyed */
+  if (err) count--;
+
+  for (j = 0; !err && k < a->num_points; j++) {
+    /* outliers are moved back onto the track before the gaps are filled, so
+     * the channels follow behind the points the GPS filter has judged */
+    if (filter) errors += gps_filter_add(&gps, a, j + 1);
+    for (; k < (filter ? gps.next : j + 1); k++) {
+      for (c = 0; c < count; c++) {
+        errors += channel_add(&channels[c], a, k, fixes);
+      }
+    }
+  }
+
+  for (c = 0; c < count; c++) {
+    if (!err) errors += channel_finish(&channels[c], a);
+    destroy_channel(&channels[c]);
+  }
+  if (err) return -1;
+
+  if (errors && (fixes & FIX(InvalidGPS)) && a->errors[InvalidGPS])
+    activity_clear_derived(a, 0);
+  if (errors) activity_finalize(a);
+  return errors;
+}
+
+/**
+ * fix_invalid_gps
+ *
+ * Description:
+ *  Interpolate positional data where the GPS device did not record any data,
+ *  or the data that was recorded is invalid.
  *
- * TODO FIX DROPOUTS which adds points should remove trksegs...
-   int fix_dropouts(Activity *a);
-   int fix_power(Activity *a);
-   int fix_heart_rate(Activity *a); // TODO probably needs HR max from athletes
-   and
-   other
-   */
+ * Return value:
+ *  -1 - unable to fix the `Activity`.
+ *  int - the number of points which were fixed.
+ */
+int fix_invalid_gps(Activity *a) {
+  return fix_activity(a, FIX(InvalidGPS));
+}
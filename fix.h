@@ -40,13 +40,72 @@
 
 #include "activity.h"
 
+/* selects a fix by the `DataError` it corrects, eg.
+ * `FIX(InvalidGPS) | FIX(PowerSpikes)`. `Dropouts` can't be fixed in place
+ * since it means inserting points. */
+#define FIX(error) (1u << (error))
+#define FIX_ALL                                                    \
+  (FIX(InvalidGPS) | FIX(PowerSpikes) | FIX(HeartRateSpikes) | \
+   FIX(HeartRateDropouts))
+
+/* readings outside of these are treated as spikes or dropouts */
+#define FIX_MAX_POWER 2500
+#define FIX_MAX_HEART_RATE 240
+#define FIX_MIN_HEART_RATE 30
+
+/* GPS readings which imply moving faster or accelerating harder than this
+ * (in m/s and m/s^2) are outliers, if a later reading within
+ * FIX_GPS_LOOKAHEAD points agrees with the readings before them */
+#define FIX_MAX_SPEED 60
+#define FIX_MAX_ACCELERATION 15
+#define FIX_GPS_LOOKAHEAD 8
+
+#define DEFAULT_FIX_OPTIONS \
+  { 7, 6, 150, 5 }
+
+/**
+ * FixOptions
+ *
+ * Description:
+ *  Structure used to specify how power and heart rate spikes are detected.
+ *
+ * Fields:
+ *  window - the number of readings the rolling median is over, centered on
+ *           the reading being judged.
+ *  threshold - how many times the spread of the readings a reading must be
+ *              above the median to be a spike.
+ *  power_floor - the smallest spread of power readings used, in watts.
+ *  heart_rate_floor - the smallest spread of heart rate readings used, in
+ *                     beats per minute.
+ */
+typedef struct {
+  unsigned window;
+  double threshold;
+  double power_floor;
+  double heart_rate_floor;
+} FixOptions;
+
+int fix_activity_options(Activity *a, unsigned fixes, FixOptions *o);
 int fix_invalid_gps(Activity *a);
-/*
-int fix_dropouts(Activity *a);
-int fix_power(Activity *a);
-int fix_heart_rate(Activity *a); // TODO probably needs HR max from athletes and
-other
-values?
-*/
+
+/**
+ * fix_activity
+ *
+ * Description:
+ *  Run the selected fixes over the `Activity` with the default spike
+ *  detection settings.
+ *
+ * Parameters:
+ *  a - the `Activity` to fix.
+ *  fixes - the fixes to run.
+ *
+ * Return value:
+ *  -1 - unable to fix the `Activity`.
+ *  int - the number of points which were fixed.
+ */
+static inline int fix_activity(Activity *a, unsigned fixes) {
+  FixOptions o = DEFAULT_FIX_OPTIONS;
+  return fix_activity_options(a, fixes, &o);
+}
 
 #endif /* _FIX_H_ */
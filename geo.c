@@ -0,0 +1,244 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "geo.h"
+#include "util.h"
+
+/* Taylor coefficients of sin(x)/x and cos(x) in powers of x^2. On
+ * [-PI/2, PI/2] the truncation error is below 1e-11 for sin and 1e-12 for
+ * cos, and far smaller for the tiny angles between consecutive GPS points. */
+static const double SIN[] = {1.0,
+                             -1.0 / 6,
+                             1.0 / 120,
+                             -1.0 / 5040,
+                             1.0 / 362880,
+                             -1.0 / 39916800,
+                             1.0 / 6227020800.0,
+                             -1.0 / 1307674368000.0};
+static const double COS[] = {1.0,
+                             -1.0 / 2,
+                             1.0 / 24,
+                             -1.0 / 720,
+                             1.0 / 40320,
+                             -1.0 / 3628800,
+                             1.0 / 479001600,
+                             -1.0 / 87178291200.0,
+                             1.0 / 20922789888000.0};
+/* Taylor coefficients of asin(x)/x in powers of x^2. Below GEO_MAX_ASIN the
+ * first omitted term is less than 1e-16 of the result. */
+static const double ASIN[] = {1.0, 1.0 / 6, 3.0 / 40, 15.0 / 336};
+
+static double poly(const double *c, size_t n, double x2) {
+  double p = c[n - 1];
+
+  for (; n > 1; n--) p = p * x2 + c[n - 2];
+  return p;
+}
+
+/**
+ * haversine
+ *
+ * Description:
+ *  The great circle distance in meters between two points given in radians,
+ *  computed with libm.
+ */
+static double haversine(double lat1, double lon1, double lat2, double lon2) {
+  double s_lat = sin((lat2 - lat1) / 2), s_lon = sin((lon2 - lon1) / 2);
+  double a = s_lat * s_lat + cos(lat1) * cos(lat2) * s_lon * s_lon;
+
+  return 2 * EARTH_RADIUS * asin(sqrt(a < 1 ? a : 1));
+}
+
+/**
+ * geo_distance
+ *
+ * Description:
+ *  The great circle distance between two (lat, lon) points using the
+ *  Haversine formula.
+ *
+ * Parameters:
+ *  lat1, lon1 - the first point in degrees.
+ *  lat2, lon2 - the second point in degrees.
+ *
+ * Return value:
+ *  The distance between the points in meters.
+ */
+double geo_distance(double lat1, double lon1, double lat2, double lon2) {
+  return haversine(to_radians(lat1), to_radians(lon1), to_radians(lat2),
+                   to_radians(lon2));
+}
+
+#ifdef __SSE2__
+static __m128d poly2(const double *c, size_t n, __m128d x2) {
+  __m128d p = _mm_set1_pd(c[n - 1]);
+
+  for (; n > 1; n--) p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(c[n - 2]));
+  return p;
+}
+
+/* distances for the steps ending at i and i + 1 */
+static void distances2(const double *lat, const double *lon, const double *c,
+                       size_t i, double *d) {
+  const __m128d half = _mm_set1_pd(0.5), zero = _mm_setzero_pd(),
+                one = _mm_set1_pd(1.0), pi = _mm_set1_pd(PI),
+                two_pi = _mm_set1_pd(2 * PI);
+  __m128d d_lat, d_lon, wrap, s_lat, s_lon, a, h;
+
+  d_lat = _mm_mul_pd(
+      _mm_sub_pd(_mm_loadu_pd(lat + i), _mm_loadu_pd(lat + i - 1)), half);
+  d_lon = _mm_sub_pd(_mm_loadu_pd(lon + i), _mm_loadu_pd(lon + i - 1));
+  /* take the short way around the antimeridian */
+  wrap = _mm_sub_pd(_mm_and_pd(_mm_cmplt_pd(d_lon, _mm_sub_pd(zero, pi)),
+                               two_pi),
+                    _mm_and_pd(_mm_cmpgt_pd(d_lon, pi), two_pi));
+  d_lon = _mm_mul_pd(_mm_add_pd(d_lon, wrap), half);
+
+  s_lat = _mm_mul_pd(d_lat,
+                     poly2(SIN, ARRAY_SIZE(SIN), _mm_mul_pd(d_lat, d_lat)));
+  s_lon = _mm_mul_pd(d_lon,
+                     poly2(SIN, ARRAY_SIZE(SIN), _mm_mul_pd(d_lon, d_lon)));
+
+  a = _mm_add_pd(
+      _mm_mul_pd(s_lat, s_lat),
+      _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(c + i), _mm_loadu_pd(c + i - 1)),
+                 _mm_mul_pd(s_lon, s_lon)));
+  h = _mm_sqrt_pd(_mm_min_pd(_mm_max_pd(a, zero), one));
+  h = _mm_mul_pd(h, poly2(ASIN, ARRAY_SIZE(ASIN), _mm_mul_pd(h, h)));
+
+  _mm_storeu_pd(d + i, _mm_mul_pd(h, _mm_set1_pd(2 * EARTH_RADIUS)));
+}
+#endif
+
+/* distance for the step ending at i */
+static double distance1(const double *lat, const double *lon, const double *c,
+                        size_t i) {
+  double d_lat = (lat[i] - lat[i - 1]) / 2, d_lon = lon[i] - lon[i - 1];
+  double s_lat, s_lon, a, h;
+
+  d_lon += (d_lon < -PI ? 2 * PI : 0) - (d_lon > PI ? 2 * PI : 0);
+  d_lon /= 2;
+
+  s_lat = d_lat * poly(SIN, ARRAY_SIZE(SIN), d_lat * d_lat);
+  s_lon = d_lon * poly(SIN, ARRAY_SIZE(SIN), d_lon * d_lon);
+
+  a = s_lat * s_lat + c[i] * c[i - 1] * s_lon * s_lon;
+  h = sqrt(a < 0 ? 0 : (a > 1 ? 1 : a));
+  return 2 * EARTH_RADIUS * h * poly(ASIN, ARRAY_SIZE(ASIN), h * h);
+}
+
+/**
+ * geo_distances
+ *
+ * Description:
+ *  Batch Haversine over columns of positions. The cosine of each latitude is
+ *  computed once and shared by the two steps the point is part of, and the
+ *  trigonometry uses polynomial approximations which are evaluated two steps
+ *  at a time with SSE2 where it is available. Each step is within a
+ *  micrometre of the libm Haversine - steps long enough for the asin
+ *  approximation to degrade are recomputed with libm afterwards.
+ *
+ * Parameters:
+ *  lat - the latitude of each point in radians, within [-PI/2, PI/2].
+ *  lon - the longitude of each point in radians, within [-PI, PI].
+ *  n - the number of points.
+ *  d - set to the distance in meters from the previous point to each point.
+ *      `d[0]` is 0.
+ *
+ * Return value:
+ *  0 - the distances were computed.
+ *  1 - unable to allocate scratch space.
+ */
+int geo_distances(const double *lat, const double *lon, size_t n, double *d) {
+  double *c;
+  size_t i;
+
+  if (!n) return 0;
+  if (!(c = malloc(n * sizeof(*c)))) return 1;
+
+  for (i = 0; i < n; i++) c[i] = poly(COS, ARRAY_SIZE(COS), lat[i] * lat[i]);
+
+  d[0] = 0;
+  i = 1;
+#ifdef __SSE2__
+  for (; i + 1 < n; i += 2) distances2(lat, lon, c, i, d);
+#endif
+  for (; i < n; i++) d[i] = distance1(lat, lon, c, i);
+
+  /* rare long steps are past where the asin polynomial is accurate */
+  for (i = 1; i < n; i++) {
+    if (d[i] > 2 * EARTH_RADIUS * GEO_MAX_ASIN) {
+      d[i] = haversine(lat[i - 1], lon[i - 1], lat[i], lon[i]);
+    }
+  }
+
+  free(c);
+  return 0;
+}
+
+/**
+ * geo_grades
+ *
+ * Description:
+ *  Compute the grade at every point as the slope of the line between the
+ *  first and last points within `window / 2` meters of it, which smooths out
+ *  the noise in both altitude and distance. The window is found with two
+ *  indices which only move forward, and the grades are then computed
+ *  together in a loop without branches which the compiler can vectorize.
+ *
+ * Parameters:
+ *  altitude - the altitude of each point in meters.
+ *  distance - the distance of each point in meters, in increasing order.
+ *  n - the number of points.
+ *  window - the distance in meters to compute each grade over.
+ *  grade - set to the grade at each point as a percentage. It is also used
+ *          to hold the rise over each window before it is divided.
+ *
+ * Return value:
+ *  0 - the grades were computed.
+ *  1 - unable to allocate scratch space, `grade` is left unset.
+ */
+int geo_grades(const double *altitude, const double *distance, size_t n,
+               double window, double *grade) {
+  double *run;
+  size_t i, lo = 0, hi = 0;
+
+  if (!n) return 0;
+  if (!(run = malloc(n * sizeof(*run)))) return 1;
+
+  for (i = 0; i < n; i++) {
+    while (lo < i && distance[lo] < distance[i] - window / 2) lo++;
+    if (hi < i) hi = i;
+    while (hi + 1 < n && distance[hi + 1] <= distance[i] + window / 2) hi++;
+    grade[i] = altitude[hi] - altitude[lo];
+    run[i] = distance[hi] - distance[lo];
+  }
+
+  /* a window without any distance in it, eg. a point on its own, is flat */
+  for (i = 0; i < n; i++) {
+    grade[i] = run[i] > 0 ? 100 * grade[i] / run[i] : 0;
+  }
+
+  free(run);
+  return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GEO_H_
+#define _GEO_H_
+
+#include <stddef.h>
+
+/* steps whose haversine root is above this (roughly 200 km) are recomputed
+ * with libm since the polynomial for asin is only accurate below it */
+#define GEO_MAX_ASIN (1.0 / 64)
+
+double geo_distance(double lat1, double lon1, double lat2, double lon2);
+int geo_distances(const double *lat, const double *lon, size_t n, double *d);
+int geo_grades(const double *altitude, const double *distance, size_t n,
+               double window, double *grade);
+
+#endif /* _GEO_H_ */
@@ -40,12 +40,19 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mxml.h"
 
 #include "activity.h"
 #include "gpx.h"
 #include "util.h"
+#include "xml.h"
+
+#define GPX_POINT "trkpt"
+
+/* every element which may enclose a trkpt, outermost first */
+static const char *GPX_CONTAINERS[] = {"gpx", "trk", "trkseg", NULL};
 
 /**
  * State
@@ -54,26 +61,98 @@
  *  Structure used to maintain state between calls to the sax_cb.
  *
  * Fields:
- *  activity - the activity being constructed during parsing.
+ *  activity - the activity being constructed during parsing. NULL when
+ *             parsing a segment in parallel, in which case points are
+ *             collected into `points` instead.
  *  metadata - whether or not we are currently inside the <metadata> tag.
  *  first_element - whether we have seen the first element yet.
  *  dp - the current datapoint which we are building up to add to `Activity`.
- *  laps - the timestamps for each of the laps read.
- *  TODO
+ *  wpt - whether or not we are currently inside a <wpt> tag.
+ *  trkseg - whether the next point starts a new trkseg.
+ *  lap_times - the timestamps for each of the laps read.
+ *  laps - the indices of the points which match `lap_times`.
+ *  breaks - the indices of the points which start a trkseg.
+ *  points - the points read when parsing a segment.
+ *  num_points - the number of points in `points`.
+ *  points_alloc - the number of points allocated for `points`.
  */
 typedef struct {
   Activity *activity;
   bool metadata;
   bool first_element;
   DataPoint dp;
-  /* TODO */
   bool wpt;
   bool trkseg;
   Vector lap_times;
   Vector laps;
-  size_t lap_num;
+  Vector breaks;
+  DataPoint *points;
+  size_t num_points;
+  size_t points_alloc;
 } State;
 
+static void init_state(State *s, Activity *a) {
+  memset(s, 0, sizeof(*s));
+  s->activity = a;
+  s->first_element = true;
+  unset_data_point(&(s->dp));
+}
+
+static void clear_state(State *s) {
+  vector_destroy(&(s->lap_times));
+  vector_destroy(&(s->laps));
+  vector_destroy(&(s->breaks));
+  if (s->points) free(s->points);
+  s->points = NULL;
+}
+
+/**
+ * add_point
+ *
+ * Description:
+ *  Append the point we've built up to the `Activity`, or to the segment's point
+ *  buffer if we're parsing a segment, noting if it starts a trkseg.
+ *
+ * Return value:
+ *  0 - the point was added.
+ *  1 - unable to add the point.
+ */
+static int add_point(State *state) {
+  Activity *a = state->activity;
+  Vector *v = &(state->breaks);
+  size_t index, n;
+
+  if (a) {
+    n = a->num_points;
+    if (activity_ingest_point(a, &(state->dp), &index)) return 1;
+    /* an out of order point can go in before points we've noted */
+    if (a->num_points > n && index < n) {
+      vector_shift(v, (uint32_t)index);
+    }
+    /* a dropped point leaves its trkseg to start with the next point */
+    if (index == a->num_points) {
+      unset_data_point(&(state->dp));
+      return 0;
+    }
+  } else {
+    ALLOC_GROW(state->points, state->num_points + 1, state->points_alloc);
+    if (!state->points) return 1;
+    state->points[state->num_points] = state->dp;
+    index = state->num_points++;
+  }
+
+  if (state->trkseg) {
+    /* the breaks stay in order even if the point went in before the last */
+    if ((!v->size || index > v->data[v->size - 1]) &&
+        vector_add(v, (uint32_t)index))
+      return 1;
+    state->trkseg = false;
+  }
+
+  unset_data_point(&(state->dp));
+  return 0;
+}
+
 /**
  * sax_cb
  *
@@ -102,7 +181,7 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     name = mxmlGetElement(node);
 
     if (state->first_element) {
-      if (strcmp(name, "gpx")) {
+      if (!xml_synthetic(node) && strcmp(name, "gpx")) {
         return 1; /* stop reading the file */
       }
 
@@ -115,7 +194,8 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     } else if (!strcmp(name, "wpt")) {
       state->wpt = true;
     } else if (!strcmp(name, "trkseg")) {
-      state->trkseg = true;
+      /* a segment which starts mid trkseg doesn't start a new one */
+      if (!xml_synthetic(node)) state->trkseg = true;
     } else if (!strcmp(name, "trkpt")) {
       attr = mxmlElementGetAttr(node, "lat");
       if (attr) {
@@ -142,7 +222,6 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
         return vector_add(&(state->lap_times), (uint32_t)parse_timestamp(data));
       } else {
         parse_field(Timestamp, &(state->dp), data);
-        return vector_add(&(state->activity->breaks), (uint32_t)state->dp[Timestamp]);
       }
     } else if (!strcmp(name, "ele")) {
       parse_field(Altitude, &(state->dp), data);
@@ -155,18 +234,7 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     } else if (!strcmp(name, "gpxdata:bikepower")) {
       parse_field(Power, &(state->dp), data);
     } else if (!strcmp(name, "trkpt")) {
-      if (activity_add_point(state->activity, &(state->dp))) {
-        return 1;
-      }
-      if (state->dp[Timestamp] == state->lap_times[state->lap_num]) {
-        vector_add(state->laps, (uint32_t)state->activity->num_points - 1);
-        state->lap_num++;
-      }
-      if (state->trkseg) {
-        vector_add(&(state->activity->breaks), (uint32_t)state->activity->num_points - 1);
-        state->trkseg = false;
-      }
-      unset_data_point(&(state->dp));
+      return add_point(state);
     }
   } else if (event == MXML_SAX_DATA) {
     mxmlRetain(node);
@@ -175,33 +243,52 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
   return 0;
 }
 
+/**
+ * find_laps
+ *
+ * Description:
+ *  Find the indices of the points whose timestamps match the lap times read
+ *  from the waypoints, looking each of them up by time.
+ */
+static int find_laps(State *s) {
+  Activity *a = s->activity;
+  size_t i, j;
+
+  for (i = 0; i < s->lap_times.size; i++) {
+    if (activity_point_at_time(a, s->lap_times.data[i], &j)) return 1;
+    if (j == a->num_points ||
+        a->data_points[j].data[Timestamp] != s->lap_times.data[i] ||
+        (s->laps.size && j <= s->laps.data[s->laps.size - 1]))
+      continue;
+    if (vector_add(&(s->laps), (uint32_t)j)) return 1;
+  }
+  return 0;
+}
+
 static void fix_laps(State *s) {
+  Activity *a = s->activity;
   size_t i, j;
-  char tweak;
+  char tweak = 0;
 
-  vector_add(s->activity->laps, 1);
+  /* every activity has at least the default starting lap */
+  vector_add(&(a->laps), 0);
 
-  /* If there are no laps, add the default starting lap and if there is only
-   * one lap it is the starting lap */
-  if (!s->laps && s>activity->num_points || s->laps->size == 1) {
-    return;
-  }
+  /* if there is only one lap it is the starting lap */
+  if (s->laps.size < 2) return;
 
   /* If there is more than one lap and *all* of them happen to come before the
    * end of a trkseg we know we have the case where the lap times we were given
    * were actually lap end instead of lap start times
    */
-  if (s->laps.size > 1 && s->activity->breaks.size > 1 &&
-      s->laps.size <= s->activity->breaks.size) {
+  if (a->breaks.size > 1 && s->laps.size <= a->breaks.size) {
     i = j = 1;
-    while (i < s->laps.size && j < s->activity->breaks.size) {
-      if (s->laps->data[i] == s->activity->breaks->data[j]-1) {
+    while (i < s->laps.size && j < a->breaks.size) {
+      if (s->laps.data[i] == a->breaks.data[j] - 1) {
         i++;
         j++;
-      } else if (s->laps->data[i] > s->activity->breaks->data[j]-1) {
+      } else if (s->laps.data[i] > a->breaks.data[j] - 1) {
         j++;
       } else {
-        match = false;
         break;
       }
     }
@@ -211,23 +298,138 @@ static void fix_laps(State *s) {
      * one lap point (no longer necessary)
      */
     tweak = (i == s->laps.size);
+  }
 
-    for (i = 1; i < s->laps.size-tweak; i++) {
-      vector_add(s->activity->laps, s->laps->data[i]+tweak);
-    }
+  for (i = 1; i < s->laps.size - tweak; i++) {
+    vector_add(&(a->laps), s->laps.data[i] + tweak);
   }
 }
 
-static void clear_state(State *s) {
-  if (state->laps) vector_destroy(&(state->laps));
-  if (state->lap_times) vector_destroy(&(state->lap_times));
+/**
+ * finish_activity
+ *
+ * Description:
+ *  Hand the breaks and laps gathered in `s` over to the `Activity` and
+ *  finalize it.
+ */
+static int finish_activity(State *s) {
+  Activity *a = s->activity;
+
+  a->format = GPX;
+
+  vector_destroy(&(a->breaks));
+  a->breaks = s->breaks;
+  memset(&(s->breaks), 0, sizeof(s->breaks));
+
+  if (find_laps(s)) return 1;
+  /* The lap indices we have could be end instead of start times */
+  fix_laps(s);
+
+  activity_finalize(a);
+  return 0;
+}
+
+/**
+ * read_sequential
+ *
+ * Description:
+ *  Parse the whole GPX document in `buf` with a single SAX pass.
+ */
+static Activity *read_sequential(const char *buf) {
+  mxml_node_t *tree;
+  Activity *a;
+  State state;
+
+  if (!(a = activity_new())) return NULL;
+  init_state(&state, a);
+
+  if (!(tree = mxmlSAXLoadString(NULL, buf, MXML_OPAQUE_CALLBACK, sax_cb,
+                                 (void *)&state)) ||
+      finish_activity(&state)) {
+    if (tree) mxmlDelete(tree);
+    clear_state(&state);
+    activity_destroy(a);
+    return NULL;
+  }
+
+  clear_state(&state);
+  mxmlDelete(tree);
+  return a;
+}
+
+/**
+ * read_parallel
+ *
+ * Description:
+ *  Split the GPX document in `buf` into segments at trkpt boundaries, parse
+ *  them in parallel and merge the points back together in order.
+ *
+ * Return value:
+ *  NULL - the document couldn't be split safely or failed to parse. The
+ *         caller should fall back to `read_sequential`.
+ *  valid pointer - the `Activity`.
+ */
+static Activity *read_parallel(const char *buf, size_t len) {
+  XMLSegment *segments;
+  State *states, merged;
+  size_t i, j, k, n;
+  int err;
+
+  if (!(segments = xml_split(buf, len, GPX_POINT, GPX_CONTAINERS, &n)))
+    return NULL;
+  if (!(states = malloc(n * sizeof(*states)))) {
+    xml_destroy_segments(segments, n);
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++) {
+    init_state(&states[i], NULL);
+    segments[i].state = &states[i];
+  }
+
+  err = xml_parse_segments(segments, n, sax_cb);
+  xml_destroy_segments(segments, n);
+
+  init_state(&merged, err ? NULL : activity_new());
+  err = !merged.activity;
+
+  /* the points go through `add_point` again rather than being offset, since
+   * points which are out of order don't always end up one for one */
+  for (i = 0; i < n; i++) {
+    for (j = 0, k = 0; !err && j < states[i].num_points; j++) {
+      if (k < states[i].breaks.size && states[i].breaks.data[k] == j) {
+        merged.trkseg = true;
+        k++;
+      }
+      merged.dp = states[i].points[j];
+      err = add_point(&merged);
+    }
+    for (j = 0; !err && j < states[i].lap_times.size; j++) {
+      err = vector_add(&(merged.lap_times), states[i].lap_times.data[j]);
+    }
+    /* a trkseg opened right before the split starts with the next segment */
+    if (states[i].trkseg && i + 1 < n) merged.trkseg = true;
+    clear_state(&states[i]);
+  }
+  free(states);
+
+  if (!err) err = finish_activity(&merged);
+  clear_state(&merged);
+
+  if (err) {
+    if (merged.activity) activity_destroy(merged.activity);
+    return NULL;
+  }
+  return merged.activity;
 }
 
 /**
  * gpx_read
  *
  * Description:
- *  Read in the GPX file pointed to by `f` and return an `Activity`.
+ *  Read in the GPX file pointed to by `f` and return an `Activity`. Large
+ *  files are speculatively split and parsed in parallel, falling back to a
+ *  sequential parse if they can't be split safely.
  *
  * Parameters:
  *  f - The file descriptor for the GPX file to read.
@@ -238,38 +440,17 @@ static void clear_state(State *s) {
  *                  The caller is responsible for freeing the activity.
  */
 Activity *gpx_read(FILE *f) {
-  mxml_node_t *tree;
-  State state = {
-    NULL,  /* activity */
-    false, /* metadata */
-    true,  /* first_element */
-    {{0}}, /* dp */
-    false, /* wpt */
-    false, /* trkseg */
-    NULL,  /* laps */
-    NULL,  /* lap_times */
-    0      /* lap_num */
-  } unset_data_point(&(state.dp));
-
-  if (!(state.activity = activity_new())) return NULL;
-
-  if (!(tree = mxmlSAXLoadFile(NULL, f, MXML_OPAQUE_CALLBACK, sax_cb,
-                               (void *)&state))) {
-    clear_state(&state);
-    activity_destroy(state.activity);
-    return NULL;
-  }
+  Activity *a = NULL;
+  char *buf;
+  size_t len;
 
-  state.activity->format = GPX;
+  if (!(buf = read_all(f, &len))) return NULL;
 
-  if (state.laps) {
-    /* The lap indices we have could be end instead of start times */
-    fix_laps(&state);
-  }
+  if (len >= XML_PARALLEL_SIZE) a = read_parallel(buf, len);
+  if (!a) a = read_sequential(buf);
 
-  clear_state(&state);
-  mxmlDelete(tree);
-  return state.activity;
+  free(buf);
+  return a;
 }
 
 /**
@@ -281,17 +462,20 @@ Activity *gpx_read(FILE *f) {
  * Parameters:
  *  a - the `Activity` to convert into XML.
  *  o - the options to use when writing the `Activity`.
+ *  keep - whether to write each point, or NULL to write them all.
  *
  * Return value:
  *  valid pointer - a pointer to the mxml_node_t root node for the xml.
  *                  The caller is responsible for freeing this node.
  */
-static mxml_node_t *to_gpx_xml(Activity *a, GPXOptions *o) {
+static mxml_node_t *to_gpx_xml(Activity *a, GPXOptions *o,
+                               unsigned char *keep) {
   char buf[TIME_BUFSIZ]; /* we don't need to zero since all the same length */
   mxml_node_t *xml, *gpx, *metadata, *wpt, *trk, *time, *name, *trkseg, *trkpt,
       *ele, *extensions, *gpxtpx, *atemp, *hr, *cad;
   unsigned i, lap_count = 0;
-  uint32_t lap;
+  uint32_t lap = 0;
+  bool lap_trksegs = o->add_laps && o->lap_trksegs && a->laps.size;
 
   xml = mxmlNewXML("1.0");
 
@@ -323,8 +507,8 @@ static mxml_node_t *to_gpx_xml(Activity *a, GPXOptions *o) {
 
   /* write laps as waypoints */
   if (o->add_laps) {
-    for (i = 0; i < a->laps->size; i++) {
-      lap = a->laps->data[i];
+    for (i = 0; i < a->laps.size; i++) {
+      lap = a->laps.data[i];
       wpt = mxmlNewElement(gpx, "wpt");
       mxmlElementSetAttrf(wpt, "lat", "%.7f",
                           a->data_points[lap].data[Latitude]);
@@ -346,17 +530,19 @@ static mxml_node_t *to_gpx_xml(Activity *a, GPXOptions *o) {
   mxmlNewText(name, 0, "Untitled");
 
   // TODO we also need to add just normal trkegs...
-  if (!(o->add_laps && o->lap_trksegs)) {
-    trkseg = mxmlNewElement(trk, "trkseg");
-  } else {
-    lap = 0;
-  }
+  /* without any laps to start them everything goes in the one trkseg,
+   * otherwise the first lap opens one at the first point written */
+  trkseg = lap_trksegs ? NULL : mxmlNewElement(trk, "trkseg");
 
   for (i = 0; i < a->num_points; i++) {
-    if ((o->add_laps && o->lap_trksegs) && lap_count < a->laps->size &&
-        lap == i) {
+    if (keep && !keep[i]) continue;
+    if (lap_trksegs && lap_count < a->laps.size && lap <= i) {
       trkseg = mxmlNewElement(trk, "trkseg");
-      lap = a->laps->data[++lap_count];
+      /* a lap starting at a point which was simplified away starts here */
+      while (lap_count < a->laps.size && a->laps.data[lap_count] <= i) {
+        lap_count++;
+      }
+      lap = lap_count < a->laps.size ? a->laps.data[lap_count] : 0;
     }
 
     trkpt = mxmlNewElement(trkseg, "trkpt");
@@ -415,11 +601,18 @@ static mxml_node_t *to_gpx_xml(Activity *a, GPXOptions *o) {
  */
 int gpx_write_options(FILE *f, Activity *a, GPXOptions *o) {
   mxml_node_t *tree;
+  unsigned char *keep = NULL;
 
   assert(a != NULL);
 
-  if (!a->last[Latitude] && !a->last[Longitude]) return 1;
-  if (!(tree = to_gpx_xml(a, o))) return 1;
+  if (!a->last_set[Latitude] && !a->last_set[Longitude]) return 1;
+  if (o->simplify > 0) {
+    if (!(keep = malloc(a->num_points))) return 1;
+    activity_simplify(a, o->simplify, keep);
+  }
+  tree = to_gpx_xml(a, o, keep);
+  if (keep) free(keep);
+  if (!tree) return 1;
 
   if (mxmlSaveFile(tree, f, MXML_NO_CALLBACK) < 0) {
     mxmlDelete(tree);
@@ -42,7 +42,7 @@
 #include "activity.h"
 
 #define DEFAULT_GPX_OPTIONS \
-  { true, false }
+  { true, false, 0 }
 
 /**
  * GPXOptions
@@ -53,10 +53,13 @@
  * Fields:
  *  add_laps - whether or not to add laps as 'wpt' fields.
  *  lap_trksegs - whether to write a trkseg for each lap.
+ *  simplify - if positive, only write the points needed to keep the track
+ *             within this many meters, see `activity_simplify`.
  */
 typedef struct {
   bool add_laps;
   bool lap_trksegs;
+  double simplify;
 } GPXOptions;
 
 Activity *gpx_read(FILE *f);
@@ -78,8 +81,7 @@ int gpx_write_options(FILE *f, Activity *a, GPXOptions *o);
  */
 static inline int gpx_write(FILE *f, Activity *a) {
   GPXOptions o = DEFAULT_GPX_OPTIONS;
-  return gpx_write(f, a, &o);
-  ;
+  return gpx_write_options(f, a, &o);
 }
 
 #endif /* _GPX_H_ */
@@ -0,0 +1,418 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+#include "rolling.h"
+#include "summary.h"
+
+static void reset_min_max(DataPoint *min, DataPoint *max) {
+  DataField i;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    min->data[i] = DBL_MAX;
+    max->data[i] = -DBL_MAX;
+  }
+}
+
+/* unset fields are `UNSET_FIELD` (DBL_MAX) and so never lower the minimum */
+static void extend_min_max(DataPoint *min, DataPoint *max, DataPoint *dp) {
+  DataField i;
+  double v;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    v = dp->data[i];
+    min->data[i] = v < min->data[i] ? v : min->data[i];
+    max->data[i] = (SET(v) && v > max->data[i]) ? v : max->data[i];
+  }
+}
+
+static void merge_min_max(DataPoint *min, DataPoint *max, DataPoint *min2,
+                          DataPoint *max2) {
+  DataField i;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    min->data[i] = min2->data[i] < min->data[i] ? min2->data[i] : min->data[i];
+    max->data[i] = max2->data[i] > max->data[i] ? max2->data[i] : max->data[i];
+  }
+}
+
+/**
+ * build_running
+ *
+ * Description:
+ *  Fill in the prefix sums of every field and of the values which depend on
+ *  the previous point, accumulating them with the same `summary_add` as the
+ *  `Summary` of the whole `Activity` so that the two can't drift apart.
+ */
+static void build_running(RangeIndex *idx, Activity *a) {
+  DataPoint *dp;
+  RangeRunning *run;
+  DataField i;
+  Summary s;
+  Tracker t;
+  size_t j, n = idx->num_points;
+  uint32_t next_altitude, next_timestamp;
+
+  memset(&(idx->totals[0]), 0, sizeof(idx->totals[0]));
+  memset(&(idx->counts[0]), 0, sizeof(idx->counts[0]));
+  memset(&(idx->running[0]), 0, sizeof(idx->running[0]));
+  summary_init(&s);
+  /* without the rolling window normalized power is just left unset */
+  tracker_init(&t, rolling_new(Power, NP_WINDOW), a->sport);
+
+  for (j = 0; j < n; j++) {
+    dp = &(a->data_points[j]);
+    summary_add(&s, &t, dp);
+
+    for (i = 0; i < DataFieldCount; i++) {
+      idx->totals[j + 1].data[i] = s.point[Total].data[i];
+      idx->counts[j + 1].data[i] = (double)(j + 1 - s.unset[i]);
+    }
+    run = &(idx->running[j + 1]);
+    run->ascent = s.ascent;
+    run->descent = s.descent;
+    run->moving = s.moving;
+    run->np_total = t.np_total;
+    run->np_time = t.np_time;
+    run->work = s.work;
+    run->heart_beats = s.heart_beats;
+    run->heart_time = s.heart_time;
+  }
+
+  if (t.power) rolling_destroy(t.power);
+
+  /* walk backwards to find the first point of any range with each value */
+  next_altitude = next_timestamp = (uint32_t)n;
+  for (j = n + 1; j-- > 0;) {
+    if (j < n) {
+      dp = &(a->data_points[j]);
+      if (SET(dp->data[Altitude])) next_altitude = (uint32_t)j;
+      if (SET(dp->data[Timestamp])) next_timestamp = (uint32_t)j;
+    }
+    idx->running[j].altitude = next_altitude;
+    idx->running[j].timestamp = next_timestamp;
+  }
+}
+
+/**
+ * build_sparse_table
+ *
+ * Description:
+ *  Compute the minimum and maximum of every block of points, and then of
+ *  every run of 2^level blocks from the runs half as long.
+ */
+static void build_sparse_table(RangeIndex *idx, Activity *a) {
+  DataPoint *min, *max;
+  size_t j, b, l, end, nb = idx->num_blocks, half;
+
+  for (b = 0; b < nb; b++) {
+    min = &(idx->min[b]);
+    max = &(idx->max[b]);
+    reset_min_max(min, max);
+    end = (b + 1) * INDEX_BLOCK;
+    end = end < idx->num_points ? end : idx->num_points;
+    for (j = b * INDEX_BLOCK; j < end; j++) {
+      extend_min_max(min, max, &(a->data_points[j]));
+    }
+  }
+
+  for (l = 1; l < idx->levels; l++) {
+    half = (size_t)1 << (l - 1);
+    for (b = 0; b + 2 * half <= nb; b++) {
+      min = &(idx->min[l * nb + b]);
+      max = &(idx->max[l * nb + b]);
+      *min = idx->min[(l - 1) * nb + b];
+      *max = idx->max[(l - 1) * nb + b];
+      merge_min_max(min, max, &(idx->min[(l - 1) * nb + b + half]),
+                    &(idx->max[(l - 1) * nb + b + half]));
+    }
+  }
+}
+
+/**
+ * range_index_new
+ *
+ * Description:
+ *  Build a `RangeIndex` over the points of the `Activity` in O(n log n) time.
+ *  The index is only valid until the points of the `Activity` change. If a
+ *  valid pointer is returned it must be free'd with a call to
+ *  `range_index_destroy`.
+ *
+ * Parameters:
+ *  a - the finalized `Activity` to index.
+ *
+ * Return value:
+ *  NULL - unable to allocate the index.
+ *  valid pointer - the pointer to the `RangeIndex`.
+ */
+RangeIndex *range_index_new(Activity *a) {
+  RangeIndex *idx;
+  size_t n, tables;
+
+  assert(a != NULL);
+
+  if (!(idx = malloc(sizeof(*idx)))) return NULL;
+
+  idx->num_points = n = a->num_points;
+  idx->num_blocks = (n + INDEX_BLOCK - 1) / INDEX_BLOCK;
+  for (idx->levels = 1; ((size_t)1 << idx->levels) <= idx->num_blocks;
+       idx->levels++)
+    ;
+  tables = idx->levels * idx->num_blocks + 1;
+
+  idx->totals = malloc((n + 1) * sizeof(*idx->totals));
+  idx->counts = malloc((n + 1) * sizeof(*idx->counts));
+  idx->running = malloc((n + 1) * sizeof(*idx->running));
+  idx->min = malloc(tables * sizeof(*idx->min));
+  idx->max = malloc(tables * sizeof(*idx->max));
+  if (!idx->totals || !idx->counts || !idx->running || !idx->min ||
+      !idx->max) {
+    range_index_destroy(idx);
+    return NULL;
+  }
+
+  build_running(idx, a);
+  build_sparse_table(idx, a);
+
+  return idx;
+}
+
+/**
+ * range_index_destroy
+ *
+ * Description:
+ *  Destroys a `RangeIndex` created by `range_index_new`.
+ *
+ * Parameters:
+ *  idx - a non-NULL `RangeIndex` pointer.
+ */
+void range_index_destroy(RangeIndex *idx) {
+  assert(idx != NULL);
+
+  if (idx->totals) free(idx->totals);
+  if (idx->counts) free(idx->counts);
+  if (idx->running) free(idx->running);
+  if (idx->min) free(idx->min);
+  if (idx->max) free(idx->max);
+  free(idx);
+}
+
+/**
+ * range_index_summary
+ *
+ * Description:
+ *  Work out the `Summary` of the points from `start` up to (but not including)
+ *  `end`. At most two blocks of points are scanned, everything else is looked
+ *  up. Normalized power carries the rolling average power in from before the
+ *  range, and the ascent, descent and moving time carry the elevation filter
+ *  and pause detection in, so they can differ slightly from those of a lap
+ *  over the same points.
+ *
+ * Parameters:
+ *  idx - the `RangeIndex` of `a`.
+ *  a - the `Activity` the points are from.
+ *  start - the index of the first point in the range.
+ *  end - the index after the last point in the range.
+ *  s - set to the `Summary` of the range.
+ */
+void range_index_summary(RangeIndex *idx, Activity *a, size_t start,
+                         size_t end, Summary *s) {
+  DataPoint *min = &(s->point[Minimum]), *max = &(s->point[Maximum]);
+  RangeRunning *first, *last = &(idx->running[end]);
+  DataField i;
+  double count, np_total, np_time;
+  size_t j, lo, hi, l, nb = idx->num_blocks;
+
+  assert(start < end && end <= idx->num_points);
+
+  reset_min_max(min, max);
+  lo = start / INDEX_BLOCK;
+  hi = (end - 1) / INDEX_BLOCK;
+  if (hi - lo < 2) {
+    for (j = start; j < end; j++) {
+      extend_min_max(min, max, &(a->data_points[j]));
+    }
+  } else {
+    for (j = start; j < (lo + 1) * INDEX_BLOCK; j++) {
+      extend_min_max(min, max, &(a->data_points[j]));
+    }
+    for (j = hi * INDEX_BLOCK; j < end; j++) {
+      extend_min_max(min, max, &(a->data_points[j]));
+    }
+    /* the blocks in between are covered by two overlapping runs */
+    lo++;
+    for (l = 0; ((size_t)2 << l) <= hi - lo; l++)
+      ;
+    merge_min_max(min, max, &(idx->min[l * nb + lo]),
+                  &(idx->max[l * nb + lo]));
+    merge_min_max(min, max, &(idx->min[l * nb + hi - ((size_t)1 << l)]),
+                  &(idx->max[l * nb + hi - ((size_t)1 << l)]));
+  }
+
+  for (i = 0; i < DataFieldCount; i++) {
+    count = idx->counts[end].data[i] - idx->counts[start].data[i];
+    s->point[Total].data[i] =
+        idx->totals[end].data[i] - idx->totals[start].data[i];
+    s->point[Average].data[i] = count ? s->point[Total].data[i] / count : 0;
+    s->unset[i] = (unsigned)(end - start - count);
+  }
+
+  s->elapsed = (max->data[Timestamp] != -DBL_MAX)
+                   ? max->data[Timestamp] - min->data[Timestamp]
+                   : 0;
+
+  /* the first point with a value has nothing before it within the range */
+  s->ascent = s->descent = s->moving = 0;
+  s->work = s->heart_beats = s->heart_time = 0;
+  j = idx->running[start].altitude;
+  if (j < end) {
+    first = &(idx->running[j + 1]);
+    s->ascent = last->ascent - first->ascent;
+    s->descent = last->descent - first->descent;
+  }
+  j = idx->running[start].timestamp;
+  if (j < end) {
+    first = &(idx->running[j + 1]);
+    s->moving = last->moving - first->moving;
+    s->work = last->work - first->work;
+    s->heart_beats = last->heart_beats - first->heart_beats;
+    s->heart_time = last->heart_time - first->heart_time;
+  }
+  summary_calories(s, end - start);
+
+  np_total = last->np_total - idx->running[start].np_total;
+  np_time = last->np_time - idx->running[start].np_time;
+  np_total = np_total > 0 ? np_total : 0;
+  s->normalized_power =
+      np_time > 0 ? sqrt(sqrt(np_total / np_time)) : UNSET_FIELD;
+}
+
+/**
+ * time_index_new
+ *
+ * Description:
+ *  Build a `TimeIndex` over the points of the `Activity`. The index is only
+ *  valid until the points of the `Activity` change. If a valid pointer is
+ *  returned it must be free'd with a call to `time_index_destroy`.
+ *
+ * Parameters:
+ *  a - the `Activity` to index.
+ *
+ * Return value:
+ *  NULL - unable to allocate the index.
+ *  valid pointer - the pointer to the `TimeIndex`.
+ */
+TimeIndex *time_index_new(Activity *a) {
+  TimeIndex *ti;
+  double ts, latest = -DBL_MAX;
+  size_t j, n;
+
+  assert(a != NULL);
+
+  if (!(ti = malloc(sizeof(*ti)))) return NULL;
+
+  ti->num_points = n = a->num_points;
+  ti->count = 0;
+  ti->times = malloc((n + 1) * sizeof(*ti->times));
+  ti->points = malloc((n + 1) * sizeof(*ti->points));
+  ti->skips = malloc((n / INDEX_TIME_STRIDE + 1) * sizeof(*ti->skips));
+  if (!ti->times || !ti->points || !ti->skips) {
+    time_index_destroy(ti);
+    return NULL;
+  }
+
+  for (j = 0; j < n; j++) {
+    ts = a->data_points[j].data[Timestamp];
+    if (!SET(ts)) continue;
+    latest = ts > latest ? ts : latest;
+    ti->times[ti->count] = latest;
+    ti->points[ti->count] = (uint32_t)j;
+    ti->count++;
+  }
+
+  ti->num_skips = (ti->count + INDEX_TIME_STRIDE - 1) / INDEX_TIME_STRIDE;
+  for (j = 0; j < ti->num_skips; j++) {
+    ti->skips[j] = ti->times[j * INDEX_TIME_STRIDE];
+  }
+
+  return ti;
+}
+
+/**
+ * time_index_destroy
+ *
+ * Description:
+ *  Destroys a `TimeIndex` created by `time_index_new`.
+ *
+ * Parameters:
+ *  ti - a non-NULL `TimeIndex` pointer.
+ */
+void time_index_destroy(TimeIndex *ti) {
+  assert(ti != NULL);
+
+  if (ti->times) free(ti->times);
+  if (ti->points) free(ti->points);
+  if (ti->skips) free(ti->skips);
+  free(ti);
+}
+
+/* the first of `times[lo, hi)` which is at least `timestamp`, or `hi` */
+static size_t search_times(double *times, size_t lo, size_t hi,
+                           double timestamp) {
+  size_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (times[mid] < timestamp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * time_index_at
+ *
+ * Description:
+ *  Find the first point at or after `timestamp` in O(log n) time.
+ *
+ * Parameters:
+ *  ti - the `TimeIndex` to search.
+ *  timestamp - the time to look for.
+ *
+ * Return value:
+ *  num_points - no point is at or after `timestamp`.
+ *  size_t - the index of the point.
+ */
+size_t time_index_at(TimeIndex *ti, double timestamp) {
+  size_t k, lo, hi;
+
+  /* the answer lies after the last skip before `timestamp`, up to the next */
+  k = search_times(ti->skips, 0, ti->num_skips, timestamp);
+  lo = k ? (k - 1) * INDEX_TIME_STRIDE + 1 : 0;
+  hi = k < ti->num_skips ? k * INDEX_TIME_STRIDE : ti->count;
+  k = search_times(ti->times, lo, hi, timestamp);
+
+  return k < ti->count ? ti->points[k] : ti->num_points;
+}
@@ -0,0 +1,122 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include "activity.h"
+
+/* the minimum and maximum are indexed per block of this many points, the
+ * points at either end of a range are scanned directly */
+#define INDEX_BLOCK 32
+/* every this many timestamps is copied into the skip table */
+#define INDEX_TIME_STRIDE 64
+
+/**
+ * RangeRunning
+ *
+ * Description:
+ *  The running totals of the values in a `Summary` which depend on the
+ *  previous point, over every point before some index.
+ *
+ * Fields:
+ *  ascent - the total ascent.
+ *  descent - the total descent.
+ *  moving - the total moving time.
+ *  work - the total work in kJ.
+ *  heart_beats - the total heart beats.
+ *  heart_time - the total time with a heart rate.
+ *  np_total - the sum of the fourth power of the rolling average power,
+ *             weighted by time.
+ *  np_time - the time in seconds `np_total` covers.
+ *  altitude - the index of the first point at or after this one with an
+ *             altitude.
+ *  timestamp - the index of the first point at or after this one with a
+ *              timestamp.
+ */
+typedef struct {
+  double ascent, descent, moving;
+  double work, heart_beats, heart_time;
+  double np_total, np_time;
+  uint32_t altitude, timestamp;
+} RangeRunning;
+
+/**
+ * RangeIndex
+ *
+ * Description:
+ *  An index over the points of an `Activity` which answers `Summary` queries
+ *  for any range of points without rescanning them. Totals, averages and the
+ *  values which depend on the previous point come from prefix sums, and the
+ *  minimum and maximum come from a sparse table over blocks of
+ *  `INDEX_BLOCK` points.
+ *
+ * Fields:
+ *  num_points - the number of points indexed.
+ *  num_blocks - the number of blocks of points.
+ *  levels - the number of levels in the sparse table.
+ *  totals - the totals of each field over the points before each index.
+ *  counts - the number of points which have each field set before each index.
+ *  running - the running totals before each index.
+ *  min - the minimum of each field over 2^level blocks from each block.
+ *  max - the maximum of each field over 2^level blocks from each block.
+ */
+struct RangeIndex {
+  size_t num_points, num_blocks, levels;
+  DataPoint *totals;
+  DataPoint *counts;
+  RangeRunning *running;
+  DataPoint *min;
+  DataPoint *max;
+};
+
+/**
+ * TimeIndex
+ *
+ * Description:
+ *  An index from time to the points of an `Activity`. The timestamps are kept
+ *  in a dense column searched with a binary search, after first searching a
+ *  small skip table of every `INDEX_TIME_STRIDE`th timestamp which stays in
+ *  cache however irregularly the points were recorded. Timestamps which go
+ *  back in time are indexed as the latest time seen so far, which keeps the
+ *  column sorted.
+ *
+ * Fields:
+ *  num_points - the number of points in the `Activity`.
+ *  count - the number of points with a timestamp.
+ *  times - the timestamp of each point with one, in increasing order.
+ *  points - the index of the point each of `times` is from.
+ *  num_skips - the number of entries in the skip table.
+ *  skips - every `INDEX_TIME_STRIDE`th entry of `times`.
+ */
+struct TimeIndex {
+  size_t num_points, count;
+  double *times;
+  uint32_t *points;
+  size_t num_skips;
+  double *skips;
+};
+
+RangeIndex *range_index_new(Activity *a);
+void range_index_destroy(RangeIndex *idx);
+void range_index_summary(RangeIndex *idx, Activity *a, size_t start,
+                         size_t end, Summary *s);
+TimeIndex *time_index_new(Activity *a);
+void time_index_destroy(TimeIndex *ti);
+size_t time_index_at(TimeIndex *ti, double timestamp);
+
+#endif /* _INDEX_H_ */
@@ -0,0 +1,479 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "meanmax.h"
+#include "util.h"
+
+/**
+ * fill_series
+ *
+ * Description:
+ *  Lay the values of `field` out on a 1 second grid starting at the first
+ *  timestamp. The values of the points within the same second are averaged,
+ *  so that recording more than once a second doesn't throw any away. Points
+ *  missing the field count as zero, short gaps between points hold the
+ *  previous value and longer gaps are zero. Points which go back in time are
+ *  ignored.
+ *
+ * Parameters:
+ *  a - the `Activity` to read the values from.
+ *  field - the `DataField` to lay out.
+ *  n - set to the number of seconds in the series.
+ *
+ * Return value:
+ *  NULL - the `Activity` has no timestamps or we were unable to allocate the
+ *         series.
+ *  valid pointer - the `n` values of the series. The caller must free it.
+ */
+static double *fill_series(Activity *a, DataField field, size_t *n) {
+  double *x, t0, v, prev_v = 0, sum = 0;
+  size_t j, k, prev_k = 0, count = 0;
+  bool started = false;
+  DataPoint *dp;
+
+  *n = 0;
+  if (a->summary.unset[Timestamp] == a->num_points) return NULL;
+
+  t0 = a->summary.point[Minimum].data[Timestamp];
+  *n = (size_t)(a->summary.point[Maximum].data[Timestamp] - t0) + 1;
+  if (!(x = calloc(*n, sizeof(*x)))) return NULL;
+
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    if (!SET(dp->data[Timestamp])) continue;
+    k = (size_t)(dp->data[Timestamp] - t0);
+    if (started && k < prev_k) continue;
+    v = SET(dp->data[field]) ? dp->data[field] : 0;
+
+    if (started && k == prev_k) {
+      sum += v;
+      x[k] = prev_v = sum / ++count;
+      continue;
+    }
+    if (started && k - prev_k <= MEANMAX_MAX_GAP) {
+      for (prev_k++; prev_k < k; prev_k++) x[prev_k] = prev_v;
+    }
+    x[k] = sum = prev_v = v;
+    count = 1;
+    prev_k = k;
+    started = true;
+  }
+
+  return x;
+}
+
+/**
+ * window_max
+ *
+ * Description:
+ *  Compute the maximum of each window of `MEANMAX_BLOCK` values of `p` with a
+ *  monotonic deque, so that every value is pushed and popped at most once.
+ *
+ * Parameters:
+ *  p - the values.
+ *  n - the number of values in `p`.
+ *  m - set to the maximum of `p[j]` to `p[j + MEANMAX_BLOCK - 1]` (or the last
+ *      value) for each `j`.
+ *
+ * Return value:
+ *  0 - the maximums were computed.
+ *  1 - unable to allocate the deque.
+ */
+static int window_max(const double *p, size_t n, double *m) {
+  size_t *deque, head = 0, tail = 0, j, k;
+
+  if (!(deque = malloc(n * sizeof(*deque)))) return 1;
+
+  /* slide the window [j, k) from the end so m[j] is known once j is added */
+  for (j = n, k = n; j > 0; j--) {
+    while (tail > head && p[deque[tail - 1]] <= p[j - 1]) tail--;
+    deque[tail++] = j - 1;
+    if (k - (j - 1) > MEANMAX_BLOCK) {
+      k--;
+      if (deque[head] == k) head++;
+    }
+    m[j - 1] = p[deque[head]];
+  }
+
+  free(deque);
+  return 0;
+}
+
+/**
+ * scan_block
+ *
+ * Description:
+ *  The largest sum over `d` seconds for windows starting between `start` and
+ *  `end`, taking differences of the prefix sums two at a time with SSE2 where
+ *  it is available.
+ */
+static double scan_block(const double *p, size_t d, size_t start,
+                         size_t end) {
+  double best = -DBL_MAX, s;
+  size_t i = start;
+#ifdef __SSE2__
+  __m128d v, m = _mm_set1_pd(-DBL_MAX);
+  double pair[2];
+
+  for (; i + 1 < end; i += 2) {
+    v = _mm_sub_pd(_mm_loadu_pd(p + i + d), _mm_loadu_pd(p + i));
+    m = _mm_max_pd(m, v);
+  }
+  _mm_storeu_pd(pair, m);
+  best = pair[0] > pair[1] ? pair[0] : pair[1];
+#endif
+  for (; i < end; i++) {
+    s = p[i + d] - p[i];
+    best = s > best ? s : best;
+  }
+  return best;
+}
+
+/**
+ * best_windows
+ *
+ * Description:
+ *  Compute the best sum over every window length of the series whose prefix
+ *  sums are `p`. Naively this is O(n^2) - for each duration we use the best
+ *  window of the previous duration, extended by a second on either side, as
+ *  a lower bound and skip whole blocks of window starts whose upper bound
+ *  (the largest prefix sum reachable from the block minus the smallest prefix
+ *  sum in it) can't beat it. Only the few blocks which survive are scanned,
+ *  which in practice makes the cost close to linear in the number of blocks.
+ *
+ * Parameters:
+ *  p - the `n + 1` prefix sums of the series.
+ *  n - the number of values in the series.
+ *  best - set to the best sum over `d` seconds in `best[d - 1]`.
+ *
+ * Return value:
+ *  0 - the curve was computed.
+ *  1 - unable to allocate the bounds.
+ */
+static int best_windows(const double *p, size_t n, double *best) {
+  double *reach, *lowest, sum, s;
+  size_t d, i, k, start = 0, end, blocks = n / MEANMAX_BLOCK + 1;
+
+  if (!(reach = malloc((n + 1 + blocks) * sizeof(*reach)))) return 1;
+  lowest = reach + n + 1;
+
+  if (window_max(p, n + 1, reach)) {
+    free(reach);
+    return 1;
+  }
+  for (k = 0; k < blocks; k++) {
+    lowest[k] = DBL_MAX;
+    end = (k + 1) * MEANMAX_BLOCK;
+    for (i = k * MEANMAX_BLOCK; i < end && i <= n; i++) {
+      lowest[k] = p[i] < lowest[k] ? p[i] : lowest[k];
+    }
+  }
+
+  for (d = 1; d <= n; d++) {
+    /* seed with the previous best window grown by one on either side */
+    if (start + d > n) start = n - d;
+    sum = p[start + d] - p[start];
+    if (start && (s = p[start - 1 + d] - p[start - 1]) > sum) {
+      sum = s;
+      start--;
+    }
+
+    for (k = 0; k * MEANMAX_BLOCK <= n - d; k++) {
+      i = k * MEANMAX_BLOCK;
+      if (reach[i + d] - lowest[k] <= sum) continue;
+
+      end = i + MEANMAX_BLOCK < n - d + 1 ? i + MEANMAX_BLOCK : n - d + 1;
+      if (scan_block(p, d, i, end) <= sum) continue;
+      for (; i < end; i++) {
+        if ((s = p[i + d] - p[i]) > sum) {
+          sum = s;
+          start = i;
+        }
+      }
+    }
+
+    best[d - 1] = sum;
+  }
+
+  free(reach);
+  return 0;
+}
+
+/**
+ * meanmax_new
+ *
+ * Description:
+ *  Compute the mean-maximal curve for `field` over the `Activity`. The values
+ *  are first laid out on a 1 second grid (see `fill_series`), so the curve is
+ *  well defined for smart recording as well as 1 second recording. Intended
+ *  for `Power`, `Speed` and `HeartRate`, though any field other than
+ *  `Timestamp` works. The result must be free'd with `meanmax_destroy`.
+ *
+ * Parameters:
+ *  a - the `Activity` to compute the curve for.
+ *  field - the `DataField` to compute the curve for.
+ *
+ * Return value:
+ *  NULL - unable to allocate the curve.
+ *  valid pointer - the curve, which is empty if the `Activity` has no
+ *                  timestamps.
+ */
+MeanMax *meanmax_new(Activity *a, DataField field) {
+  MeanMax *m;
+  double *x, *p;
+  size_t n, i;
+
+  assert(a != NULL && field != Timestamp);
+
+  if (!(m = malloc(sizeof(*m)))) return NULL;
+  m->field = field;
+  m->length = 0;
+  m->best = NULL;
+
+  if (!(x = fill_series(a, field, &n))) {
+    if (!n) return m;
+    free(m);
+    return NULL;
+  }
+
+  if (!(p = malloc((n + 1) * sizeof(*p)))) goto fail;
+  p[0] = 0;
+  for (i = 0; i < n; i++) p[i + 1] = p[i] + x[i];
+  free(x);
+  x = NULL;
+
+  if (!(m->best = malloc(n * sizeof(*(m->best))))) goto fail;
+  if (best_windows(p, n, m->best)) goto fail;
+  for (i = 0; i < n; i++) m->best[i] /= (i + 1);
+  m->length = n;
+
+  free(p);
+  return m;
+
+fail:
+  if (x) free(x);
+  if (p) free(p);
+  if (m->best) free(m->best);
+  free(m);
+  return NULL;
+}
+
+/**
+ * meanmax_destroy
+ *
+ * Description:
+ *  Frees a `MeanMax` curve created by `meanmax_new`.
+ *
+ * Parameters:
+ *  m - a non-NULL `MeanMax` pointer.
+ */
+void meanmax_destroy(MeanMax *m) {
+  assert(m != NULL);
+
+  if (m->best) free(m->best);
+  free(m);
+}
+
+/**
+ * meanmax_curve_new
+ *
+ * Description:
+ *  Compute the compact mean-maximal curve for `field` over the `Activity`,
+ *  keeping only the durations on the grid shared by all curves. The result
+ *  must be free'd with `meanmax_curve_destroy`.
+ *
+ * Parameters:
+ *  a - the `Activity` to compute the curve for.
+ *  field - the `DataField` to compute the curve for.
+ *
+ * Return value:
+ *  NULL - unable to allocate the curve.
+ *  valid pointer - the curve.
+ */
+MeanMaxCurve *meanmax_curve_new(Activity *a, DataField field) {
+  MeanMaxCurve *c;
+  MeanMax *m;
+  size_t d, i;
+
+  if (!(m = meanmax_new(a, field))) return NULL;
+  if (!(c = malloc(sizeof(*c)))) goto fail;
+  c->field = field;
+  c->size = 0;
+  c->bests = NULL;
+
+  for (d = 1; d <= m->length; d = meanmax_next_duration(d)) c->size++;
+  if (c->size && !(c->bests = malloc(c->size * sizeof(*(c->bests))))) {
+    free(c);
+    goto fail;
+  }
+
+  for (d = 1, i = 0; i < c->size; d = meanmax_next_duration(d), i++) {
+    c->bests[i].best = (float)m->best[d - 1];
+    c->bests[i].when = a->start_time;
+  }
+
+  meanmax_destroy(m);
+  return c;
+
+fail:
+  meanmax_destroy(m);
+  return NULL;
+}
+
+/**
+ * meanmax_curve_merge
+ *
+ * Description:
+ *  Merge `other` into `c`, keeping the better of the two for every duration.
+ *  `c` is extended if `other` covers longer durations.
+ *
+ * Parameters:
+ *  c - the curve to update, eg. a season curve.
+ *  other - the curve to merge in, eg. from a new activity.
+ *
+ * Return value:
+ *  0 - successfully merged the curves.
+ *  1 - the curves are for different fields or we were unable to extend `c`.
+ */
+int meanmax_curve_merge(MeanMaxCurve *c, MeanMaxCurve *other) {
+  MeanMaxBest *bests;
+  size_t i, n;
+
+  assert(c != NULL && other != NULL);
+
+  if (c->field != other->field) return 1;
+
+  n = c->size < other->size ? c->size : other->size;
+  for (i = 0; i < n; i++) {
+    if (other->bests[i].best > c->bests[i].best) c->bests[i] = other->bests[i];
+  }
+
+  if (other->size > c->size) {
+    bests = realloc(c->bests, other->size * sizeof(*bests));
+    if (!bests) return 1;
+    memcpy(bests + c->size, other->bests + c->size,
+           (other->size - c->size) * sizeof(*bests));
+    c->bests = bests;
+    c->size = other->size;
+  }
+
+  return 0;
+}
+
+/**
+ * meanmax_curve_write
+ *
+ * Description:
+ *  Write the curve to `f` as CSV, with a header naming the field followed by
+ *  the duration in seconds, best average and time set for each duration.
+ *
+ * Return value:
+ *  0 - successfully wrote the curve.
+ *  1 - unable to write the curve.
+ */
+int meanmax_curve_write(FILE *f, MeanMaxCurve *c) {
+  size_t d, i;
+
+  if (fprintf(f, "seconds,%s,when\n", DATA_FIELDS[c->field]) < 0) return 1;
+
+  for (d = 1, i = 0; i < c->size; d = meanmax_next_duration(d), i++) {
+    if (fprintf(f, "%lu,%.2f,%lu\n", (unsigned long)d,
+                (double)c->bests[i].best,
+                (unsigned long)c->bests[i].when) < 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * meanmax_curve_read
+ *
+ * Description:
+ *  Read a curve written by `meanmax_curve_write`. The durations must match
+ *  the grid shared by all curves.
+ *
+ * Return value:
+ *  NULL - unable to read the curve.
+ *  valid pointer - the curve, which must be free'd with
+ *                  `meanmax_curve_destroy`.
+ */
+MeanMaxCurve *meanmax_curve_read(FILE *f) {
+  MeanMaxCurve *c;
+  char buf[MEANMAX_LINE_SIZE], *name, *comma;
+  unsigned long seconds, when;
+  size_t d = 1, alloc = 0;
+  float best;
+  DataField i;
+
+  if (!fgets(buf, sizeof(buf), f) || strncmp(buf, "seconds,", 8)) return NULL;
+  name = buf + 8;
+  if (!(comma = strchr(name, ','))) return NULL;
+  *comma = '\0';
+  for (i = 0; i < DataFieldCount && strcmp(DATA_FIELDS[i], name); i++)
+    ;
+  if (i == DataFieldCount || i == Timestamp) return NULL;
+
+  if (!(c = malloc(sizeof(*c)))) return NULL;
+  c->field = i;
+  c->size = 0;
+  c->bests = NULL;
+
+  while (fgets(buf, sizeof(buf), f)) {
+    if (sscanf(buf, "%lu,%f,%lu", &seconds, &best, &when) != 3 ||
+        seconds != d)
+      goto fail;
+
+    ALLOC_GROW(c->bests, c->size + 1, alloc);
+    if (!(c->bests)) goto fail;
+    c->bests[c->size].best = best;
+    c->bests[c->size].when = (uint32_t)when;
+    c->size++;
+    d = meanmax_next_duration(d);
+  }
+
+  return c;
+
+fail:
+  meanmax_curve_destroy(c);
+  return NULL;
+}
+
+/**
+ * meanmax_curve_destroy
+ *
+ * Description:
+ *  Frees a `MeanMaxCurve`.
+ *
+ * Parameters:
+ *  c - a non-NULL `MeanMaxCurve` pointer.
+ */
+void meanmax_curve_destroy(MeanMaxCurve *c) {
+  assert(c != NULL);
+
+  if (c->bests) free(c->bests);
+  free(c);
+}
@@ -0,0 +1,112 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEANMAX_H_
+#define _MEANMAX_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "activity.h"
+
+/* the number of window starts whose bound is checked at once */
+#define MEANMAX_BLOCK 64
+/* gaps in the recording up to this many seconds hold the previous value,
+ * longer gaps count as zero */
+#define MEANMAX_MAX_GAP 5
+/* a `MeanMaxCurve` keeps every duration up to this many seconds, after which
+ * each duration is 1/MEANMAX_SPACING longer than the one before */
+#define MEANMAX_EXACT 600
+#define MEANMAX_SPACING 50
+#define MEANMAX_LINE_SIZE 64
+
+/**
+ * MeanMax
+ *
+ * Description:
+ *  The mean-maximal curve for a single `DataField` of an `Activity` - the best
+ *  average value sustained for every duration from 1 second up to the length
+ *  of the activity.
+ *
+ * Fields:
+ *  field - the `DataField` the curve is for.
+ *  length - the longest duration in seconds.
+ *  best - `best[d - 1]` is the best average over any `d` seconds.
+ */
+typedef struct {
+  DataField field;
+  size_t length;
+  double *best;
+} MeanMax;
+
+/**
+ * MeanMaxBest
+ *
+ * Description:
+ *  The best average for a single duration of a `MeanMaxCurve`.
+ *
+ * Fields:
+ *  best - the best average value.
+ *  when - the start time of the activity the best average comes from.
+ */
+typedef struct {
+  float best;
+  uint32_t when;
+} MeanMaxBest;
+
+/**
+ * MeanMaxCurve
+ *
+ * Description:
+ *  A compact mean-maximal curve which can be saved and merged with others.
+ *  Rather than every second it holds a fixed grid of durations shared by all
+ *  curves - each second up to `MEANMAX_EXACT` and then geometrically spaced -
+ *  so that merging is a pointwise max. Merging the curves of every activity
+ *  produces an athlete's season or all-time curve, and a new activity can be
+ *  merged into it without revisiting the old ones.
+ *
+ * Fields:
+ *  field - the `DataField` the curve is for.
+ *  size - the number of durations in `bests`.
+ *  bests - the best for each duration on the grid, in increasing duration.
+ */
+typedef struct {
+  DataField field;
+  size_t size;
+  MeanMaxBest *bests;
+} MeanMaxCurve;
+
+MeanMax *meanmax_new(Activity *a, DataField field);
+void meanmax_destroy(MeanMax *m);
+MeanMaxCurve *meanmax_curve_new(Activity *a, DataField field);
+int meanmax_curve_merge(MeanMaxCurve *c, MeanMaxCurve *other);
+int meanmax_curve_write(FILE *f, MeanMaxCurve *c);
+MeanMaxCurve *meanmax_curve_read(FILE *f);
+void meanmax_curve_destroy(MeanMaxCurve *c);
+
+/**
+ * meanmax_next_duration
+ *
+ * Description:
+ *  The duration which follows `d` on the grid used by `MeanMaxCurve`, which
+ *  starts at 1 second.
+ */
+static inline size_t meanmax_next_duration(size_t d) {
+  return d < MEANMAX_EXACT ? d + 1 : d + d / MEANMAX_SPACING;
+}
+
+#endif /* _MEANMAX_H_ */
@@ -0,0 +1,514 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "activity.h"
+#include "fitparse.h"
+#include "fix.h"
+#include "pipeline.h"
+#include "util.h"
+
+/* indexed by FileFormat */
+static const char *EXTENSIONS[] = {"csv", "gpx", "tcx", "fit", "csv"};
+
+/**
+ * Job
+ *
+ * Description:
+ *  A single file moving through the pipeline. Each stage fills in the next
+ *  piece of the job and hands it off to the following stage.
+ *
+ * Fields:
+ *  index - the position of the file in the inputs (and status) array.
+ *  input - the name of the file to read.
+ *  buf - the raw contents of the file, filled in by the prefetch stage.
+ *  len - the length of `buf`.
+ *  activity - the `Activity` built by the parse stage.
+ */
+typedef struct {
+  unsigned index;
+  char *input;
+  char *buf;
+  size_t len;
+  Activity *activity;
+} Job;
+
+/**
+ * Queue
+ *
+ * Description:
+ *  Bounded FIFO of jobs connecting two stages. Pushing blocks while the queue
+ *  is full and popping blocks while it is empty. Once every producer has
+ *  called `queue_close` and the queue drains, popping returns NULL.
+ *
+ * Fields:
+ *  jobs - ring buffer of `size` jobs.
+ *  head - the index of the oldest job in `jobs`.
+ *  count - the number of jobs currently queued.
+ *  producers - the number of stage workers still pushing into the queue.
+ */
+typedef struct {
+  Job **jobs;
+  unsigned size, head, count;
+  unsigned producers;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+} Queue;
+
+/**
+ * Pipeline
+ *
+ * Description:
+ *  State shared by all of the stage workers. `outputs` holds the name each
+ *  input is written to, or NULL if it isn't to be converted.
+ */
+typedef struct {
+  char **inputs;
+  char **outputs;
+  unsigned count;
+  PipelineOptions *options;
+  PipelineStatus *status;
+  Queue read, parsed, fixed;
+} Pipeline;
+
+static int queue_init(Queue *q, unsigned size, unsigned producers) {
+  if (!(q->jobs = malloc(size * sizeof(*(q->jobs))))) return 1;
+  q->size = size;
+  q->head = q->count = 0;
+  q->producers = producers;
+  pthread_mutex_init(&(q->lock), NULL);
+  pthread_cond_init(&(q->not_empty), NULL);
+  pthread_cond_init(&(q->not_full), NULL);
+  return 0;
+}
+
+static void queue_destroy(Queue *q) {
+  pthread_cond_destroy(&(q->not_full));
+  pthread_cond_destroy(&(q->not_empty));
+  pthread_mutex_destroy(&(q->lock));
+  free(q->jobs);
+}
+
+static void queue_push(Queue *q, Job *job) {
+  pthread_mutex_lock(&(q->lock));
+  while (q->count == q->size) pthread_cond_wait(&(q->not_full), &(q->lock));
+  q->jobs[(q->head + q->count) % q->size] = job;
+  q->count++;
+  pthread_cond_signal(&(q->not_empty));
+  pthread_mutex_unlock(&(q->lock));
+}
+
+static Job *queue_pop(Queue *q) {
+  Job *job = NULL;
+
+  pthread_mutex_lock(&(q->lock));
+  while (!q->count && q->producers)
+    pthread_cond_wait(&(q->not_empty), &(q->lock));
+  if (q->count) {
+    job = q->jobs[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&(q->not_full));
+  }
+  pthread_mutex_unlock(&(q->lock));
+  return job;
+}
+
+static void queue_close(Queue *q) {
+  pthread_mutex_lock(&(q->lock));
+  /* wake up every consumer so they can notice the queue has finished */
+  if (!--q->producers) pthread_cond_broadcast(&(q->not_empty));
+  pthread_mutex_unlock(&(q->lock));
+}
+
+static void finish_job(Pipeline *p, Job *job, PipelineStatus status) {
+  p->status[job->index] = status;
+  if (job->activity) activity_destroy(job->activity);
+  if (job->buf) free(job->buf);
+  free(job);
+}
+
+/**
+ * read_file
+ *
+ * Description:
+ *  Read the entire contents of the file named `filename` into memory.
+ *
+ * Parameters:
+ *  filename - the name of the file to read.
+ *  len - set to the number of bytes read.
+ *
+ * Return value:
+ *  NULL - unable to read the file or the file was empty.
+ *  valid pointer - the contents of the file. The caller must free it.
+ */
+static char *read_file(const char *filename, size_t *len) {
+  FILE *f;
+  char *buf;
+
+  if (!(f = fopen(filename, "rb"))) return NULL;
+  buf = read_all(f, len);
+  fclose(f);
+
+  if (buf && !*len) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/**
+ * output_name
+ *
+ * Description:
+ *  Derive the name of the file to write by swapping the extension of
+ *  `input` for the one which matches `format`.
+ *
+ * Return value:
+ *  NULL - unable to allocate the name.
+ *  valid pointer - the output name. The caller must free it.
+ */
+static char *output_name(const char *input, FileFormat format) {
+  char *name;
+  const char *ext = EXTENSIONS[format];
+  size_t len = strlen(input);
+
+  if (!(name = malloc(len + strlen(ext) + 2))) return NULL;
+  strcpy(name, input);
+  if (!change_extension(name, (char *)ext)) {
+    name[len] = '.';
+    strcpy(name + len + 1, ext);
+  }
+  return name;
+}
+
+/**
+ * prefetch_stage
+ *
+ * Description:
+ *  Reads each input file into memory so that disk latency for the next files
+ *  overlaps with the parsing and writing of the previous ones. Only
+ *  `queue_size` files are ever held in memory waiting to be parsed.
+ */
+static void *prefetch_stage(void *data) {
+  Pipeline *p = (Pipeline *)data;
+  Job *job;
+  unsigned i;
+
+  for (i = 0; i < p->count; i++) {
+    if (!p->outputs[i]) continue;
+    if (!(job = calloc(1, sizeof(*job)))) {
+      p->status[i] = PipelineReadError;
+      continue;
+    }
+    job->index = i;
+    job->input = p->inputs[i];
+    if (!(job->buf = read_file(job->input, &(job->len)))) {
+      finish_job(p, job, PipelineReadError);
+      continue;
+    }
+    queue_push(&(p->read), job);
+  }
+
+  queue_close(&(p->read));
+  return NULL;
+}
+
+/**
+ * parse_stage
+ *
+ * Description:
+ *  Parses the in-memory contents of a file into an `Activity`. The raw buffer
+ *  is released as soon as parsing is done.
+ */
+static void *parse_stage(void *data) {
+  Pipeline *p = (Pipeline *)data;
+  Job *job;
+  FILE *f;
+  char ext[4];
+  FileFormat format;
+
+  while ((job = queue_pop(&(p->read)))) {
+    strncpy(ext, extension(job->input), sizeof(ext) - 1);
+    ext[sizeof(ext) - 1] = '\0';
+    downcase(ext);
+    format = file_format(ext);
+
+    if ((f = fmemopen(job->buf, job->len, "r"))) {
+      job->activity = (format != UnknownFileFormat)
+                          ? fitparse_read_format_file(f, format)
+                          : fitparse_read_file(f);
+      fclose(f);
+    }
+    free(job->buf);
+    job->buf = NULL;
+
+    if (!job->activity) {
+      finish_job(p, job, PipelineParseError);
+      continue;
+    }
+    queue_push(&(p->parsed), job);
+  }
+
+  queue_close(&(p->parsed));
+  return NULL;
+}
+
+/**
+ * fix_stage
+ *
+ * Description:
+ *  Cleans up the data in each parsed `Activity`.
+ */
+static void *fix_stage(void *data) {
+  Pipeline *p = (Pipeline *)data;
+  Job *job;
+
+  while ((job = queue_pop(&(p->parsed)))) {
+    if (p->options->fixes) fix_activity(job->activity, p->options->fixes);
+    queue_push(&(p->fixed), job);
+  }
+
+  queue_close(&(p->fixed));
+  return NULL;
+}
+
+/**
+ * write_stage
+ *
+ * Description:
+ *  Serializes each `Activity` next to its input file in the requested format.
+ *  We refuse to write over the input file itself.
+ */
+static void *write_stage(void *data) {
+  Pipeline *p = (Pipeline *)data;
+  Job *job;
+  char *name;
+  PipelineStatus status;
+
+  while ((job = queue_pop(&(p->fixed)))) {
+    status = PipelineWriteError;
+    name = p->outputs[job->index];
+    if (strcmp(name, job->input) &&
+        !fitparse_write_format(name, p->options->format, job->activity)) {
+      status = PipelineOK;
+    }
+    finish_job(p, job, status);
+  }
+
+  return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(**(char *const *const *)a, **(char *const *const *)b);
+}
+
+/**
+ * name_outputs
+ *
+ * Description:
+ *  Work out the name each input is written to. Inputs which would be written
+ *  to the same file, eg. `a.gpx` and `a.tcx`, are marked as conflicting
+ *  rather than having their writers race over the file.
+ *
+ * Parameters:
+ *  p - the `Pipeline` to fill in the `outputs` of.
+ *
+ * Return value:
+ *  0 - successfully named the outputs, some of which may be NULL.
+ *  1 - unable to allocate the names.
+ */
+static int name_outputs(Pipeline *p) {
+  char ***sorted;
+  unsigned i, j, k;
+
+  if (!(p->outputs = calloc(p->count, sizeof(*(p->outputs))))) return 1;
+  if (!(sorted = malloc(p->count * sizeof(*sorted)))) return 1;
+
+  for (i = 0, k = 0; i < p->count; i++) {
+    if (!(p->outputs[i] = output_name(p->inputs[i], p->options->format))) {
+      p->status[i] = PipelineWriteError;
+    } else {
+      sorted[k++] = &(p->outputs[i]);
+    }
+  }
+
+  /* the same names end up next to each other */
+  qsort(sorted, k, sizeof(*sorted), compare_names);
+  for (i = 0; i < k; i = j) {
+    for (j = i + 1; j < k && !strcmp(*sorted[i], *sorted[j]); j++)
+      ;
+    if (j - i < 2) continue;
+    for (; i < j; i++) {
+      p->status[sorted[i] - p->outputs] = PipelineOutputConflict;
+      free(*sorted[i]);
+      *sorted[i] = NULL;
+    }
+  }
+
+  free(sorted);
+  return 0;
+}
+
+static void free_outputs(Pipeline *p) {
+  unsigned i;
+
+  if (!p->outputs) return;
+  for (i = 0; i < p->count; i++) {
+    if (p->outputs[i]) free(p->outputs[i]);
+  }
+  free(p->outputs);
+}
+
+/**
+ * start_stage
+ *
+ * Description:
+ *  Start up to `n` workers for a stage. Each worker which doesn't start is
+ *  closed as a producer of the stage's output queue straight away, so that
+ *  the stages after it can still drain and finish.
+ *
+ * Parameters:
+ *  threads - set to the `n` workers.
+ *  n - the number of workers to start.
+ *  ready - whether the stage can run at all, ie. the stage it feeds has at
+ *          least one worker to take its jobs.
+ *  stage - the function each worker runs.
+ *  p - the `Pipeline` the workers are part of.
+ *  out - the queue the stage pushes into, or NULL.
+ *
+ * Return value:
+ *  The number of workers which were started, which are the first of
+ *  `threads`.
+ */
+static unsigned start_stage(pthread_t *threads, unsigned n, bool ready,
+                            void *(*stage)(void *), Pipeline *p, Queue *out) {
+  unsigned i, j;
+
+  for (i = 0; ready && i < n; i++) {
+    if (pthread_create(&threads[i], NULL, stage, p)) break;
+  }
+  for (j = i; out && j < n; j++) queue_close(out);
+  return i;
+}
+
+/**
+ * pipeline_run
+ *
+ * Description:
+ *  Convert each of the `inputs` to the format given in `o`, writing each
+ *  result next to its input. Reading, parsing, fixing and writing run as
+ *  separate stages connected by bounded queues so that I/O for one file
+ *  overlaps with CPU work on the others, and files of very different sizes
+ *  do not leave workers idle.
+ *
+ * Parameters:
+ *  inputs - the names of the files to convert.
+ *  count - the number of names in `inputs`.
+ *  o - the options to use for the conversion.
+ *  status - optional array of `count` entries which is filled in with the
+ *           outcome for each input.
+ *
+ * Return value:
+ *  0 - every file was converted successfully.
+ *  n - the number of files which could not be converted.
+ */
+unsigned pipeline_run(char **inputs, unsigned count, PipelineOptions *o,
+                      PipelineStatus *status) {
+  Pipeline p;
+  pthread_t prefetch, *workers, *first[4];
+  unsigned i, k, total, size, errors = 0, n[4], started[4];
+  PipelineStatus *s = status;
+
+  assert(inputs != NULL && o != NULL);
+
+  if (!count) return 0;
+  if (!s && !(s = malloc(count * sizeof(*s)))) return count;
+
+  /* the workers come out of one budget. Parsing is the most work, so it gets
+   * whatever the fix and write stages don't, but each stage needs one */
+  if (!(total = o->threads)) total = online_cpus();
+  n[0] = 1;
+  n[2] = n[3] = total / 4 ? total / 4 : 1;
+  n[1] = total > n[2] + n[3] + 1 ? total - n[2] - n[3] : 1;
+
+  p.inputs = inputs;
+  p.count = count;
+  p.options = o;
+  p.status = s;
+  p.outputs = NULL;
+
+  /* any file which never makes it through is left as a read error */
+  for (i = 0; i < count; i++) s[i] = PipelineReadError;
+  if (name_outputs(&p)) goto fail;
+
+  size = o->queue_size ? o->queue_size : 1;
+  if (!(workers = malloc((n[1] + n[2] + n[3]) * sizeof(*workers))))
+    goto fail;
+  first[0] = &prefetch;
+  first[1] = workers;
+  first[2] = first[1] + n[1];
+  first[3] = first[2] + n[2];
+  if (queue_init(&(p.read), size, n[0])) goto fail_workers;
+  if (queue_init(&(p.parsed), size, n[1])) goto fail_read;
+  if (queue_init(&(p.fixed), size, n[2])) goto fail_parsed;
+
+  /* start from the end of the pipeline, so that a stage which couldn't start
+   * any workers stops everything before it starting instead of leaving it
+   * blocked on a full queue */
+  started[3] = start_stage(first[3], n[3], true, write_stage, &p, NULL);
+  started[2] = start_stage(first[2], n[2], started[3] > 0, fix_stage, &p,
+                           &(p.fixed));
+  started[1] = start_stage(first[1], n[1], started[2] > 0, parse_stage, &p,
+                           &(p.parsed));
+  started[0] = start_stage(first[0], n[0], started[1] > 0, prefetch_stage, &p,
+                           &(p.read));
+
+  for (k = 0; k < 4; k++) {
+    for (i = 0; i < started[k]; i++) pthread_join(first[k][i], NULL);
+  }
+
+  queue_destroy(&(p.fixed));
+  queue_destroy(&(p.parsed));
+  queue_destroy(&(p.read));
+  free(workers);
+  free_outputs(&p);
+
+  for (i = 0; i < count; i++) {
+    if (s[i] != PipelineOK) errors++;
+  }
+
+  if (!status) free(s);
+  return errors;
+
+fail_parsed:
+  queue_destroy(&(p.parsed));
+fail_read:
+  queue_destroy(&(p.read));
+fail_workers:
+  free(workers);
+fail:
+  free_outputs(&p);
+  for (i = 0; i < count; i++) s[i] = PipelineReadError;
+  if (!status) free(s);
+  return count;
+}
@@ -0,0 +1,67 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include "activity.h"
+#include "fix.h"
+
+#define DEFAULT_PIPELINE_OPTIONS \
+  { UnknownFileFormat, 0, 4, 0 }
+
+/**
+ * PipelineOptions
+ *
+ * Description:
+ *  Structure used to specify how a batch of files should be converted.
+ *
+ * Fields:
+ *  format - the format to write each file out in. `UnknownFileFormat` means
+ *           the default write format.
+ *  threads - the number of workers shared between the parse, fix and write
+ *            stages, at least one each. 0 means one worker per online CPU.
+ *  queue_size - the number of files which may be waiting between any two
+ *               stages. Bounds how far the prefetch stage can read ahead.
+ *  fixes - the fixes to run on each `Activity`, see `fix_activity`. None
+ *          are run by default.
+ */
+typedef struct {
+  FileFormat format;
+  unsigned threads;
+  unsigned queue_size;
+  unsigned fixes;
+} PipelineOptions;
+
+/**
+ * PipelineStatus
+ *
+ * Description:
+ *  The outcome of converting a single file in the batch.
+ */
+typedef enum {
+  PipelineOK,
+  PipelineReadError,
+  PipelineParseError,
+  PipelineWriteError,
+  PipelineOutputConflict /* another input would be written to the same file */
+} PipelineStatus;
+
+unsigned pipeline_run(char **inputs, unsigned count, PipelineOptions *o,
+                      PipelineStatus *status);
+
+#endif /* _PIPELINE_H_ */
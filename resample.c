@@ -0,0 +1,237 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+
+#include "resample.h"
+#include "util.h"
+
+/* indexed by DataField */
+static const ResamplePolicy DEFAULT_POLICIES[] = {
+    ResampleHold,   /* Timestamp */
+    ResampleLinear, /* Latitude */
+    ResampleLinear, /* Longitude */
+    ResampleLinear, /* Altitude */
+    ResampleLinear, /* Distance */
+    ResampleZero,   /* Speed */
+    ResampleZero,   /* Power */
+    ResampleLinear, /* Grade */
+    ResampleLinear, /* HeartRate */
+    ResampleZero,   /* Cadence */
+    ResampleHold,   /* LRBalance */
+    ResampleHold    /* Temperature */
+};
+
+/**
+ * resample_options_init
+ *
+ * Description:
+ *  Fill in the default `ResampleOptions`: a point every second, with
+ *  positions, distance and heart rate interpolated, speed, power and cadence
+ *  dropping to zero across gaps and everything else held.
+ *
+ * Parameters:
+ *  o - the `ResampleOptions` to fill in.
+ */
+void resample_options_init(ResampleOptions *o) {
+  DataField i;
+
+  o->interval = DEFAULT_RESAMPLE_INTERVAL;
+  o->max_gap = DEFAULT_RESAMPLE_MAX_GAP;
+  for (i = 0; i < DataFieldCount; i++) o->policies[i] = DEFAULT_POLICIES[i];
+}
+
+/**
+ * Resampler
+ *
+ * Description:
+ *  The state of the single pass over the points being resampled.
+ *
+ * Fields:
+ *  a - the `Activity` being resampled.
+ *  next_point - the first point which hasn't been passed yet.
+ *  latest - the latest timestamp passed so far. Points with an earlier
+ *           timestamp are out of order and ignored.
+ *  prev - the last point passed with each field, or `num_points` if none.
+ *  next - the first point from `next_point` on with each field and a later
+ *         timestamp, or `num_points` if none. Found again once `next_point`
+ *         passes it.
+ */
+typedef struct {
+  Activity *a;
+  size_t next_point;
+  double latest;
+  size_t prev[DataFieldCount];
+  size_t next[DataFieldCount];
+} Resampler;
+
+static double time_of(Resampler *r, size_t j) {
+  return r->a->data_points[j].data[Timestamp];
+}
+
+/* pass every point recorded at or before `t` */
+static void advance(Resampler *r, double t) {
+  DataPoint *dp;
+  DataField i;
+  size_t j, n = r->a->num_points;
+
+  for (; r->next_point < n; r->next_point++) {
+    j = r->next_point;
+    dp = &(r->a->data_points[j]);
+    if (!SET(dp->data[Timestamp])) continue;
+    if (dp->data[Timestamp] > t) break;
+    if (dp->data[Timestamp] < r->latest) continue;
+
+    r->latest = dp->data[Timestamp];
+    for (i = 0; i < DataFieldCount; i++) {
+      if (SET(dp->data[i])) r->prev[i] = j;
+    }
+  }
+
+  /* each next only ever moves forward, so finding them costs O(n) in all */
+  for (i = 0; i < DataFieldCount; i++) {
+    if (r->next[i] >= r->next_point && r->next[i] < n) continue;
+    for (j = r->next[i] > r->next_point ? r->next[i] : r->next_point; j < n;
+         j++) {
+      dp = &(r->a->data_points[j]);
+      if (SET(dp->data[i]) && SET(dp->data[Timestamp]) &&
+          dp->data[Timestamp] > t)
+        break;
+    }
+    r->next[i] = j;
+  }
+}
+
+/* the value of field `i` at time `t`, between its readings at `prev` and
+ * `next` */
+static double resample_field(Resampler *r, ResampleOptions *o, DataField i,
+                             double t) {
+  size_t p = r->prev[i], q = r->next[i], n = r->a->num_points;
+  double tp, v0, v1;
+  bool gap;
+
+  if (p == n) return UNSET_FIELD;
+  tp = time_of(r, p);
+  v0 = r->a->data_points[p].data[i];
+  if (t == tp) return v0;
+  gap = q == n || time_of(r, q) - tp > o->max_gap;
+
+  switch (o->policies[i]) {
+    case ResampleLinear:
+      if (gap) return UNSET_FIELD;
+      v1 = r->a->data_points[q].data[i];
+      return v0 + (v1 - v0) * (t - tp) / (time_of(r, q) - tp);
+    case ResampleZero:
+      return gap ? 0 : v0;
+    default:
+      return v0;
+  }
+}
+
+/* carry the lap or break starting at or before `point` over to `index` */
+static int map_start(Vector *from, size_t *next, size_t point, Vector *to,
+                     size_t index) {
+  if (*next >= from->size || from->data[*next] >= point) return 0;
+  while (*next < from->size && from->data[*next] < point) (*next)++;
+  if (to->size && to->data[to->size - 1] == index) return 0;
+  return vector_add(to, (uint32_t)index);
+}
+
+/**
+ * resample_activity_options
+ *
+ * Description:
+ *  Resample the `Activity` onto a uniform timeline with a point every
+ *  `interval` seconds from the first timestamp, which makes rolling windows
+ *  and mean-maximal curves over it simpler and faster. Each field is worked
+ *  out from the readings either side of each resampled point according to
+ *  its `ResamplePolicy`, which also fills any gaps in the recording, eg.
+ *  from smart recording. The points are resampled in a single pass straight
+ *  into an `Activity` allocated up front. Points without a timestamp, or
+ *  with one earlier than a point before them, are ignored. Laps and breaks
+ *  start at the first resampled point at or after they did, apart from the
+ *  breaks found by pause detection, which are found again over the
+ *  resampled points.
+ *
+ * Parameters:
+ *  a - the finalized `Activity` to resample.
+ *  o - the `ResampleOptions` to resample with.
+ *
+ * Return value:
+ *  NULL - `a` has no timestamps or we were unable to resample it.
+ *  valid pointer - the resampled `Activity`, which must be free'd with a call
+ *                  to `activity_destroy`.
+ */
+Activity *resample_activity_options(Activity *a, ResampleOptions *o) {
+  Activity *resampled;
+  Resampler r;
+  DataPoint dp;
+  DataField i;
+  Vector breaks = {0};
+  double t, start, end;
+  size_t k, count, lap = 0, brk = 0;
+
+  assert(a != NULL && o != NULL && o->interval > 0);
+
+  start = a->summary.point[Minimum].data[Timestamp];
+  end = a->summary.point[Maximum].data[Timestamp];
+  if (!a->num_points || !SET(start) || !SET(end)) return NULL;
+  count = (size_t)floor((end - start) / o->interval) + 1;
+
+  if (!(resampled = activity_new())) return NULL;
+  resampled->sport = a->sport;
+  resampled->format = a->format;
+  resampled->derived = a->derived;
+  if (activity_reserve(resampled, count) ||
+      activity_recorded_breaks(a, &breaks))
+    goto error;
+
+  r.a = a;
+  r.next_point = 0;
+  r.latest = -DBL_MAX;
+  for (i = 0; i < DataFieldCount; i++) {
+    r.prev[i] = a->num_points;
+    r.next[i] = 0;
+  }
+
+  for (k = 0; k < count; k++) {
+    t = start + (double)k * o->interval;
+    advance(&r, t);
+
+    for (i = 0; i < DataFieldCount; i++) {
+      dp.data[i] = i == Timestamp ? t : resample_field(&r, o, i, t);
+    }
+    if (activity_append_point(resampled, &dp) ||
+        map_start(&(a->laps), &lap, r.next_point, &(resampled->laps), k) ||
+        map_start(&breaks, &brk, r.next_point, &(resampled->breaks), k))
+      goto error;
+  }
+
+  /* the first lap and segment also cover anything recorded before them */
+  if (resampled->laps.size) resampled->laps.data[0] = 0;
+  if (resampled->breaks.size) resampled->breaks.data[0] = 0;
+
+  vector_destroy(&breaks);
+  activity_finalize(resampled);
+  return resampled;
+
+error:
+  vector_destroy(&breaks);
+  activity_destroy(resampled);
+  return NULL;
+}
@@ -0,0 +1,89 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include "activity.h"
+
+#define DEFAULT_RESAMPLE_INTERVAL 1
+/* readings further apart than this many seconds are on either side of a
+ * gap in the recording, eg. a pause */
+#define DEFAULT_RESAMPLE_MAX_GAP 10
+
+/**
+ * ResamplePolicy
+ *
+ * Description:
+ *  How the value of a field is worked out at a time between its readings.
+ *
+ *  ResampleLinear - interpolated between the readings either side, and
+ *                   unset across a gap.
+ *  ResampleHold - the last reading, even across a gap.
+ *  ResampleZero - the last reading, and zero across a gap, eg. for power
+ *                 when the device stopped recording because we stopped.
+ */
+typedef enum { ResampleLinear, ResampleHold, ResampleZero } ResamplePolicy;
+
+/**
+ * ResampleOptions
+ *
+ * Description:
+ *  Structure used to specify how an `Activity` should be resampled. Use
+ *  `resample_options_init` to fill in the default policies.
+ *
+ * Fields:
+ *  interval - the time in seconds between the resampled points.
+ *  max_gap - readings further apart than this many seconds are on either
+ *            side of a gap.
+ *  policies - the `ResamplePolicy` for each field. The timestamp is always
+ *             the time of the resampled point.
+ */
+typedef struct {
+  double interval;
+  double max_gap;
+  ResamplePolicy policies[DataFieldCount];
+} ResampleOptions;
+
+void resample_options_init(ResampleOptions *o);
+Activity *resample_activity_options(Activity *a, ResampleOptions *o);
+
+/**
+ * resample_activity
+ *
+ * Description:
+ *  Resample the `Activity` to a point every `interval` seconds with the
+ *  default policies.
+ *
+ * Parameters:
+ *  a - the `Activity` to resample.
+ *  interval - the time in seconds between the resampled points.
+ *
+ * Return value:
+ *  NULL - unable to resample the `Activity`.
+ *  valid pointer - the resampled `Activity`, which must be free'd with a call
+ *                  to `activity_destroy`.
+ */
+static inline Activity *resample_activity(Activity *a, double interval) {
+  ResampleOptions o;
+
+  resample_options_init(&o);
+  o.interval = interval;
+  return resample_activity_options(a, &o);
+}
+
+#endif /* _RESAMPLE_H_ */
@@ -0,0 +1,369 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rolling.h"
+#include "util.h"
+
+static RollingSample *queue_at(RollingQueue *q, size_t i) {
+  return &(q->samples[(q->head + i) % q->alloc]);
+}
+
+static int queue_push(RollingQueue *q, RollingSample *s) {
+  RollingSample *samples;
+  size_t i, alloc;
+
+  if (q->count == q->alloc) {
+    /* unwrap the ring into the larger buffer so the oldest is first again */
+    alloc = alloc_nr(q->alloc);
+    if (!(samples = malloc(alloc * sizeof(*samples)))) return 1;
+    for (i = 0; i < q->count; i++) samples[i] = *queue_at(q, i);
+    if (q->samples) free(q->samples);
+    q->samples = samples;
+    q->alloc = alloc;
+    q->head = 0;
+  }
+
+  *queue_at(q, q->count) = *s;
+  q->count++;
+  return 0;
+}
+
+static void queue_pop_front(RollingQueue *q) {
+  q->head = (q->head + 1) % q->alloc;
+  q->count--;
+}
+
+/**
+ * rolling_new
+ *
+ * Description:
+ *  Instantiates a new `Rolling` window over `field`. If a valid pointer is
+ *  returned it must be free'd with a call to `rolling_destroy`.
+ *
+ * Parameters:
+ *  field - the `DataField` to track.
+ *  window - the length of the window in seconds, eg. 3, 10 or 30.
+ *
+ * Return value:
+ *  NULL - unable to create a new `Rolling` object.
+ *  valid pointer - the pointer to the `Rolling` window.
+ */
+Rolling *rolling_new(DataField field, double window) {
+  Rolling *r;
+
+  assert(field != Timestamp && window > 0);
+
+  if (!(r = malloc(sizeof(*r)))) return NULL;
+
+  r->field = field;
+  r->window = window;
+  r->sum = 0;
+  r->latest = -DBL_MAX;
+  memset(&(r->all), 0, sizeof(r->all));
+  memset(&(r->max), 0, sizeof(r->max));
+  memset(&(r->min), 0, sizeof(r->min));
+
+  return r;
+}
+
+/**
+ * rolling_destroy
+ *
+ * Description:
+ *  Destroys a `Rolling` window created by `rolling_new`.
+ *
+ * Parameters:
+ *  r - a non-NULL `Rolling` pointer.
+ */
+void rolling_destroy(Rolling *r) {
+  assert(r != NULL);
+
+  if (r->all.samples) free(r->all.samples);
+  if (r->max.samples) free(r->max.samples);
+  if (r->min.samples) free(r->min.samples);
+  free(r);
+}
+
+/**
+ * rolling_add
+ *
+ * Description:
+ *  Add the next `DataPoint` to the window, dropping the samples which are now
+ *  more than `window` seconds older than it. Points without the field being
+ *  tracked still move the window along. Points without a timestamp, or which
+ *  go back in time, are ignored.
+ *
+ * Parameters:
+ *  r - the `Rolling` window to update.
+ *  dp - the `DataPoint` to add.
+ *
+ * Return value:
+ *  0 - the point was added or ignored.
+ *  1 - unable to grow the window.
+ */
+int rolling_add(Rolling *r, DataPoint *dp) {
+  RollingSample s;
+  double start;
+
+  s.timestamp = dp->data[Timestamp];
+  s.value = dp->data[r->field];
+  if (!SET(s.timestamp) || s.timestamp < r->latest) return 0;
+  r->latest = s.timestamp;
+
+  /* evict everything which has fallen out of the window */
+  start = s.timestamp - r->window;
+  while (r->all.count && queue_at(&(r->all), 0)->timestamp <= start) {
+    r->sum -= queue_at(&(r->all), 0)->value;
+    queue_pop_front(&(r->all));
+  }
+  while (r->max.count && queue_at(&(r->max), 0)->timestamp <= start)
+    queue_pop_front(&(r->max));
+  while (r->min.count && queue_at(&(r->min), 0)->timestamp <= start)
+    queue_pop_front(&(r->min));
+
+  if (!SET(s.value)) return 0;
+
+  /* older samples which are beaten by the new one can never be the extreme */
+  while (r->max.count &&
+         queue_at(&(r->max), r->max.count - 1)->value <= s.value)
+    r->max.count--;
+  while (r->min.count &&
+         queue_at(&(r->min), r->min.count - 1)->value >= s.value)
+    r->min.count--;
+
+  if (queue_push(&(r->all), &s) || queue_push(&(r->max), &s) ||
+      queue_push(&(r->min), &s))
+    return 1;
+  r->sum += s.value;
+
+  /* restart the sum when the window empties so rounding can't accumulate */
+  if (r->all.count == 1) r->sum = s.value;
+  return 0;
+}
+
+/**
+ * rolling_mean
+ *
+ * Description:
+ *  The mean of the values within the window.
+ *
+ * Return value:
+ *  UNSET_FIELD - there are no values within the window.
+ *  double - the mean of the values.
+ */
+double rolling_mean(Rolling *r) {
+  return r->all.count ? r->sum / r->all.count : UNSET_FIELD;
+}
+
+/**
+ * rolling_max
+ *
+ * Description:
+ *  The largest value within the window.
+ *
+ * Return value:
+ *  UNSET_FIELD - there are no values within the window.
+ *  double - the largest value.
+ */
+double rolling_max(Rolling *r) {
+  return r->max.count ? queue_at(&(r->max), 0)->value : UNSET_FIELD;
+}
+
+/**
+ * rolling_min
+ *
+ * Description:
+ *  The smallest value within the window.
+ *
+ * Return value:
+ *  UNSET_FIELD - there are no values within the window.
+ *  double - the smallest value.
+ */
+double rolling_min(Rolling *r) {
+  return r->min.count ? queue_at(&(r->min), 0)->value : UNSET_FIELD;
+}
+
+/* the heap of a `RollingMedian` which holds the lower half of the values */
+#define LOWER 0
+#define UPPER 1
+
+/* whether slot `a` belongs above slot `b` in heap `h` */
+static bool heap_before(RollingMedian *m, MedianHeap *h, size_t a, size_t b) {
+  return h->sign * (m->values[a] - m->values[b]) > 0;
+}
+
+static void heap_set(RollingMedian *m, MedianHeap *h, size_t i, size_t slot) {
+  h->slots[i] = slot;
+  m->position[slot] = i;
+}
+
+static void heap_sift(RollingMedian *m, MedianHeap *h, size_t i) {
+  size_t slot = h->slots[i], child;
+
+  while (i && heap_before(m, h, slot, h->slots[(i - 1) / 2])) {
+    heap_set(m, h, i, h->slots[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  while ((child = 2 * i + 1) < h->size) {
+    if (child + 1 < h->size &&
+        heap_before(m, h, h->slots[child + 1], h->slots[child]))
+      child++;
+    if (!heap_before(m, h, h->slots[child], slot)) break;
+    heap_set(m, h, i, h->slots[child]);
+    i = child;
+  }
+  heap_set(m, h, i, slot);
+}
+
+static void heap_push(RollingMedian *m, unsigned char which, size_t slot) {
+  MedianHeap *h = &(m->heaps[which]);
+
+  m->heap[slot] = which;
+  heap_set(m, h, h->size++, slot);
+  heap_sift(m, h, h->size - 1);
+}
+
+static size_t heap_remove(RollingMedian *m, MedianHeap *h, size_t i) {
+  size_t slot = h->slots[i];
+
+  if (i != --h->size) {
+    heap_set(m, h, i, h->slots[h->size]);
+    heap_sift(m, h, i);
+  }
+  return slot;
+}
+
+/**
+ * rolling_median_new
+ *
+ * Description:
+ *  Instantiates a new `RollingMedian` over the last `window` values. If a
+ *  valid pointer is returned it must be free'd with a call to
+ *  `rolling_median_destroy`.
+ *
+ * Parameters:
+ *  window - the number of values in the window.
+ *
+ * Return value:
+ *  NULL - unable to create a new `RollingMedian` object.
+ *  valid pointer - the pointer to the `RollingMedian`.
+ */
+RollingMedian *rolling_median_new(size_t window) {
+  RollingMedian *m;
+
+  assert(window > 0);
+
+  if (!(m = malloc(sizeof(*m)))) return NULL;
+
+  m->window = window;
+  m->count = m->next = 0;
+  m->values = malloc(window * sizeof(*m->values));
+  m->heap = malloc(window * sizeof(*m->heap));
+  m->position = malloc(window * sizeof(*m->position));
+  m->heaps[LOWER].slots = malloc(window * sizeof(size_t));
+  m->heaps[UPPER].slots = malloc(window * sizeof(size_t));
+  m->heaps[LOWER].size = m->heaps[UPPER].size = 0;
+  m->heaps[LOWER].sign = 1;
+  m->heaps[UPPER].sign = -1;
+
+  if (!m->values || !m->heap || !m->position || !m->heaps[LOWER].slots ||
+      !m->heaps[UPPER].slots) {
+    rolling_median_destroy(m);
+    return NULL;
+  }
+  return m;
+}
+
+/**
+ * rolling_median_destroy
+ *
+ * Description:
+ *  Destroys a `RollingMedian` created by `rolling_median_new`.
+ *
+ * Parameters:
+ *  m - a non-NULL `RollingMedian` pointer.
+ */
+void rolling_median_destroy(RollingMedian *m) {
+  assert(m != NULL);
+
+  if (m->values) free(m->values);
+  if (m->heap) free(m->heap);
+  if (m->position) free(m->position);
+  if (m->heaps[LOWER].slots) free(m->heaps[LOWER].slots);
+  if (m->heaps[UPPER].slots) free(m->heaps[UPPER].slots);
+  free(m);
+}
+
+/**
+ * rolling_median_add
+ *
+ * Description:
+ *  Add the next value to the window, dropping the oldest value if the window
+ *  is full.
+ *
+ * Parameters:
+ *  m - the `RollingMedian` to update.
+ *  value - the value to add.
+ */
+void rolling_median_add(RollingMedian *m, double value) {
+  MedianHeap *lower = &(m->heaps[LOWER]), *upper = &(m->heaps[UPPER]);
+  size_t slot = m->next;
+
+  if (m->count == m->window) {
+    heap_remove(m, &(m->heaps[m->heap[slot]]), m->position[slot]);
+  } else {
+    m->count++;
+  }
+  m->next = (m->next + 1) % m->window;
+
+  m->values[slot] = value;
+  if (lower->size && value > m->values[lower->slots[0]]) {
+    heap_push(m, UPPER, slot);
+  } else {
+    heap_push(m, LOWER, slot);
+  }
+
+  /* keep the lower half the same size as the upper half or one larger */
+  if (lower->size > upper->size + 1) {
+    heap_push(m, UPPER, heap_remove(m, lower, 0));
+  } else if (upper->size > lower->size) {
+    heap_push(m, LOWER, heap_remove(m, upper, 0));
+  }
+}
+
+/**
+ * rolling_median
+ *
+ * Description:
+ *  The median of the values within the window.
+ *
+ * Return value:
+ *  UNSET_FIELD - there are no values within the window.
+ *  double - the median of the values.
+ */
+double rolling_median(RollingMedian *m) {
+  MedianHeap *lower = &(m->heaps[LOWER]), *upper = &(m->heaps[UPPER]);
+
+  if (!m->count) return UNSET_FIELD;
+  if (lower->size > upper->size) return m->values[lower->slots[0]];
+  return (m->values[lower->slots[0]] + m->values[upper->slots[0]]) / 2;
+}
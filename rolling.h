@@ -0,0 +1,134 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ROLLING_H_
+#define _ROLLING_H_
+
+#include "activity.h"
+
+/**
+ * RollingSample
+ *
+ * Description:
+ *  A single value of the field being tracked and when it was recorded.
+ */
+typedef struct {
+  double timestamp;
+  double value;
+} RollingSample;
+
+/**
+ * RollingQueue
+ *
+ * Description:
+ *  Growable ring buffer of samples which can be pushed at the back and popped
+ *  from either end.
+ *
+ * Fields:
+ *  samples - the ring buffer of `alloc` samples.
+ *  head - the index of the oldest sample in `samples`.
+ *  count - the number of samples currently queued.
+ */
+typedef struct {
+  RollingSample *samples;
+  size_t alloc, head, count;
+} RollingQueue;
+
+/**
+ * Rolling
+ *
+ * Description:
+ *  Streaming mean, maximum and minimum of a `DataField` over the last `window`
+ *  seconds. The maximum and minimum are kept in monotonic deques, so each
+ *  point added costs O(1) amortized regardless of the window length, and no
+ *  more samples are held than fall within the window.
+ *
+ * Fields:
+ *  field - the `DataField` being tracked.
+ *  window - the length of the window in seconds.
+ *  sum - the sum of the values within the window.
+ *  latest - the timestamp of the most recent point added.
+ *  all - every sample within the window, oldest first.
+ *  max - the samples which could still become the maximum, in decreasing
+ *        value.
+ *  min - the samples which could still become the minimum, in increasing
+ *        value.
+ */
+typedef struct {
+  DataField field;
+  double window;
+  double sum;
+  double latest;
+  RollingQueue all, max, min;
+} Rolling;
+
+/**
+ * MedianHeap
+ *
+ * Description:
+ *  A binary heap of the slots of a `RollingMedian`, ordered by their values.
+ *
+ * Fields:
+ *  slots - the slots in heap order.
+ *  size - the number of slots in the heap.
+ *  sign - 1 for a max-heap, -1 for a min-heap.
+ */
+typedef struct {
+  size_t *slots;
+  size_t size;
+  int sign;
+} MedianHeap;
+
+/**
+ * RollingMedian
+ *
+ * Description:
+ *  Streaming median of the last `window` values added. The smaller half of
+ *  the values are kept in a max-heap and the larger half in a min-heap, and
+ *  each heap tracks where every slot is so that the oldest value can be
+ *  removed from the middle of a heap. Adding a value costs O(log window).
+ *
+ * Fields:
+ *  window - the number of values in the window.
+ *  count - the number of values currently in the window.
+ *  next - the slot the next value is stored in, which holds the oldest value
+ *         once the window is full.
+ *  values - the value in each slot.
+ *  heap - which heap each slot is in.
+ *  position - the position of each slot within its heap.
+ *  heaps - the lower half max-heap and the upper half min-heap.
+ */
+typedef struct {
+  size_t window, count, next;
+  double *values;
+  unsigned char *heap;
+  size_t *position;
+  MedianHeap heaps[2];
+} RollingMedian;
+
+Rolling *rolling_new(DataField field, double window);
+void rolling_destroy(Rolling *r);
+int rolling_add(Rolling *r, DataPoint *dp);
+double rolling_mean(Rolling *r);
+double rolling_max(Rolling *r);
+double rolling_min(Rolling *r);
+RollingMedian *rolling_median_new(size_t window);
+void rolling_median_destroy(RollingMedian *m);
+void rolling_median_add(RollingMedian *m, double value);
+double rolling_median(RollingMedian *m);
+
+#endif /* _ROLLING_H_ */
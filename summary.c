@@ -0,0 +1,209 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+#include <math.h>
+
+#include "summary.h"
+
+/**
+ * summary_init
+ *
+ * Description:
+ *  Initializes a `Summary` before any points are added to it.
+ *
+ * Parameters:
+ *  s - the `Summary` to initialize.
+ */
+void summary_init(Summary *s) {
+  DataField i;
+  s->elapsed = s->moving = s->calories = s->ascent = s->descent = 0;
+  s->work = s->heart_beats = s->heart_time = 0;
+  s->normalized_power = UNSET_FIELD;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    s->point[Minimum].data[i] = DBL_MAX;
+    s->point[Maximum].data[i] = -DBL_MAX;
+    s->point[Total].data[i] = 0;
+    s->point[Average].data[i] = 0;
+    s->unset[i] = 0;
+  }
+}
+
+/**
+ * tracker_init
+ *
+ * Description:
+ *  Start tracking the running values for a new `Summary`.
+ *
+ * Parameters:
+ *  t - the `Tracker` to initialize.
+ *  power - the rolling window to compute normalized power with, or NULL.
+ *  sport - the sport the points are from.
+ */
+void tracker_init(Tracker *t, Rolling *power, Sport sport) {
+  elevation_filter_init(&(t->elevation));
+  pause_detector_init(&(t->pause), sport);
+  t->timestamp = t->start = UNSET_FIELD;
+  t->power = power;
+  t->np_total = t->np_time = 0;
+}
+
+/**
+ * add_normalized_power
+ *
+ * Description:
+ *  Accumulate the fourth power of the rolling average power once the rolling
+ *  window has filled, weighting each point by the time since the last one.
+ *  Failing to grow the rolling window only drops the point's sample.
+ *
+ * Parameters:
+ *  t - the running values for the `Summary`.
+ *  dp - the `DataPoint` to add, which must have a timestamp.
+ */
+static void add_normalized_power(Tracker *t, DataPoint *dp) {
+  double ts = dp->data[Timestamp], dt, avg;
+
+  rolling_add(t->power, dp);
+  if (!SET(t->start)) t->start = ts;
+  if (ts - t->start < NP_WINDOW - 1 || !SET(avg = rolling_mean(t->power)))
+    return;
+
+  dt = SET(t->timestamp) ? ts - t->timestamp : 1;
+  dt = dt < NP_MAX_GAP ? dt : NP_MAX_GAP;
+  t->np_total += avg * avg * avg * avg * dt;
+  t->np_time += dt;
+}
+
+/**
+ * add_energy
+ *
+ * Description:
+ *  Accumulate the work done and the heart beats since the last point, which
+ *  the calories are worked out from. Each point counts for the time since the
+ *  last one (up to `ENERGY_MAX_GAP` seconds).
+ *
+ * Parameters:
+ *  s - the `Summary` to update.
+ *  t - the running values for the `Summary`.
+ *  dp - the `DataPoint` to add, which must have a timestamp.
+ */
+static void add_energy(Summary *s, Tracker *t, DataPoint *dp) {
+  double ts = dp->data[Timestamp], dt;
+
+  dt = SET(t->timestamp) && ts > t->timestamp ? ts - t->timestamp : 0;
+  dt = dt < ENERGY_MAX_GAP ? dt : ENERGY_MAX_GAP;
+  if (SET(dp->data[Power])) s->work += dp->data[Power] * dt / 1000;
+  if (SET(dp->data[HeartRate])) {
+    s->heart_beats += dp->data[HeartRate] * dt / 60;
+    s->heart_time += dt;
+  }
+}
+
+/**
+ * summary_add
+ *
+ * Description:
+ *  Accumulate the `DataPoint` into the `Summary`. The per field update is
+ *  written without branches so that it can be vectorized across fields -
+ *  unset fields are `UNSET_FIELD` (DBL_MAX) and so never lower the minimum.
+ *  Averages are left to `summary_finish`.
+ *
+ * Parameters:
+ *  s - the `Summary` to update.
+ *  t - the running values for the `Summary`.
+ *  dp - the `DataPoint` to add.
+ */
+void summary_add(Summary *s, Tracker *t, DataPoint *dp) {
+  DataField i;
+  double v, *min = s->point[Minimum].data, *max = s->point[Maximum].data,
+            *total = s->point[Total].data, d_alt;
+  int set;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    v = dp->data[i];
+    set = SET(v);
+    min[i] = v < min[i] ? v : min[i];
+    max[i] = (set && v > max[i]) ? v : max[i];
+    total[i] += set ? v : 0;
+    s->unset[i] += !set;
+  }
+
+  if (SET(dp->data[Altitude])) {
+    d_alt = elevation_filter_add(&(t->elevation), dp->data[Altitude],
+                                 dp->data[Timestamp]);
+    s->ascent += d_alt > 0 ? d_alt : 0;
+    s->descent += d_alt < 0 ? -d_alt : 0;
+  }
+
+  if (SET(dp->data[Timestamp])) {
+    if (t->power) add_normalized_power(t, dp);
+    s->moving += pause_detector_add(&(t->pause), dp);
+    add_energy(s, t, dp);
+    t->timestamp = dp->data[Timestamp];
+  }
+}
+
+/**
+ * summary_finish
+ *
+ * Description:
+ *  Compute the values of the `Summary` which depend on all of the points
+ *  accumulated so far.
+ *
+ * Parameters:
+ *  s - the `Summary` to finish.
+ *  t - the running values for the `Summary`.
+ *  n - the number of points which have been added to `s`.
+ */
+void summary_finish(Summary *s, Tracker *t, size_t n) {
+  DataField i;
+  size_t count;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    count = n - s->unset[i];
+    s->point[Average].data[i] = count ? s->point[Total].data[i] / count : 0;
+  }
+
+  s->elapsed = (n - s->unset[Timestamp])
+                   ? s->point[Maximum].data[Timestamp] -
+                         s->point[Minimum].data[Timestamp]
+                   : 0;
+
+  if (t->power) {
+    s->normalized_power =
+        t->np_time > 0 ? sqrt(sqrt(t->np_total / t->np_time)) : UNSET_FIELD;
+  }
+  summary_calories(s, n);
+}
+
+/**
+ * summary_calories
+ *
+ * Description:
+ *  Set the calories of a `Summary` from the work done. At a gross efficiency
+ *  of around 24% each kJ of work burns about a kcal. Without any power it
+ *  takes the athlete to turn the heart beats into calories, see
+ *  `athlete_calories`.
+ *
+ * Parameters:
+ *  s - the `Summary` to set the calories of.
+ *  n - the number of points which have been added to `s`.
+ */
+void summary_calories(Summary *s, size_t n) {
+  s->calories = n - s->unset[Power] ? s->work : 0;
+}
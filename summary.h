@@ -0,0 +1,56 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SUMMARY_H_
+#define _SUMMARY_H_
+
+#include "activity.h"
+#include "rolling.h"
+
+/**
+ * Tracker
+ *
+ * Description:
+ *  The running values needed to accumulate a `Summary` one point at a time.
+ *
+ * Fields:
+ *  elevation - the filter the ascent and descent come from.
+ *  pause - the auto-pause detection the moving time comes from.
+ *  timestamp - the last timestamp which was set.
+ *  start - the first timestamp which was set.
+ *  power - the rolling average power used for normalized power, or NULL if
+ *          normalized power isn't being computed.
+ *  np_total - the sum of the fourth power of the rolling average power,
+ *             weighted by time.
+ *  np_time - the time in seconds `np_total` covers.
+ */
+typedef struct {
+  ElevationFilter elevation;
+  PauseDetector pause;
+  double timestamp;
+  double start;
+  Rolling *power;
+  double np_total, np_time;
+} Tracker;
+
+void summary_init(Summary *s);
+void tracker_init(Tracker *t, Rolling *power, Sport sport);
+void summary_add(Summary *s, Tracker *t, DataPoint *dp);
+void summary_finish(Summary *s, Tracker *t, size_t n);
+void summary_calories(Summary *s, size_t n);
+
+#endif /* _SUMMARY_H_ */
@@ -39,12 +39,20 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mxml.h"
 
 #include "activity.h"
 #include "tcx.h"
 #include "util.h"
+#include "xml.h"
+
+#define TCX_POINT "Trackpoint"
+
+/* every element which may enclose a Trackpoint, outermost first */
+static const char *TCX_CONTAINERS[] = {
+    "TrainingCenterDatabase", "Activities", "Activity", "Lap", "Track", NULL};
 
 /**
  * State
@@ -53,18 +61,90 @@
  *  Structure used to maintain state between calls to the sax_cb.
  *
  * Fields:
- *  activity - the activity being constructed during parsing.
+ *  activity - the activity being constructed during parsing. NULL when
+ *             parsing a segment in parallel, in which case points are
+ *             collected into `points` instead.
  *  metadata - whether or not we are currently inside the <metadata> tag.
  *  first_element - whether we have seen the first element yet.
  *  dp - the current datapoint which we are building up to add to `Activity`.
+ *  lap - whether the next point starts a new lap.
+ *  laps - the indices of the points which start a lap.
+ *  points - the points read when parsing a segment.
+ *  num_points - the number of points in `points`.
+ *  points_alloc - the number of points allocated for `points`.
  */
 typedef struct {
   Activity *activity;
   bool metadata;
   bool first_element;
   DataPoint dp;
+  bool lap;
+  Vector laps;
+  DataPoint *points;
+  size_t num_points;
+  size_t points_alloc;
 } State;
 
+static void init_state(State *s, Activity *a) {
+  memset(s, 0, sizeof(*s));
+  s->activity = a;
+  s->first_element = true;
+  unset_data_point(&(s->dp));
+}
+
+static void clear_state(State *s) {
+  vector_destroy(&(s->laps));
+  if (s->points) free(s->points);
+  s->points = NULL;
+}
+
+/**
+ * add_point
+ *
+ * Description:
+ *  Append the point we've built up to the `Activity`, or to the segment's point
+ *  buffer if we're parsing a segment, noting if it starts a lap.
+ *
+ * Return value:
+ *  0 - the point was added.
+ *  1 - unable to add the point.
+ */
+static int add_point(State *state) {
+  Activity *a = state->activity;
+  Vector *v = &(state->laps);
+  size_t index, n;
+
+  if (a) {
+    n = a->num_points;
+    if (activity_ingest_point(a, &(state->dp), &index)) return 1;
+    /* an out of order point can go in before points we've noted */
+    if (a->num_points > n && index < n) {
+      vector_shift(v, (uint32_t)index);
+    }
+    /* a dropped point leaves its lap to start with the next point */
+    if (index == a->num_points) {
+      unset_data_point(&(state->dp));
+      return 0;
+    }
+  } else {
+    ALLOC_GROW(state->points, state->num_points + 1, state->points_alloc);
+    if (!state->points) return 1;
+    state->points[state->num_points] = state->dp;
+    index = state->num_points++;
+  }
+
+  if (state->lap) {
+    /* the laps stay in order even if the point went in before the last */
+    if ((!v->size || index > v->data[v->size - 1]) &&
+        vector_add(v, (uint32_t)index))
+      return 1;
+    state->lap = false;
+  }
+
+  unset_data_point(&(state->dp));
+  return 0;
+}
+
 /**
  * sax_cb
  *
@@ -72,7 +152,6 @@ typedef struct {
  *  MXML SAX callback which processes events and nodes as a stream. We retain
  *  nodes which have data and process them on ELEMNT_CLOSE so that we know what
  *  kind of node was read.
- *  TODO
  *
  * Parameters:
  *  node - the current node in the tree being proessed.
@@ -85,7 +164,7 @@ typedef struct {
  *      Added to enable to MXML to realize we're not processing a TCX file.
  */
 static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
-  const char *name, *attr, *data;
+  const char *name, *data;
   State *state = (State *)sax_data;
 
   if (event == MXML_SAX_ELEMENT_OPEN) {
@@ -94,7 +173,7 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     name = mxmlGetElement(node);
 
     if (state->first_element) {
-      if (strcmp(name, "TraingCenterDatabase")) {
+      if (!xml_synthetic(node) && strcmp(name, "TrainingCenterDatabase")) {
         return 1; /* stop reading the file */
       }
 
@@ -103,7 +182,8 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     }
 
     if (!strcmp(name, "Lap")) {
-      /* TODO */
+      /* a segment which starts mid lap doesn't start a new one */
+      if (!xml_synthetic(node)) state->lap = true;
     } else if (!strcmp(name, "Trackpoint")) {
       /* TODO do we need to do anything? */
     }
@@ -130,11 +210,9 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
     } else if (!strcmp(name, "LongitudeDegrees")) {
       parse_field(Longitude, &(state->dp), data); /* TODO */
     } else if (!strcmp(name, "LatitudeDegrees")) {
-      parse_field(Longitude, &(state->dp), data); /* TODO */
+      parse_field(Latitude, &(state->dp), data); /* TODO */
     } else if (!strcmp(name, "Trackpoint")) {
-      /* TODO */
-      activity_add_point(state->activity, &(state->dp));
-      unset_data_point(&(state->dp));
+      return add_point(state);
     }
   } else if (event == MXML_SAX_DATA) {
     mxmlRetain(node);
@@ -143,11 +221,122 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
   return 0;
 }
 
+/**
+ * finish_activity
+ *
+ * Description:
+ *  Hand the laps gathered in `s` over to the `Activity` and finalize it.
+ */
+static void finish_activity(State *s) {
+  Activity *a = s->activity;
+
+  a->format = TCX;
+
+  vector_destroy(&(a->laps));
+  a->laps = s->laps;
+  memset(&(s->laps), 0, sizeof(s->laps));
+
+  activity_finalize(a);
+}
+
+/**
+ * read_sequential
+ *
+ * Description:
+ *  Parse the whole TCX document in `buf` with a single SAX pass.
+ */
+static Activity *read_sequential(const char *buf) {
+  mxml_node_t *tree;
+  Activity *a;
+  State state;
+
+  if (!(a = activity_new())) return NULL;
+  init_state(&state, a);
+
+  if (!(tree = mxmlSAXLoadString(NULL, buf, MXML_OPAQUE_CALLBACK, sax_cb,
+                                 (void *)&state))) {
+    clear_state(&state);
+    activity_destroy(a);
+    return NULL;
+  }
+
+  finish_activity(&state);
+  clear_state(&state);
+  mxmlDelete(tree);
+  return a;
+}
+
+/**
+ * read_parallel
+ *
+ * Description:
+ *  Split the TCX document in `buf` into segments at Trackpoint boundaries,
+ *  parse them in parallel and merge the points back together in order.
+ *
+ * Return value:
+ *  NULL - the document couldn't be split safely or failed to parse. The
+ *         caller should fall back to `read_sequential`.
+ *  valid pointer - the `Activity`.
+ */
+static Activity *read_parallel(const char *buf, size_t len) {
+  XMLSegment *segments;
+  State *states, merged;
+  size_t i, j, k, n;
+  int err;
+
+  if (!(segments = xml_split(buf, len, TCX_POINT, TCX_CONTAINERS, &n)))
+    return NULL;
+  if (!(states = malloc(n * sizeof(*states)))) {
+    xml_destroy_segments(segments, n);
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++) {
+    init_state(&states[i], NULL);
+    segments[i].state = &states[i];
+  }
+
+  err = xml_parse_segments(segments, n, sax_cb);
+  xml_destroy_segments(segments, n);
+
+  init_state(&merged, err ? NULL : activity_new());
+  err = !merged.activity;
+
+  /* the points go through `add_point` again rather than being offset, since
+   * points which are out of order don't always end up one for one */
+  for (i = 0; i < n; i++) {
+    for (j = 0, k = 0; !err && j < states[i].num_points; j++) {
+      if (k < states[i].laps.size && states[i].laps.data[k] == j) {
+        merged.lap = true;
+        k++;
+      }
+      merged.dp = states[i].points[j];
+      err = add_point(&merged);
+    }
+    /* a lap opened right before the split starts with the next segment */
+    if (states[i].lap && i + 1 < n) merged.lap = true;
+    clear_state(&states[i]);
+  }
+  free(states);
+
+  if (err) {
+    clear_state(&merged);
+    if (merged.activity) activity_destroy(merged.activity);
+    return NULL;
+  }
+
+  finish_activity(&merged);
+  clear_state(&merged);
+  return merged.activity;
+}
+
 /**
  * tcx_read
  *
  * Description:
- *  Read in the TCX file pointed to by `f` and return an `Activity`.
+ *  Read in the TCX file pointed to by `f` and return an `Activity`. Large
+ *  files are speculatively split and parsed in parallel, falling back to a
+ *  sequential parse if they can't be split safely.
  *
  * Parameters:
  *  f - The file descriptor for the TCX file to read.
@@ -158,22 +347,17 @@ static int sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *sax_data) {
  *                  The caller is responsible for freeing the activity.
  */
 Activity *tcx_read(FILE *f) {
-  mxml_node_t *tree;
-  State state = {NULL, false /* metadata */, true /* first_element */, {{0}}};
-  unset_data_point(&(state.dp));
+  Activity *a = NULL;
+  char *buf;
+  size_t len;
 
-  if (!(state.activity = activity_new())) return NULL;
+  if (!(buf = read_all(f, &len))) return NULL;
 
-  if (!(tree = mxmlSAXLoadFile(NULL, f, MXML_OPAQUE_CALLBACK, sax_cb,
-                               (void *)&state))) {
-    activity_destroy(state.activity);
-    return NULL;
-  }
+  if (len >= XML_PARALLEL_SIZE) a = read_parallel(buf, len);
+  if (!a) a = read_sequential(buf);
 
-  state.activity->format = TCX;
-
-  mxmlDelete(tree);
-  return state.activity;
+  free(buf);
+  return a;
 }
 
 /**
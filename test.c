@@ -15,12 +15,28 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 
+#include "athlete.h"
+#include "csv.h"
 #include "fitparse.h"
+#include "fix.h"
+#include "geo.h"
+#include "gpx.h"
+#include "index.h"
+#include "meanmax.h"
+#include "pipeline.h"
+#include "resample.h"
+#include "rolling.h"
+#include "summary.h"
+#include "tcx.h"
 #include "util.h"
+#include "xml.h"
+#include "zones.h"
 
 #define PREFIX "out."
 #define DEFAULT_DIR "tests/out"
@@ -86,8 +102,1533 @@ bool test(const char *filename, const char *dir) {
 #endif
 }
 
+/* report `what` if it isn't `ok`, returning the number of failures */
+static int check(bool ok, const char *what) {
+  if (!ok) fprintf(stderr, "FAILED: %s\n", what);
+  return !ok;
+}
+
+/* write a CSV with `n` rows of known data to `f`, or as many rows as it takes
+ * to reach `size` bytes if `n` is 0, returning the number of rows */
+static size_t write_rows(FILE *f, size_t n, long size) {
+  size_t i;
+
+  fprintf(f, "timestamp,power,heart_rate\n");
+  for (i = 0; n ? i < n : ftell(f) < size; i++) {
+    fprintf(f, "%lu,%lu,%lu\n", 1390000000ul + (unsigned long)i,
+            (unsigned long)(i % 1000), 100 + (unsigned long)(i % 80));
+  }
+  rewind(f);
+  return i;
+}
+
+/* a CSV large enough to be split into chunks parsed in parallel comes out
+ * the same as one small enough to be read serially */
+static int test_csv_chunks(void) {
+  FILE *f, *g;
+  Activity *a = NULL, *b = NULL;
+  size_t i, n, head;
+  int err = 0;
+  double *d;
+
+  if (!(f = tmpfile()) || !(g = tmpfile())) return check(false, "tmpfile");
+  n = write_rows(f, 0, 4 * CSV_PARALLEL_SIZE);
+  head = write_rows(g, n / 16, 0);
+
+  a = csv_read(f);
+  b = csv_read(g);
+  fclose(f);
+  fclose(g);
+  if (check(a && b, "csv_read")) goto out;
+
+  err += check(a->num_points == n, "chunked csv point count");
+  err += check(b->num_points == head, "serial csv point count");
+  for (i = 0; !err && i < a->num_points; i++) {
+    d = a->data_points[i].data;
+    err += check(d[Timestamp] == 1390000000.0 + i && d[Power] == i % 1000 &&
+                     d[HeartRate] == 100 + i % 80,
+                 "chunked csv point order");
+  }
+  for (i = 0; !err && i < head; i++) {
+    err += check(!memcmp(&(a->data_points[i]), &(b->data_points[i]),
+                         sizeof(DataPoint)),
+                 "chunked csv matches serial csv");
+  }
+
+out:
+  if (a) activity_destroy(a);
+  if (b) activity_destroy(b);
+  return err;
+}
+
+/* whether the laps or breaks in `v` start at the `n` points in `want` */
+static bool starts_equal(Vector *v, const uint32_t *want, size_t n) {
+  return v->size == n && (!n || !memcmp(v->data, want, n * sizeof(*want)));
+}
+
+/* write a GPX or TCX document with `n` points over three segments or laps
+ * to `f`, big enough to be split and parsed in parallel. A comment at the
+ * end makes the split points ambiguous, so it has to be parsed serially. */
+static void write_xml(FILE *f, bool tcx, size_t n, bool comment) {
+  char when[32];
+  time_t t;
+  size_t i;
+
+  fprintf(f, tcx ? "<?xml version=\"1.0\"?>\n<TrainingCenterDatabase>"
+                   "<Activities><Activity Sport=\"Biking\">\n"
+                 : "<?xml version=\"1.0\"?>\n<gpx version=\"1.1\"><trk>\n");
+  for (i = 0; i < n; i++) {
+    t = (time_t)(1390000000 + i);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    if (!(i % (n / 3))) {
+      if (i) fprintf(f, tcx ? "</Track></Lap>\n" : "</trkseg>\n");
+      fprintf(f, tcx ? "<Lap StartTime=\"%s\"><Track>\n" : "<trkseg>\n",
+              when);
+    }
+    if (tcx) {
+      fprintf(f,
+              "<Trackpoint><Time>%s</Time><Position><LatitudeDegrees>%.7f"
+              "</LatitudeDegrees><LongitudeDegrees>7.0</LongitudeDegrees>"
+              "</Position><AltitudeMeters>%.1f</AltitudeMeters><HeartRateBpm>"
+              "<Value>%lu</Value></HeartRateBpm></Trackpoint>\n",
+              when, 45 + i * 5 / 111195.0, 100 + (double)(i % 50),
+              100 + (unsigned long)(i % 80));
+    } else {
+      fprintf(f,
+              "<trkpt lat=\"%.7f\" lon=\"7.0\"><ele>%.1f</ele><time>%s"
+              "</time></trkpt>\n",
+              45 + i * 5 / 111195.0, 100 + (double)(i % 50), when);
+    }
+  }
+  fprintf(f, tcx ? "</Track></Lap>\n%s</Activity></Activities>"
+                   "</TrainingCenterDatabase>\n"
+                 : "</trkseg>\n%s</trk></gpx>\n",
+          comment ? "<!-- the end -->\n" : "");
+}
+
+/* large GPX and TCX documents split at points and parsed in parallel come
+ * out the same as when they are parsed serially. With a single CPU they are
+ * never split, and both are parsed serially. */
+static int test_xml_split(void) {
+  Activity *a[2];
+  FILE *f;
+  size_t i, n = 60000;
+  int tcx, err = 0;
+
+  for (tcx = 0; tcx < 2; tcx++) {
+    for (i = 0; i < 2; i++) {
+      a[i] = NULL;
+      if (!(f = tmpfile())) continue;
+      write_xml(f, tcx, n, i);
+      err += check(ftell(f) >= XML_PARALLEL_SIZE, "xml big enough to split");
+      rewind(f);
+      a[i] = tcx ? tcx_read(f) : gpx_read(f);
+      fclose(f);
+    }
+    err += check(a[0] && a[1] && a[0]->num_points == n &&
+                     activity_equal(a[0], a[1]) &&
+                     starts_equal(&(a[0]->laps), a[1]->laps.data,
+                                  a[1]->laps.size) &&
+                     starts_equal(&(a[0]->breaks), a[1]->breaks.data,
+                                  a[1]->breaks.size),
+                 tcx ? "parallel tcx matches serial tcx"
+                     : "parallel gpx matches serial gpx");
+    for (i = 0; i < 2; i++) {
+      if (a[i]) activity_destroy(a[i]);
+    }
+  }
+  return err;
+}
+
+/* a simplified CSV only has the rows for the ends of a track going north
+ * then east, and the corner, not the points in between or a wobble too
+ * small to keep */
+static int test_csv_simplify(void) {
+  FILE *f;
+  Activity *a;
+  DataPoint dp;
+  CSVOptions o = DEFAULT_CSV_OPTIONS;
+  const double kept[] = {1390000000.0, 1390000010.0, 1390000020.0};
+  char line[BUFSIZ];
+  size_t i, n = 0;
+  int err = 0;
+
+  if (!(a = activity_new())) return check(false, "activity_new");
+  for (i = 0; i <= 20; i++) {
+    unset_data_point(&dp);
+    dp.data[Timestamp] = 1390000000.0 + i;
+    dp.data[Latitude] = 37.0 + 0.0001 * (i < 10 ? i : 10);
+    dp.data[Longitude] = -122.0 + 0.0001 * (i < 10 ? 0 : i - 10);
+    /* about 20cm off the line */
+    if (i == 5) dp.data[Longitude] += 0.0000025;
+    if (activity_append_point(a, &dp)) err++;
+  }
+  activity_finalize(a);
+  if (check(!err && (f = tmpfile()), "simplify setup")) goto out;
+
+  o.simplify = 1;
+  err += check(!csv_write_options(f, a, &o), "csv_write_options");
+  rewind(f);
+  /* skip the header */
+  if (!fgets(line, sizeof(line), f)) err += check(false, "simplified header");
+  while (fgets(line, sizeof(line), f)) {
+    err += check(n < ARRAY_SIZE(kept) && strtod(line, NULL) == kept[n],
+                 "simplified csv row");
+    n++;
+  }
+  err += check(n == ARRAY_SIZE(kept), "simplified csv row count");
+  fclose(f);
+
+out:
+  activity_destroy(a);
+  return err;
+}
+
+/* a repeatable pseudo random number in [0, 1), the same on every libc */
+static double random_unit(unsigned long *seed) {
+  *seed = (*seed * 1103515245ul + 12345ul) & 0x7ffffffful;
+  return (double)*seed / 0x80000000ul;
+}
+
+/* whether `x` is within `tolerance` of `y`, relative to the larger of them */
+static bool close_to(double x, double y, double tolerance) {
+  double scale = fabs(x) > fabs(y) ? fabs(x) : fabs(y);
+
+  return fabs(x - y) <= tolerance * (scale > 1 ? scale : 1);
+}
+
+/* an `Activity` of `n` points one second apart, to fill in the fields of */
+static Activity *test_activity(size_t n) {
+  Activity *a;
+  size_t i;
+
+  if (!(a = activity_new()) || activity_reserve(a, n)) {
+    if (a) activity_destroy(a);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    unset_data_point(&(a->data_points[i]));
+    a->data_points[i].data[Timestamp] = 1390000000.0 + i;
+  }
+  a->num_points = n;
+  return a;
+}
+
+/* the pruned mean-maximal curve matches trying every window */
+static int test_meanmax(void) {
+  Activity *a;
+  MeanMax *m = NULL;
+  unsigned long seed = 1;
+  size_t n = 1000, d, i, j;
+  double best, sum, *power;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "meanmax setup");
+  for (i = 0; i < n; i++) {
+    /* a hard effort in the middle, and some stretches which tie */
+    power = &(a->data_points[i].data[Power]);
+    *power = i % 200 < 20 ? 250 : floor(100 + 300 * random_unit(&seed));
+    if (i >= 600 && i < 660) *power += 300;
+  }
+  activity_finalize(a);
+  if (check((m = meanmax_new(a, Power)) && m->length == n, "meanmax_new"))
+    goto out;
+
+  for (d = 1; !err && d <= n; d++) {
+    for (i = 0, best = 0; i + d <= n; i++) {
+      for (j = i, sum = 0; j < i + d; j++) sum += a->data_points[j].data[Power];
+      best = sum > best ? sum : best;
+    }
+    err += check(close_to(m->best[d - 1], best / d, 1e-9), "meanmax best");
+  }
+
+out:
+  if (m) meanmax_destroy(m);
+  activity_destroy(a);
+  return err;
+}
+
+/* recording at 4 Hz, the curve is that of the average of each second */
+static int test_meanmax_samples(void) {
+  Activity *a;
+  MeanMax *m = NULL;
+  unsigned long seed = 3;
+  size_t n = 100, d, i, j;
+  double best, sum, second[100];
+  int err = 0;
+
+  if (!(a = test_activity(4 * n))) return check(false, "meanmax setup");
+  for (i = 0; i < n; i++) second[i] = 0;
+  for (i = 0; i < 4 * n; i++) {
+    a->data_points[i].data[Timestamp] = 1390000000.0 + i / 4.0;
+    a->data_points[i].data[Power] = floor(100 + 500 * random_unit(&seed));
+    second[i / 4] += a->data_points[i].data[Power] / 4;
+  }
+  activity_finalize(a);
+  if (check((m = meanmax_new(a, Power)) && m->length == n, "meanmax_new"))
+    goto out;
+
+  for (d = 1; !err && d <= n; d++) {
+    for (i = 0, best = 0; i + d <= n; i++) {
+      for (j = i, sum = 0; j < i + d; j++) sum += second[j];
+      best = sum > best ? sum : best;
+    }
+    err += check(close_to(m->best[d - 1], best / d, 1e-9),
+                 "meanmax best of the seconds");
+  }
+
+out:
+  if (m) meanmax_destroy(m);
+  activity_destroy(a);
+  return err;
+}
+
+/* the rolling mean, maximum and minimum over 3, 10 and 30 seconds match
+ * looking at every point in the window, with uneven steps, ties and points
+ * without the field */
+static int test_rolling(void) {
+  const double windows[] = {3, 10, 30};
+  Activity *a;
+  Rolling *r;
+  DataPoint *dp;
+  unsigned long seed = 8;
+  size_t w, i, j, count, n = 1000;
+  double t = 1390000000.0, sum, max, min, v;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "rolling setup");
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    dp->data[Timestamp] = t;
+    v = floor(10 * random_unit(&seed));
+    dp->data[Power] = i % 11 == 5 ? UNSET_FIELD : v;
+    t += 1 + floor(3 * random_unit(&seed));
+  }
+
+  for (w = 0; w < ARRAY_SIZE(windows); w++) {
+    if (check((r = rolling_new(Power, windows[w])) != NULL, "rolling_new"))
+      break;
+    for (i = 0; !err && i < n; i++) {
+      err += check(!rolling_add(r, &(a->data_points[i])), "rolling_add");
+      t = a->data_points[i].data[Timestamp];
+      sum = count = 0;
+      max = -DBL_MAX;
+      min = DBL_MAX;
+      for (j = 0; j <= i; j++) {
+        dp = &(a->data_points[j]);
+        v = dp->data[Power];
+        if (!SET(v) || dp->data[Timestamp] <= t - windows[w]) continue;
+        sum += v;
+        count++;
+        max = v > max ? v : max;
+        min = v < min ? v : min;
+      }
+      err += check(count ? close_to(rolling_mean(r), sum / count, 1e-9) &&
+                               rolling_max(r) == max && rolling_min(r) == min
+                         : !SET(rolling_mean(r)) && !SET(rolling_max(r)) &&
+                               !SET(rolling_min(r)),
+                   "rolling window");
+    }
+    rolling_destroy(r);
+  }
+  activity_destroy(a);
+  return err;
+}
+
+static int compare_doubles(const void *x, const void *y) {
+  const double *a = x, *b = y;
+
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* the rolling median of odd and even windows matches sorting the window */
+static int test_rolling_median(void) {
+  RollingMedian *m;
+  unsigned long seed = 2;
+  double values[500], sorted[8], median;
+  size_t window, i, count;
+  int err = 0;
+
+  for (i = 0; i < ARRAY_SIZE(values); i++) {
+    /* plenty of repeated values */
+    values[i] = floor(20 * random_unit(&seed));
+  }
+
+  for (window = 7; window <= 8; window++) {
+    if (check((m = rolling_median_new(window)) != NULL, "rolling_median_new"))
+      return err + 1;
+    err += check(!SET(rolling_median(m)), "empty rolling median");
+    for (i = 0; !err && i < ARRAY_SIZE(values); i++) {
+      rolling_median_add(m, values[i]);
+      count = i + 1 < window ? i + 1 : window;
+      memcpy(sorted, &(values[i + 1 - count]), count * sizeof(*sorted));
+      qsort(sorted, count, sizeof(*sorted), compare_doubles);
+      median = count % 2 ? sorted[count / 2]
+                         : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+      err += check(rolling_median(m) == median, "rolling median");
+    }
+    rolling_median_destroy(m);
+  }
+  return err;
+}
+
+/* a power and a heart rate reading which stand out from the readings around
+ * them are interpolated over, while a hard effort which lasts is left alone */
+static int test_spikes(void) {
+  Activity *a;
+  DataPoint *dp;
+  unsigned long seed = 7;
+  size_t i, n = 300;
+  double effort = 0;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "spikes setup");
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    dp->data[Power] = floor(180 + 40 * random_unit(&seed));
+    dp->data[HeartRate] = floor(138 + 4 * random_unit(&seed));
+    if (i >= 200) effort += dp->data[Power] += 200;
+  }
+  a->data_points[100].data[Power] = 1200;
+  a->data_points[150].data[HeartRate] = 200;
+  activity_finalize(a);
+
+  err += check(fix_activity(a, FIX(PowerSpikes) | FIX(HeartRateSpikes)) == 2 &&
+                   a->errors[PowerSpikes] == 1 &&
+                   a->errors[HeartRateSpikes] == 1,
+               "spike count");
+  dp = &(a->data_points[100]);
+  err += check(dp->data[Power] == (dp[-1].data[Power] + dp[1].data[Power]) / 2,
+               "power spike interpolated");
+  dp = &(a->data_points[150]);
+  err += check(dp->data[HeartRate] ==
+                   (dp[-1].data[HeartRate] + dp[1].data[HeartRate]) / 2,
+               "heart rate spike interpolated");
+  for (i = 200; i < n; i++) effort -= a->data_points[i].data[Power];
+  err += check(!effort, "hard effort kept");
+  activity_destroy(a);
+  return err;
+}
+
+/* the batched Haversine with polynomial trigonometry is within a micrometre
+ * of libm, for short steps, steps long enough to need libm, and the poles */
+static int test_geo_distances(void) {
+  unsigned long seed = 3;
+  double lat[2000], lon[2000], rlat[2000], rlon[2000], d[2000], step;
+  size_t i, n = ARRAY_SIZE(lat);
+  int err = 0;
+
+  for (i = 0, lat[0] = 37, lon[0] = -122; i < n; i++) {
+    step = i % 100 == 50 ? 60 : i % 10 == 5 ? 0.05 : 0.0002;
+    if (i) lat[i] = lat[i - 1] + step * (random_unit(&seed) - 0.5);
+    if (i) lon[i] = lon[i - 1] + step * (random_unit(&seed) - 0.5);
+    if (i % 500 == 250) lat[i] = 89.99999;
+    lat[i] = lat[i] > 90 ? 90 : lat[i] < -90 ? -90 : lat[i];
+    lon[i] += lon[i] > 180 ? -360 : lon[i] < -180 ? 360 : 0;
+    rlat[i] = to_radians(lat[i]);
+    rlon[i] = to_radians(lon[i]);
+  }
+
+  if (check(!geo_distances(rlat, rlon, n, d), "geo_distances")) return 1;
+  err += check(d[0] == 0, "geo_distances first step");
+  for (i = 1; !err && i < n; i++) {
+    err += check(fabs(d[i] - geo_distance(lat[i - 1], lon[i - 1], lat[i],
+                                          lon[i])) < 1e-6,
+                 "geo_distances step");
+  }
+  return err;
+}
+
+/* the square of the distance in meters from `p` to the segment from `a` to
+ * `b`, measured the same way as `activity_simplify` does */
+static double segment_distance2(DataPoint *a, DataPoint *b, DataPoint *p) {
+  double scale = cos(to_radians(a->data[Latitude])), bx, by, px, py, t, len2;
+
+  bx = (b->data[Longitude] - a->data[Longitude]) * scale;
+  by = b->data[Latitude] - a->data[Latitude];
+  px = (p->data[Longitude] - a->data[Longitude]) * scale;
+  py = p->data[Latitude] - a->data[Latitude];
+  len2 = bx * bx + by * by;
+  t = len2 > 0 ? (px * bx + py * by) / len2 : 0;
+  t = t < 0 ? 0 : t > 1 ? 1 : t;
+  px -= t * bx;
+  py -= t * by;
+  t = to_radians(1) * EARTH_RADIUS;
+  return (px * px + py * py) * t * t;
+}
+
+/* the textbook recursive Douglas-Peucker between the kept points `i` and `j` */
+static void simplify_reference(Activity *a, size_t i, size_t j,
+                               double tolerance2, unsigned char *keep) {
+  double d, max = tolerance2;
+  size_t k, far = j;
+
+  for (k = i + 1; k < j; k++) {
+    d = segment_distance2(&(a->data_points[i]), &(a->data_points[j]),
+                          &(a->data_points[k]));
+    if (d > max) {
+      max = d;
+      far = k;
+    }
+  }
+  if (far == j) return;
+  keep[far] = 1;
+  simplify_reference(a, i, far, tolerance2, keep);
+  simplify_reference(a, far, j, tolerance2, keep);
+}
+
+/* simplifying without a stack keeps the same points as recursing */
+static int test_simplify(void) {
+  Activity *a;
+  unsigned long seed = 4;
+  unsigned char keep[3000], expected[3000];
+  size_t i, n = ARRAY_SIZE(keep), kept;
+  double lat = 37, lon = -122;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "simplify setup");
+  for (i = 0; i < n; i++) {
+    /* a wandering track which heads roughly north */
+    lat += 0.0001 * random_unit(&seed);
+    lon += 0.0001 * (random_unit(&seed) - 0.5);
+    a->data_points[i].data[Latitude] = lat;
+    a->data_points[i].data[Longitude] = lon;
+  }
+
+  memset(expected, 0, n);
+  expected[0] = expected[n - 1] = 1;
+  simplify_reference(a, 0, n - 1, 5 * 5, expected);
+  kept = activity_simplify(a, 5, keep);
+
+  err += check(kept > 2 && kept < n / 2, "simplify kept some points");
+  err += check(!memcmp(keep, expected, n), "simplify matches recursion");
+  for (i = 0; i < n; i++) kept -= keep[i];
+  err += check(!kept, "simplify count");
+  activity_destroy(a);
+  return err;
+}
+
+/* the value of `field` resampled at `t` from the points of `a`, worked out
+ * by looking at all of them */
+static double resample_reference(Activity *a, DataField field,
+                                 ResamplePolicy policy, double max_gap,
+                                 double t) {
+  DataPoint *dp, *prev = NULL, *next = NULL;
+  double t0, t1, v0, v1;
+  size_t j;
+
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    if (!SET(dp->data[field])) continue;
+    if (dp->data[Timestamp] <= t) prev = dp;
+    if (dp->data[Timestamp] > t && !next) next = dp;
+  }
+  if (!prev) return UNSET_FIELD;
+  t0 = prev->data[Timestamp];
+  v0 = prev->data[field];
+  if (t0 == t) return v0;
+  if (!next || next->data[Timestamp] - t0 > max_gap) {
+    return policy == ResampleLinear ? UNSET_FIELD
+           : policy == ResampleZero ? 0
+                                    : v0;
+  }
+  if (policy != ResampleLinear) return v0;
+  t1 = next->data[Timestamp];
+  v1 = next->data[field];
+  return v0 + (v1 - v0) * (t - t0) / (t1 - t0);
+}
+
+/* resampling smart recording with a gap in it onto a uniform timeline
+ * matches interpolating each point from all of the readings, and the laps
+ * and recorded breaks start at the first resampled point at or after they
+ * did, while the pause at the gap isn't one over the resampled points */
+static int test_resample(void) {
+  const double times[] = {0, 1, 3, 4, 7, 7.5, 8, 20, 21, 24};
+  const uint32_t laps[] = {0, 7}, breaks[] = {0, 21};
+  Activity *a, *r = NULL;
+  ResampleOptions o;
+  size_t i, n = ARRAY_SIZE(times);
+  double t, v, *d;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "resample setup");
+  for (i = 0; i < n; i++) {
+    d = a->data_points[i].data;
+    d[Timestamp] = 1390000000.0 + times[i];
+    /* a missing reading is interpolated over */
+    d[HeartRate] = i == 3 ? UNSET_FIELD : 120 + 3 * i;
+    d[Power] = 100 + 10 * i;
+    d[Temperature] = 20 + i;
+  }
+  if (vector_add(&(a->laps), 0) || vector_add(&(a->laps), 4) ||
+      vector_add(&(a->breaks), 0) || vector_add(&(a->breaks), 8)) {
+    activity_destroy(a);
+    return check(false, "resample setup");
+  }
+  activity_finalize(a);
+  resample_options_init(&o);
+  if (check((r = resample_activity_options(a, &o)) != NULL,
+            "resample_activity_options"))
+    goto out;
+
+  err += check(r->num_points == 25, "resampled point count");
+  err += check(a->pauses.size == 1 && a->pauses.data[0] == 7 &&
+                   starts_equal(&(r->laps), laps, ARRAY_SIZE(laps)) &&
+                   starts_equal(&(r->breaks), breaks, ARRAY_SIZE(breaks)) &&
+                   !r->pauses.size,
+               "resampled laps and breaks");
+  for (i = 0; !err && i < r->num_points; i++) {
+    d = r->data_points[i].data;
+    t = 1390000000.0 + i;
+    err += check(d[Timestamp] == t, "resampled timestamp");
+    v = resample_reference(a, HeartRate, ResampleLinear, o.max_gap, t);
+    err += check(SET(v) ? close_to(d[HeartRate], v, 1e-12)
+                        : !SET(d[HeartRate]),
+                 "resampled heart rate");
+    v = resample_reference(a, Power, ResampleZero, o.max_gap, t);
+    err += check(d[Power] == v, "resampled power");
+    v = resample_reference(a, Temperature, ResampleHold, o.max_gap, t);
+    err += check(d[Temperature] == v, "resampled temperature");
+  }
+
+out:
+  if (r) activity_destroy(r);
+  activity_destroy(a);
+  return err;
+}
+
+/* looking points up by time with the index matches scanning for them, with
+ * uneven steps and points without a timestamp */
+static int test_time_index(void) {
+  Activity *a;
+  unsigned long seed = 5;
+  size_t i, j, point, n = 1000;
+  double t = 1390000000.0, end, ts;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "time index setup");
+  for (i = 0; i < n; i++) {
+    a->data_points[i].data[Timestamp] = i % 7 == 3 ? UNSET_FIELD : t;
+    t += 1 + floor(3 * random_unit(&seed));
+  }
+  end = a->data_points[n - 1].data[Timestamp];
+  activity_finalize(a);
+
+  for (t = 1390000000.0 - 2; !err && t <= end + 2; t += 0.5) {
+    for (j = 0; j < n; j++) {
+      ts = a->data_points[j].data[Timestamp];
+      if (SET(ts) && ts >= t) break;
+    }
+    err += check(!activity_point_at_time(a, t, &point) && point == j,
+                 "point at time");
+  }
+  activity_destroy(a);
+  return err;
+}
+
+/* normalized power is the fourth root of the mean fourth power of the 30
+ * second rolling average, and an hour at it scores (NP / FTP)^2 * 100 TSS */
+static int test_normalized_power(void) {
+  Activity *a;
+  Athlete athlete = DEFAULT_ATHLETE;
+  unsigned long seed = 6;
+  size_t i, j, n = 600;
+  double avg, total = 0, np, tss;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "normalized power setup");
+  for (i = 0; i < n; i++) {
+    a->data_points[i].data[Power] = floor(100 + 300 * random_unit(&seed));
+    a->data_points[i].data[Speed] = 10;
+  }
+  activity_finalize(a);
+
+  for (i = NP_WINDOW - 1; i < n; i++) {
+    for (j = i + 1 - NP_WINDOW, avg = 0; j <= i; j++) {
+      avg += a->data_points[j].data[Power];
+    }
+    avg /= NP_WINDOW;
+    total += avg * avg * avg * avg;
+  }
+  np = sqrt(sqrt(total / (n + 1 - NP_WINDOW)));
+  err += check(close_to(a->summary.normalized_power, np, 1e-9),
+               "normalized power");
+
+  athlete.ftp = 250;
+  tss = (n - 1) * (np / 250) * (np / 250) / SECS_IN_HOUR * 100;
+  err += check(close_to(athlete_tss(&athlete, &(a->summary)), tss, 1e-9),
+               "training stress score");
+  activity_destroy(a);
+  return err;
+}
+
+/* the time in each power zone, for the whole activity and each lap, matches
+ * bucketing each point by searching the zones, with uneven steps, a gap,
+ * readings on the zone boundaries and points without power */
+static int test_zones(void) {
+  const double lower[] = {0, 100, 200, 300};
+  double total[ARRAY_SIZE(lower)] = {0}, laps[2][ARRAY_SIZE(lower)] = {{0}};
+  Activity *a;
+  Zones z;
+  ZoneHistogram h, lap_h[2];
+  DataPoint *dp;
+  unsigned long seed = 9;
+  size_t i, k, zone, n = 1000;
+  double t = 1390000000.0, dt;
+  int err = 0;
+
+  if (!(a = test_activity(n)) || zones_new(&z, Power, lower, 4) ||
+      vector_add(&(a->laps), 0) || vector_add(&(a->laps), 500)) {
+    if (a) activity_destroy(a);
+    return check(false, "zones setup");
+  }
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    t += i == 700 ? 60 : 1 + floor(2 * random_unit(&seed));
+    dp->data[Timestamp] = t;
+    dp->data[Power] = i % 13 == 6   ? UNSET_FIELD
+                      : i % 10 == 3 ? 100 * (i % 4)
+                                    : floor(400 * random_unit(&seed));
+  }
+  activity_finalize(a);
+
+  for (i = 1; i < n; i++) {
+    dp = &(a->data_points[i]);
+    if (!SET(dp->data[Power])) continue;
+    dt = dp->data[Timestamp] - dp[-1].data[Timestamp];
+    dt = dt < ZONES_MAX_GAP ? dt : ZONES_MAX_GAP;
+    for (zone = ARRAY_SIZE(lower) - 1; dp->data[Power] < lower[zone]; zone--)
+      ;
+    total[zone] += dt;
+    laps[i >= 500][zone] += dt;
+  }
+
+  zones_histograms(a, &z, &h, lap_h);
+  for (k = 0; k < ZONES_MAX; k++) {
+    err += check(h.seconds[k] == (k < 4 ? total[k] : 0) &&
+                     lap_h[0].seconds[k] == (k < 4 ? laps[0][k] : 0) &&
+                     lap_h[1].seconds[k] == (k < 4 ? laps[1][k] : 0),
+                 "zone histogram");
+  }
+  activity_destroy(a);
+  return err;
+}
+
+/* calories come from the work done with power, and from the heart rate with
+ * the equations of Keytel et al. (2005) without it */
+static int test_calories(void) {
+  Activity *a;
+  Athlete athlete = DEFAULT_ATHLETE;
+  size_t i, n = 1201;
+  double minutes = (n - 1) / 60.0, per_minute;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "calories setup");
+  for (i = 0; i < n; i++) a->data_points[i].data[HeartRate] = 150;
+  activity_finalize(a);
+
+  athlete.weight = 70;
+  athlete.age = 30;
+  athlete.gender = Male;
+  per_minute = (-55.0969 + 0.6309 * 150 + 0.1988 * 70 + 0.2017 * 30) / 4.184;
+  err += check(close_to(athlete_calories(&athlete, &(a->summary)),
+                        per_minute * minutes, 1e-9),
+               "calories from heart rate");
+  athlete.gender = Female;
+  per_minute = (-20.4022 + 0.4472 * 150 - 0.1263 * 70 + 0.074 * 30) / 4.184;
+  err += check(close_to(athlete_calories(&athlete, &(a->summary)),
+                        per_minute * minutes, 1e-9),
+               "calories from heart rate for women");
+  athlete.age = 0;
+  err += check(!SET(athlete_calories(&athlete, &(a->summary))),
+               "calories without an age");
+
+  for (i = 0; i < n; i++) a->data_points[i].data[Power] = 200;
+  activity_finalize(a);
+  err += check(close_to(athlete_calories(&athlete, &(a->summary)),
+                        200 * (n - 1) / 1000.0, 1e-9),
+               "calories from power");
+  activity_destroy(a);
+  return err;
+}
+
+/* altitude which wanders by less than the hysteresis is never climbing or
+ * descending, while a real climb and descent count in full, however noisy */
+static int test_ascent(void) {
+  Activity *a;
+  DataPoint *dp;
+  unsigned long seed = 13;
+  size_t i, n = 800;
+  double noise = 0.45 * ELEVATION_HYSTERESIS, raw = 0, low, high;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "ascent setup");
+  for (i = 0; i < n; i++) {
+    a->data_points[i].data[Altitude] =
+        100 + noise * (2 * random_unit(&seed) - 1);
+  }
+  activity_finalize(a);
+  err += check(!a->summary.ascent && !a->summary.descent, "noise not climbed");
+
+  /* up 100 meters from 50 to 250, and back down from 400 to 600 */
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    dp->data[Altitude] += i < 50    ? 0
+                          : i < 250 ? (i - 50) / 2.0
+                          : i < 400 ? 100
+                          : i < 600 ? (600 - i) / 2.0
+                                    : 0;
+    if (i) raw += fabs(dp->data[Altitude] - dp[-1].data[Altitude]);
+  }
+  activity_finalize(a);
+  /* the last change before the top may not have reached the hysteresis */
+  low = 100 - ELEVATION_HYSTERESIS - 2 * noise;
+  high = 100 + 2 * noise;
+  err += check(a->summary.ascent > low && a->summary.ascent < high &&
+                   a->summary.descent > low && a->summary.descent < high,
+               "climb counted");
+  err += check(raw > 2 * (a->summary.ascent + a->summary.descent),
+               "noise on the climb not counted");
+  activity_destroy(a);
+  return err;
+}
+
+/* the grade of point `i` found by searching for the ends of its window */
+static double grade_reference(Activity *a, size_t i) {
+  DataPoint *p = a->data_points;
+  double d = p[i].data[Distance];
+  size_t lo = 0, hi = a->num_points - 1;
+
+  while (p[lo].data[Distance] < d - GRADE_WINDOW / 2.0) lo++;
+  while (p[hi].data[Distance] > d + GRADE_WINDOW / 2.0) hi--;
+  if (p[hi].data[Distance] <= p[lo].data[Distance]) return 0;
+  return 100 * (p[hi].data[Altitude] - p[lo].data[Altitude]) /
+         (p[hi].data[Distance] - p[lo].data[Distance]);
+}
+
+/* a steady slope has the same grade everywhere, a noisy one has the grade
+ * over the window around each point, and a recorded grade is kept */
+static int test_grade(void) {
+  Activity *a;
+  DataPoint *dp;
+  unsigned long seed = 17;
+  size_t i, n = 400;
+  double d = 0;
+  int err = 0;
+
+  if (!(a = test_activity(n))) return check(false, "grade setup");
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    /* uneven steps, and standing still for a while */
+    d += i >= 100 && i < 110 ? 0 : 2 + 6 * random_unit(&seed);
+    dp->data[Distance] = d;
+    dp->data[Altitude] = 50 + 0.04 * d;
+  }
+  activity_finalize(a);
+  for (i = 0; i < n; i++) {
+    if (!close_to(a->data_points[i].data[Grade], 4, 1e-9)) break;
+  }
+  err += check(i == n, "steady grade");
+
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    dp->data[Altitude] += 3 * random_unit(&seed);
+    dp->data[Grade] = i == 200 ? 12 : UNSET_FIELD;
+  }
+  activity_finalize(a);
+  for (i = 0; i < n; i++) {
+    if (!close_to(a->data_points[i].data[Grade],
+                  i == 200 ? 12 : grade_reference(a, i), 1e-9))
+      break;
+  }
+  err += check(i == n, "grade over the window");
+  activity_destroy(a);
+  return err;
+}
+
+/* a stop, or a gap in the recording, of at least `PAUSE_MIN_TIME` seconds is
+ * a pause which isn't moving time and starts a break, a shorter one is still
+ * moving, and how slow stopped is depends on the sport */
+static int test_pauses(void) {
+  const Sport sports[] = {UnknownSport, Bicycling, Running};
+  const uint32_t breaks[] = {0, 120, 200}, gap[] = {0, 200};
+  Activity *a;
+  DataPoint *dp;
+  size_t i, s, n = 300;
+  double stopped;
+  bool paused;
+  int err = 0;
+
+  for (s = 0; s < ARRAY_SIZE(sports); s++) {
+    if (!(a = test_activity(n))) return check(false, "pauses setup");
+    a->sport = sports[s];
+    /* crawling along counts as stopped on a bike, but not on foot */
+    stopped = sports[s] == UnknownSport ? 0 : 0.8;
+    paused = sports[s] != Running;
+    for (i = 0; i < n; i++) {
+      dp = &(a->data_points[i]);
+      /* a gap of 31 seconds before 200 and of 6 seconds before 250 */
+      dp->data[Timestamp] += i >= 250 ? 35 : i >= 200 ? 30 : 0;
+      /* stopped for 6 seconds up to 56 and for 20 seconds up to 120 */
+      dp->data[Speed] = i >= 50 && i < 56     ? 0
+                        : i >= 100 && i < 120 ? stopped
+                                              : 5;
+    }
+    activity_finalize(a);
+
+    err += check(a->summary.elapsed == n - 1 + 35 &&
+                     a->summary.moving ==
+                         a->summary.elapsed - (paused ? 20 : 0) - 31,
+                 "paused moving time");
+    /* without any recorded breaks the pauses are all of the breaks */
+    err += check(paused ? starts_equal(&(a->breaks), breaks, 3) &&
+                              starts_equal(&(a->pauses), breaks, 3)
+                        : starts_equal(&(a->breaks), gap, 2) &&
+                              starts_equal(&(a->pauses), gap, 2),
+                 "pause breaks");
+    activity_destroy(a);
+  }
+  return err;
+}
+
+/* points recorded out of order are dropped, merged or put in their place
+ * depending on the policy, as far back as `ORDER_WINDOW` and beyond it, and
+ * the laps still start at the points they were recorded at */
+static int ordered_activity(OrderPolicy policy, size_t delay, bool *merged) {
+  Activity *a;
+  DataPoint dp;
+  size_t i, n = 40, late = 18, dup = 25, count;
+  int err = 0;
+
+  if (!(a = activity_new())) return check(false, "order setup");
+  a->order.policy = policy;
+  for (i = 0; i < n; i++) {
+    if (!(i % 10)) vector_add(&(a->laps), (uint32_t)a->num_points);
+    unset_data_point(&dp);
+    dp.data[Timestamp] = 1390000000.0 + i;
+    if (i != late) activity_append_point(a, &dp);
+    if (i == late + delay) {
+      dp.data[Timestamp] = 1390000000.0 + late;
+      activity_append_point(a, &dp);
+    }
+    if (i == (dup + delay < n ? dup + delay : n - 1)) {
+      dp.data[Timestamp] = 1390000000.0 + dup;
+      dp.data[Power] = 200;
+      activity_append_point(a, &dp);
+    }
+  }
+  activity_finalize(a);
+
+  count = policy == OrderReorder ? n : n - 1;
+  err += check(a->num_points == count, "ordered point count");
+  for (i = 1; i < a->num_points; i++) {
+    if (a->data_points[i].data[Timestamp] <=
+        a->data_points[i - 1].data[Timestamp])
+      break;
+  }
+  err += check(i == a->num_points, "ordered timestamps");
+  err += check(a->laps.size == n / 10 && !a->laps.data[0], "ordered laps");
+  for (i = 1; !err && i < a->laps.size; i++) {
+    err += check(a->data_points[a->laps.data[i]].data[Timestamp] ==
+                     1390000000.0 + 10 * i,
+                 "ordered lap starts");
+  }
+  for (i = 0; i < a->num_points; i++) {
+    if (a->data_points[i].data[Timestamp] == 1390000000.0 + dup) break;
+  }
+  *merged = i < a->num_points && a->data_points[i].data[Power] == 200;
+  activity_destroy(a);
+  return err;
+}
+
+static int test_order_policies(void) {
+  size_t delay[] = {3, ORDER_WINDOW + 6}, d;
+  bool merged;
+  int err = 0;
+
+  for (d = 0; d < 2; d++) {
+    err += ordered_activity(OrderDrop, delay[d], &merged);
+    err += check(!merged, "dropped duplicate");
+    err += ordered_activity(OrderMerge, delay[d], &merged);
+    /* merging doesn't look for the point beyond the window */
+    err += check(merged == !d, "merged duplicate");
+    err += ordered_activity(OrderReorder, delay[d], &merged);
+    err += check(merged, "reordered duplicate");
+  }
+  return err;
+}
+
+/* a track heading north at 5 m/s, which jumps `east` meters to the east for
+ * the points from `from` to `to` */
+static Activity *gps_activity(size_t n, size_t from, size_t to, double east) {
+  Activity *a;
+  size_t i;
+
+  if (!(a = test_activity(n))) return NULL;
+  for (i = 0; i < n; i++) {
+    a->data_points[i].data[Latitude] = 45 + i * 5 / 111195.0;
+    a->data_points[i].data[Longitude] =
+        7 + (i >= from && i < to ? east / 78710.0 : 0);
+  }
+  return a;
+}
+
+/* a position which jumps away and straight back is moved onto the track,
+ * while one which stays where it jumped to is a real jump and is kept */
+static int test_gps_filter(void) {
+  Activity *a;
+  size_t i, n = 100;
+  int err = 0;
+
+  if (!(a = gps_activity(n, 40, 41, 1000))) return check(false, "gps setup");
+  err += check(fix_activity(a, FIX(InvalidGPS)) == 1 &&
+                   a->errors[InvalidGPS] == 1,
+               "gps spike fixed");
+  for (i = 0; i < n; i++) {
+    if (!close_to(a->data_points[i].data[Longitude], 7, 1e-9) ||
+        !close_to(a->data_points[i].data[Latitude], 45 + i * 5 / 111195.0,
+                  1e-9))
+      break;
+  }
+  err += check(i == n, "gps spike back on the track");
+  activity_destroy(a);
+
+  if (!(a = gps_activity(n, 40, n, 1000))) return check(false, "gps setup");
+  err += check(!fix_activity(a, FIX(InvalidGPS)) && !a->errors[InvalidGPS],
+               "gps jump kept");
+  err += check(close_to(a->data_points[40].data[Longitude],
+                        7 + 1000 / 78710.0, 1e-12),
+               "gps jump where it jumped to");
+  activity_destroy(a);
+
+  /* the filter keeps up with the pass through the last points */
+  if (!(a = gps_activity(n, n - 2, n - 1, 1000))) {
+    return check(false, "gps setup");
+  }
+  err += check(fix_activity(a, FIX(InvalidGPS)) == 1 &&
+                   close_to(a->data_points[n - 2].data[Longitude], 7, 1e-9),
+               "gps spike at the end fixed");
+  activity_destroy(a);
+  return err;
+}
+
+/* a track with a GPS spike and a few points without a position, and power
+ * and heart rate with spikes and a heart rate dropout */
+static Activity *dirty_activity(size_t n) {
+  Activity *a;
+  DataPoint *dp;
+  unsigned long seed = 11;
+  size_t i;
+
+  if (!(a = gps_activity(n, 40, 41, 1000))) return NULL;
+  for (i = 0; i < n; i++) {
+    dp = &(a->data_points[i]);
+    if (i >= 60 && i < 63) dp->data[Latitude] = dp->data[Longitude] = 0;
+    dp->data[Power] = floor(180 + 40 * random_unit(&seed));
+    dp->data[HeartRate] = floor(138 + 4 * random_unit(&seed));
+  }
+  a->data_points[100].data[Power] = 1200;
+  a->data_points[120].data[Power] = FIX_MAX_POWER + 500;
+  a->data_points[150].data[HeartRate] = 200;
+  for (i = 170; i < 173; i++) a->data_points[i].data[HeartRate] = 0;
+  activity_finalize(a);
+  return a;
+}
+
+/* whether `fields` of every point of `a` are the same as those of `b` */
+static bool fields_equal(Activity *a, Activity *b, const DataField *fields,
+                         size_t count) {
+  size_t i, f;
+
+  if (a->num_points != b->num_points) return false;
+  for (i = 0; i < a->num_points; i++) {
+    for (f = 0; f < count; f++) {
+      if (!close_to(a->data_points[i].data[fields[f]],
+                    b->data_points[i].data[fields[f]], 1e-12))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* all of the fixes in one pass fix the same points in the same way as each
+ * fix run on its own in turn, and a fix leaves the fields and the counts of
+ * the fixes which weren't selected alone */
+static int test_fused_fixes(void) {
+  const DataField fixed[] = {Latitude, Longitude, Power, HeartRate},
+                  others[] = {Latitude, Longitude, HeartRate};
+  const DataError order[] = {InvalidGPS, PowerSpikes, HeartRateDropouts,
+                             HeartRateSpikes};
+  const unsigned counts[] = {4, 0, 2, 1, 3};
+  Activity *a = NULL, *b = NULL, *c = NULL;
+  size_t n = 300, e;
+  int fixes = 0, err = 0;
+
+  if (!(a = dirty_activity(n)) || !(b = dirty_activity(n)) ||
+      !(c = dirty_activity(n))) {
+    err += check(false, "fused fixes setup");
+    goto out;
+  }
+
+  a->errors[Dropouts] = 3;
+  err += check(fix_activity(a, FIX_ALL) == 10 && a->errors[Dropouts] == 3,
+               "fused fix count");
+  for (e = 0; e < ARRAY_SIZE(order); e++) {
+    fixes += fix_activity(b, FIX(order[e]));
+  }
+  err += check(fixes == 10, "separate fix count");
+  for (e = 0; e < DataErrorCount; e++) {
+    err += check(e == Dropouts || (a->errors[e] == counts[e] &&
+                                   b->errors[e] == counts[e]),
+                 "fix counts");
+  }
+  err += check(fields_equal(a, b, fixed, ARRAY_SIZE(fixed)),
+               "fused fixes match separate fixes");
+
+  /* nothing inserts the missing points, so they stay missing */
+  err += check(!fix_activity(c, FIX(Dropouts)), "dropouts left alone");
+  err += check(fix_activity(c, FIX(PowerSpikes)) == 2 &&
+                   c->errors[PowerSpikes] == 2 && !c->errors[InvalidGPS] &&
+                   !c->errors[HeartRateSpikes] &&
+                   !c->errors[HeartRateDropouts],
+               "power fix count");
+  activity_destroy(b);
+  if (!(b = dirty_activity(n))) {
+    err += check(false, "fused fixes setup");
+    goto out;
+  }
+  err += check(fields_equal(b, c, others, ARRAY_SIZE(others)),
+               "power fix leaves the other fields alone");
+  err += check(fix_activity(c, FIX(HeartRateSpikes)) == 1 &&
+                   c->data_points[170].data[HeartRate] == 0 &&
+                   c->errors[PowerSpikes] == 2,
+               "heart rate spikes leave dropouts alone");
+
+out:
+  if (a) activity_destroy(a);
+  if (b) activity_destroy(b);
+  if (c) activity_destroy(c);
+  return err;
+}
+
+/* runs a batch of inputs through the pipeline, where each output has to come
+ * from its own input whatever order the workers finish in, the inputs which
+ * fail are reported as such, and nothing is fixed unless asked for */
+static int run_pipeline(const char *dir, unsigned threads) {
+  PipelineOptions o = DEFAULT_PIPELINE_OPTIONS;
+  const PipelineStatus expected[] = {PipelineOK, PipelineParseError,
+                                     PipelineOK, PipelineReadError,
+                                     PipelineOK, PipelineOK};
+  PipelineStatus status[ARRAY_SIZE(expected)];
+  char names[ARRAY_SIZE(expected)][64], *inputs[ARRAY_SIZE(expected)];
+  unsigned i, count = ARRAY_SIZE(expected), errors;
+  size_t rows;
+  Activity *a;
+  FILE *f;
+  int err = 0;
+
+  for (i = 0; i < count; i++) {
+    snprintf(names[i], sizeof(names[i]), "%s/%u.dat", dir, i);
+    inputs[i] = names[i];
+    if (expected[i] == PipelineReadError || !(f = fopen(names[i], "w")))
+      continue;
+    if (expected[i] == PipelineParseError) {
+      fprintf(f, "not an activity\n");
+    } else {
+      rows = write_rows(f, 10 + 50 * i, 0);
+      /* a power spike at the end, which is left alone */
+      fseek(f, 0, SEEK_END);
+      fprintf(f, "%lu,3000,120\n", 1390000000ul + (unsigned long)rows);
+    }
+    fclose(f);
+  }
+
+  o.threads = threads;
+  o.queue_size = 1;
+  errors = pipeline_run(inputs, count, &o, status);
+  err += check(errors == 2, "pipeline error count");
+
+  for (i = 0; i < count; i++) {
+    err += check(status[i] == expected[i], "pipeline status");
+    snprintf(names[i] + strlen(names[i]) - 3, 4, "csv");
+    a = (f = fopen(names[i], "r")) ? csv_read(f) : NULL;
+    if (f) fclose(f);
+    if (expected[i] != PipelineOK) {
+      err += check(!f, "pipeline output for a failed input");
+    } else {
+      rows = 10 + 50 * i;
+      err += check(a && a->num_points == rows + 1 &&
+                       a->data_points[rows].data[Power] == 3000,
+                   "pipeline output from its own input");
+    }
+    if (a) activity_destroy(a);
+    remove(names[i]);
+    snprintf(names[i] + strlen(names[i]) - 3, 4, "dat");
+    remove(names[i]);
+  }
+  return err;
+}
+
+static int test_pipeline(void) {
+  char dir[] = "/tmp/pipelineXXXXXX";
+  int err = 0;
+
+  if (!mkdtemp(dir)) return check(false, "pipeline setup");
+  /* one thread still starts a worker for each stage */
+  err += run_pipeline(dir, 1);
+  err += run_pipeline(dir, 4);
+  remove(dir);
+  return err;
+}
+
+/* merging a head unit with a heart rate strap which started recording half
+ * way through gives a distance derived over the merged track, rather than
+ * one which starts again from zero where the first activity ends */
+static int test_merge(void) {
+  const uint32_t laps[] = {0, 50};
+  Activity *a[2], *m;
+  DataPoint *dp;
+  size_t i, j;
+  int err = 0;
+
+  for (i = 0; i < 2; i++) {
+    if (!(a[i] = test_activity(100))) {
+      if (i) activity_destroy(a[0]);
+      return check(false, "merge setup");
+    }
+    for (j = 0; j < 100; j++) {
+      dp = &(a[i]->data_points[j]);
+      dp->data[Timestamp] += 50 * i;
+      dp->data[Latitude] = 45 + (j + 50 * i) * 5 / 111195.0;
+      dp->data[Longitude] = 7;
+      if (i) dp->data[HeartRate] = 140;
+    }
+  }
+  vector_add(&(a[0]->laps), 0);
+  vector_add(&(a[0]->laps), 50);
+  activity_finalize(a[0]);
+  activity_finalize(a[1]);
+
+  if (!(m = fitparse_merge(a, 2))) {
+    err += check(false, "fitparse_merge");
+    goto out;
+  }
+  err += check(m->num_points == 150 &&
+                   starts_equal(&(m->laps), laps, ARRAY_SIZE(laps)) &&
+                   m->data_points[120].data[HeartRate] == 140,
+               "merged points");
+  for (i = 1; i < m->num_points; i++) {
+    if (m->data_points[i].data[Distance] < m->data_points[i - 1].data[Distance])
+      break;
+  }
+  err += check(i == m->num_points &&
+                   close_to(m->data_points[149].data[Distance], 745, 0.5),
+               "merged distance");
+  err += check(close_to(a[1]->data_points[99].data[Distance], 495, 0.5),
+               "merged activities left alone");
+  activity_destroy(m);
+
+out:
+  activity_destroy(a[0]);
+  activity_destroy(a[1]);
+  return err;
+}
+
+/* an activity with laps at 0 and 150, a recorded break at 200, a stop from
+ * 95 to 110 and a minute long gap before 250, which are both pauses */
+static Activity *paused_activity(void) {
+  Activity *a;
+  DataPoint dp;
+  size_t i;
+  double t = 1390000000.0;
+
+  if (!(a = activity_new())) return NULL;
+  if (vector_add(&(a->laps), 0) || vector_add(&(a->laps), 150) ||
+      vector_add(&(a->breaks), 0) || vector_add(&(a->breaks), 200)) {
+    activity_destroy(a);
+    return NULL;
+  }
+  for (i = 0; i < 300; i++) {
+    unset_data_point(&dp);
+    t += i == 250 ? 60 : 0;
+    dp.data[Timestamp] = t++;
+    dp.data[Speed] = i >= 95 && i <= 110 ? 0 : 5;
+    if (activity_append_point(a, &dp)) {
+      activity_destroy(a);
+      return NULL;
+    }
+  }
+  activity_finalize(a);
+  return a;
+}
+
+/* crops, splits and views keep the recorded breaks which fall in them and
+ * find their own pauses, rather than keeping the pauses of the whole
+ * activity, and finalizing them again doesn't change anything */
+static int test_views(void) {
+  const uint32_t breaks[] = {0, 111, 200, 250}, pauses[] = {111, 250},
+                 view_laps[] = {0, 45}, view_breaks[] = {0, 95, 145},
+                 view_pauses[] = {145}, crop_laps[] = {0, 100},
+                 crop_breaks[] = {0, 61, 150}, crop_pauses[] = {61},
+                 part_laps[] = {0, 150}, part_breaks[] = {0, 111, 200};
+  Activity *a, *v, **parts;
+  size_t i, n;
+  int err = 0;
+
+  if (!(a = paused_activity())) return check(false, "view setup");
+  err += check(starts_equal(&(a->breaks), breaks, ARRAY_SIZE(breaks)) &&
+                   starts_equal(&(a->pauses), pauses, ARRAY_SIZE(pauses)),
+               "activity pauses");
+
+  /* starting part way through the stop, which is too short to be a pause */
+  if (!(v = activity_view(a, 105, 260))) {
+    err += check(false, "activity_view");
+  } else {
+    for (i = 0; i < 2; i++) {
+      err += check(
+          starts_equal(&(v->laps), view_laps, ARRAY_SIZE(view_laps)) &&
+              starts_equal(&(v->breaks), view_breaks,
+                           ARRAY_SIZE(view_breaks)) &&
+              starts_equal(&(v->pauses), view_pauses, ARRAY_SIZE(view_pauses)),
+          i ? "view finalized again" : "view breaks");
+      activity_finalize(v);
+    }
+    activity_destroy(v);
+  }
+
+  if (!(v = fitparse_crop(a, 1390000050.0, 1390000300.0))) {
+    err += check(false, "fitparse_crop");
+  } else {
+    err += check(
+        v->num_points == 200 &&
+            starts_equal(&(v->laps), crop_laps, ARRAY_SIZE(crop_laps)) &&
+            starts_equal(&(v->breaks), crop_breaks, ARRAY_SIZE(crop_breaks)) &&
+            starts_equal(&(v->pauses), crop_pauses, ARRAY_SIZE(crop_pauses)),
+        "crop breaks");
+    activity_destroy(v);
+  }
+
+  if (!(parts = fitparse_split(a, 30, &n))) {
+    err += check(false, "fitparse_split");
+  } else {
+    err += check(n == 2 && parts[0]->num_points == 250 &&
+                     starts_equal(&(parts[0]->laps), part_laps,
+                                  ARRAY_SIZE(part_laps)) &&
+                     starts_equal(&(parts[0]->breaks), part_breaks,
+                                  ARRAY_SIZE(part_breaks)) &&
+                     starts_equal(&(parts[0]->pauses), pauses, 1) &&
+                     starts_equal(&(parts[1]->breaks), breaks, 1) &&
+                     !parts[1]->pauses.size,
+                 "split breaks");
+    for (i = 0; i < n; i++) activity_destroy(parts[i]);
+    free(parts);
+  }
+  activity_destroy(a);
+  return err;
+}
+
+/* the `Summary` of the points from `start` up to `end` found by visiting
+ * every one of them, for just the values of the points and the elapsed time */
+static void reference_summary(Activity *a, size_t start, size_t end,
+                              Summary *s) {
+  DataField i;
+  double v;
+  size_t j;
+
+  summary_init(s);
+  for (j = start; j < end; j++) {
+    for (i = 0; i < DataFieldCount; i++) {
+      v = a->data_points[j].data[i];
+      if (!SET(v)) {
+        s->unset[i]++;
+        continue;
+      }
+      s->point[Minimum].data[i] = v < s->point[Minimum].data[i]
+                                      ? v
+                                      : s->point[Minimum].data[i];
+      s->point[Maximum].data[i] = v > s->point[Maximum].data[i]
+                                      ? v
+                                      : s->point[Maximum].data[i];
+      s->point[Total].data[i] += v;
+    }
+  }
+  for (i = 0; i < DataFieldCount; i++) {
+    v = (double)(end - start - s->unset[i]);
+    s->point[Average].data[i] = v ? s->point[Total].data[i] / v : 0;
+  }
+  s->elapsed = a->data_points[end - 1].data[Timestamp] -
+               a->data_points[start].data[Timestamp];
+}
+
+/* whether the values of the points summarized by `s` match those of `want` */
+static bool summary_matches(Summary *s, Summary *want) {
+  DataField i;
+  int k;
+
+  for (i = 0; i < DataFieldCount; i++) {
+    for (k = Minimum; k <= Average; k++) {
+      if (!close_to(s->point[k].data[i], want->point[k].data[i], 1e-9))
+        return false;
+    }
+    if (s->unset[i] != want->unset[i]) return false;
+  }
+  return s->elapsed == want->elapsed;
+}
+
+/* the time moving from `start` up to `end` when nothing has a speed, which
+ * is every step that isn't a gap of at least `PAUSE_MIN_TIME` seconds */
+static double reference_moving(Activity *a, size_t start, size_t end) {
+  double dt, moving = 0;
+  size_t j;
+
+  for (j = start + 1; j < end; j++) {
+    dt = a->data_points[j].data[Timestamp] -
+         a->data_points[j - 1].data[Timestamp];
+    moving += dt < PAUSE_MIN_TIME ? dt : 0;
+  }
+  return moving;
+}
+
+/* an `Activity` with random power and heart rate, some of it missing, and a
+ * minute long gap before point 250 */
+static Activity *summary_activity(size_t n) {
+  Activity *a;
+  DataPoint *dp;
+  unsigned long seed = 5;
+  size_t j;
+
+  if (!(a = test_activity(n))) return NULL;
+  for (j = 0; j < n; j++) {
+    dp = &(a->data_points[j]);
+    dp->data[Timestamp] += j >= 250 ? 60 : 0;
+    dp->data[Power] = j % 7 ? floor(400 * random_unit(&seed)) : UNSET_FIELD;
+    dp->data[HeartRate] = j < 20 ? UNSET_FIELD : 100 + 80 * random_unit(&seed);
+  }
+  return a;
+}
+
+/* the summary of each lap, and of each segment between the breaks, which are
+ * worked out together in one pass, match summarizing its points alone */
+static int test_lap_summaries(void) {
+  const uint32_t laps[] = {0, 97, 220}, breaks[] = {0, 180, 250},
+                 pauses[] = {250};
+  Vector *starts[2];
+  Summary *summaries[2], want;
+  Activity *a;
+  size_t n = 300, k, l, end;
+  int err = 0;
+
+  if (!(a = summary_activity(n)) || vector_add(&(a->laps), 0) ||
+      vector_add(&(a->laps), 97) || vector_add(&(a->laps), 220) ||
+      vector_add(&(a->breaks), 0) || vector_add(&(a->breaks), 180)) {
+    if (a) activity_destroy(a);
+    return check(false, "lap summaries setup");
+  }
+  activity_finalize(a);
+  err += check(starts_equal(&(a->laps), laps, ARRAY_SIZE(laps)) &&
+                   starts_equal(&(a->breaks), breaks, ARRAY_SIZE(breaks)) &&
+                   starts_equal(&(a->pauses), pauses, ARRAY_SIZE(pauses)),
+               "lap summaries starts");
+
+  starts[0] = &(a->laps);
+  starts[1] = &(a->breaks);
+  summaries[0] = a->lap_summaries;
+  summaries[1] = a->break_summaries;
+  for (l = 0; l < 2; l++) {
+    if (check(summaries[l] != NULL, "lap summaries")) {
+      err++;
+      continue;
+    }
+    for (k = 0; k < starts[l]->size; k++) {
+      end = k + 1 < starts[l]->size ? starts[l]->data[k + 1] : n;
+      reference_summary(a, starts[l]->data[k], end, &want);
+      err += check(summary_matches(&(summaries[l][k]), &want) &&
+                       summaries[l][k].moving ==
+                           reference_moving(a, starts[l]->data[k], end),
+                   l ? "break summary" : "lap summary");
+    }
+  }
+  activity_destroy(a);
+  return err;
+}
+
+/* range summaries from the index match visiting every point of the range,
+ * for ranges within a block, across a few blocks and across many of them,
+ * and the index follows the points when they change */
+static int test_range_summary(void) {
+  Activity *a;
+  Summary s, want;
+  unsigned long seed = 9;
+  size_t n = 1000, start, end, k;
+  int err = 0;
+
+  if (!(a = summary_activity(n))) return check(false, "range summary setup");
+  activity_finalize(a);
+  err += check(activity_range_summary(a, 10, 10, &s) &&
+                   activity_range_summary(a, 0, n + 1, &s),
+               "empty range summary");
+
+  /* mostly short ranges, so that some stay within a block or two */
+  for (k = 0; k < 500; k++) {
+    start = k ? (size_t)(n * random_unit(&seed)) : 0;
+    end = start + 1 +
+          (size_t)((k % 3 ? INDEX_BLOCK * 3 : n) * random_unit(&seed));
+    end = k && end < n ? end : n;
+    reference_summary(a, start, end, &want);
+    err += check(!activity_range_summary(a, start, end, &s) &&
+                     summary_matches(&s, &want),
+                 "range summary");
+  }
+
+  a->data_points[500].data[Power] = 5000;
+  activity_finalize(a);
+  reference_summary(a, 100, 900, &want);
+  err += check(!activity_range_summary(a, 100, 900, &s) &&
+                   s.point[Maximum].data[Power] == 5000 &&
+                   summary_matches(&s, &want),
+               "range summary after the points change");
+  activity_destroy(a);
+  return err;
+}
+
+/* the behavior tests which don't need any input files */
+static int test_kernels(void) {
+  int err = 0;
+
+  err += test_csv_chunks();
+  err += test_csv_simplify();
+  err += test_xml_split();
+  err += test_meanmax();
+  err += test_meanmax_samples();
+  err += test_rolling();
+  err += test_rolling_median();
+  err += test_spikes();
+  err += test_geo_distances();
+  err += test_simplify();
+  err += test_resample();
+  err += test_time_index();
+  err += test_normalized_power();
+  err += test_zones();
+  err += test_calories();
+  err += test_ascent();
+  err += test_grade();
+  err += test_pauses();
+  err += test_order_policies();
+  err += test_gps_filter();
+  err += test_fused_fixes();
+  err += test_pipeline();
+  err += test_merge();
+  err += test_views();
+  err += test_lap_summaries();
+  err += test_range_summary();
+  print("%d kernel test failures\n", err);
+  return err;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc == 3) {
+  if (argc == 1) {
+    return test_kernels() ? 1 : 0;
+  } else if (argc == 3) {
     return test(argv[1], argv[2]);
   } else {
     return test(argv[1], DEFAULT_DIR);
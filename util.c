@@ -19,12 +19,24 @@
 #include <stdint.h>
 #include <time.h>
 #include <ctype.h>
+#include <unistd.h>
 
 #include "date.h"
 
 #include "activity.h"
 #include "util.h"
 
+/**
+ * DATA_FIELDS
+ *
+ * Description:
+ *  Mapping from `DataField` to field name string.
+ */
+const char *DATA_FIELDS[DataFieldCount] = {
+    "timestamp",  "latitude", "longitude",  "altitude",
+    "distance",   "speed",    "power",      "grade",
+    "heart_rate", "cadence",  "lr_balance", "temperature"};
+
 /* Parse an ISO_8601 timestamp */
 uint32_t parse_timestamp(const char *date) {
   unsigned long timestamp;
@@ -36,8 +48,11 @@ uint32_t parse_timestamp(const char *date) {
 
 int format_timestamp(char *buf, uint32_t timestamp) {
   time_t time = (time_t)timestamp;
-  struct tm *tm = gmtime(&time);
-  return !strftime(buf, TIME_BUFSIZ, "%Y-%m-%dT%H:%M:%SZ", tm) ? -1 : 0;
+  struct tm tm;
+
+  /* writers run on several threads at once, so no shared static buffer */
+  if (!gmtime_r(&time, &tm)) return -1;
+  return !strftime(buf, TIME_BUFSIZ, "%Y-%m-%dT%H:%M:%SZ", &tm) ? -1 : 0;
 }
 
 char *change_extension(char *filename, char *ext) {
@@ -69,3 +84,32 @@ double parse_field(DataField field, DataPoint *dp, const char *str) {
   }
   return dp->data[field];
 }
+
+/* Read everything remaining in `f` into a NUL terminated buffer which the
+ * caller must free. `len` does not include the terminator. */
+char *read_all(FILE *f, size_t *len) {
+  char *buf = NULL, *tmp;
+  size_t alloc = 0, n;
+
+  *len = 0;
+  do {
+    ALLOC_GROW(buf, *len + BUFSIZ + 1, alloc);
+    if (!buf) return NULL;
+    n = fread(buf + *len, 1, alloc - *len - 1, f);
+    *len += n;
+  } while (n && !ferror(f));
+
+  if (ferror(f)) {
+    free(buf);
+    return NULL;
+  }
+
+  buf[*len] = '\0';
+  return (tmp = realloc(buf, *len + 1)) ? tmp : buf;
+}
+
+/* The number of CPUs currently online, used to size worker pools. */
+unsigned online_cpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned)n : 1;
+}
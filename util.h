@@ -21,6 +21,7 @@
 #include <ctype.h>
 #include <float.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -47,24 +48,28 @@
   } while (0)
 
 #define PI (3.141592653589793)
+#define EARTH_RADIUS 6371000 /* m */
 #define TIME_BUFSIZ 21
 
-typedef struct {
-  uint32_t *data;
-  size_t size;
-  size_t alloc;
-} Vector;
+extern const char *DATA_FIELDS[DataFieldCount];
 
 static inline int vector_add(Vector *v, uint32_t p) {
   ALLOC_GROW(v->data, v->size + 1, v->alloc);
   if (!v->data) {
     return 1;
   }
-  v->data[v.size] = p;
+  v->data[v->size] = p;
   v->size++;
   return 0;
 }
 
+/* a point was inserted at `index`, so the points from there on moved up */
+static inline void vector_shift(Vector *v, uint32_t index) {
+  size_t i;
+
+  for (i = v->size; i > 0 && v->data[i - 1] >= index; i--) v->data[i - 1]++;
+}
+
 static inline void vector_destroy(Vector *v) {
   if (v->data) free(v->data);
 }
@@ -93,5 +98,7 @@ int format_timestamp(char *buf, uint32_t timestamp);
 char *change_extension(char *filename, char *ext);
 FileFormat file_format(char *ext);
 double parse_field(DataField field, DataPoint *dp, const char *str);
+char *read_all(FILE *f, size_t *len);
+unsigned online_cpus(void);
 
 #endif /* _UTIL_H_ */
@@ -0,0 +1,313 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mxml.h"
+
+#include "util.h"
+#include "xml.h"
+
+/**
+ * Worker
+ *
+ * Description:
+ *  Arguments for a thread parsing a single `XMLSegment`.
+ */
+typedef struct {
+  XMLSegment *segment;
+  mxml_sax_cb_t cb;
+} Worker;
+
+/**
+ * name_at
+ *
+ * Description:
+ *  Whether the element name at `p` (just past the '<' or '</') is exactly
+ *  `name`, ie. is not merely prefixed by it.
+ */
+static bool name_at(const char *p, const char *end, const char *name) {
+  size_t len = strlen(name);
+
+  if ((size_t)(end - p) <= len || strncmp(p, name, len)) return false;
+  return isspace(p[len]) || p[len] == '>' || p[len] == '/';
+}
+
+/**
+ * find_point
+ *
+ * Description:
+ *  Find the start of the next `point` element at or after `p`.
+ *
+ * Return value:
+ *  NULL - there are no more `point` elements.
+ *  valid pointer - the '<' which opens the element.
+ */
+static const char *find_point(const char *p, const char *end,
+                              const char *point) {
+  while ((p = memchr(p, '<', end - p))) {
+    if (name_at(p + 1, end, point)) return p;
+    p++;
+  }
+  return NULL;
+}
+
+/**
+ * scan_containers
+ *
+ * Description:
+ *  Track how the `containers` are opened and closed between `p` and `end`,
+ *  updating the stack of currently open containers. Every other element is
+ *  ignored.
+ *
+ * Parameters:
+ *  p - the start of the text to scan.
+ *  end - one past the end of the text to scan.
+ *  containers - NULL terminated names of the elements to track.
+ *  stack - indices into `containers` of the currently open elements.
+ *  depth - the number of entries in `stack`.
+ *
+ * Return value:
+ *  0 - the containers nest properly.
+ *  1 - a container was closed out of order or nested too deeply.
+ */
+static int scan_containers(const char *p, const char *end,
+                           const char **containers, int stack[],
+                           size_t *depth) {
+  const char *gt;
+  bool close;
+  int i;
+
+  for (; (p = memchr(p, '<', end - p)); p++) {
+    close = (p + 1 < end && p[1] == '/');
+
+    for (i = 0; containers[i]; i++) {
+      if (name_at(p + 1 + close, end, containers[i])) break;
+    }
+    if (!containers[i]) continue;
+
+    if (close) {
+      if (!*depth || stack[*depth - 1] != i) return 1;
+      (*depth)--;
+    } else {
+      /* self closing containers don't change the nesting */
+      if ((gt = memchr(p, '>', end - p)) && gt[-1] == '/') continue;
+      if (*depth == XML_MAX_DEPTH) return 1;
+      stack[(*depth)++] = i;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * wrap_segment
+ *
+ * Description:
+ *  Copy the text between `start` and `end` into a new buffer, preceded by
+ *  synthetic opening tags for the containers that were open at `start` and
+ *  followed by closing tags for the containers still open at `end`.
+ *
+ * Return value:
+ *  NULL - unable to allocate the segment.
+ *  valid pointer - the well formed segment. The caller must free it.
+ */
+static char *wrap_segment(const char *start, const char *end,
+                          const char **containers, int before[],
+                          size_t before_depth, int after[],
+                          size_t after_depth) {
+  char *xml, *p;
+  size_t i, size = end - start + 1;
+
+  for (i = 0; i < before_depth; i++) {
+    size += strlen(containers[before[i]]) + sizeof(XML_SYNTHETIC) + 6;
+  }
+  for (i = 0; i < after_depth; i++) {
+    size += strlen(containers[after[i]]) + 3;
+  }
+
+  if (!(p = xml = malloc(size))) return NULL;
+
+  for (i = 0; i < before_depth; i++) {
+    p += sprintf(p, "<%s " XML_SYNTHETIC "=\"\">", containers[before[i]]);
+  }
+  memcpy(p, start, end - start);
+  p += end - start;
+  for (i = after_depth; i > 0; i--) {
+    p += sprintf(p, "</%s>", containers[after[i - 1]]);
+  }
+  *p = '\0';
+
+  return xml;
+}
+
+/**
+ * xml_split
+ *
+ * Description:
+ *  Speculatively split a large XML document into segments which can be
+ *  parsed independently. Split points are chosen at evenly spaced `point`
+ *  elements, and each segment is wrapped in the `containers` open at its
+ *  boundaries so that it is well formed. The first segment contains
+ *  everything before the first split (the header) and the last everything
+ *  after the final split (the trailer).
+ *
+ *  If a split point could be ambiguous - there are comments or CDATA
+ *  sections after the first split, or the containers don't nest the way we
+ *  expect - we give up and the caller should parse sequentially.
+ *
+ * Parameters:
+ *  buf - the NUL terminated document.
+ *  len - the length of `buf`.
+ *  point - the name of the element for a single point, eg. "trkpt".
+ *  containers - NULL terminated names of every element which may enclose
+ *               points, including the document root.
+ *  n - set to the number of segments.
+ *
+ * Return value:
+ *  NULL - the document is too small or can't be split safely.
+ *  valid pointer - `n` segments with `state` and `tree` unset. Must be freed
+ *                  with `xml_destroy_segments`.
+ */
+XMLSegment *xml_split(const char *buf, size_t len, const char *point,
+                      const char **containers, size_t *n) {
+  const char *end = buf + len, *p, **splits;
+  int stack[XML_MAX_DEPTH], prev[XML_MAX_DEPTH];
+  size_t i, k, count, depth = 0, prev_depth;
+  XMLSegment *segments = NULL;
+
+  count = len / XML_SEGMENT_SIZE;
+  if (count > online_cpus()) count = online_cpus();
+  if (count < 2) return NULL;
+
+  if (!(splits = malloc((count + 1) * sizeof(*splits)))) return NULL;
+
+  splits[0] = buf;
+  for (i = 1, k = 1; i < count; i++) {
+    if (!(p = find_point(buf + i * (len / count), end, point))) break;
+    if (p > splits[k - 1]) splits[k++] = p;
+  }
+  splits[k] = end;
+  count = k;
+
+  /* a point inside a comment or CDATA section would make a bogus split, and
+   * any such section which could contain one ends after the first split */
+  if (count < 2 || strstr(splits[1], "-->") || strstr(splits[1], "]]>")) {
+    free(splits);
+    return NULL;
+  }
+
+  if (!(segments = calloc(count, sizeof(*segments)))) goto fail;
+
+  for (k = 0; k < count; k++) {
+    memcpy(prev, stack, depth * sizeof(*stack));
+    prev_depth = depth;
+
+    if (scan_containers(splits[k], splits[k + 1], containers, stack, &depth))
+      goto fail;
+    /* every split must fall within a container, and the end must close them */
+    if ((k < count - 1 && !depth) || (k == count - 1 && depth)) goto fail;
+
+    if (!(segments[k].xml = wrap_segment(splits[k], splits[k + 1], containers,
+                                         prev, prev_depth, stack, depth)))
+      goto fail;
+  }
+
+  free(splits);
+  *n = count;
+  return segments;
+
+fail:
+  if (segments) xml_destroy_segments(segments, count);
+  free(splits);
+  return NULL;
+}
+
+static void *parse_segment(void *data) {
+  Worker *w = (Worker *)data;
+  XMLSegment *s = w->segment;
+
+  s->tree =
+      mxmlSAXLoadString(NULL, s->xml, MXML_OPAQUE_CALLBACK, w->cb, s->state);
+
+  /* the text is no longer needed, release it while the others finish */
+  free(s->xml);
+  s->xml = NULL;
+  return NULL;
+}
+
+/**
+ * xml_parse_segments
+ *
+ * Description:
+ *  Parse each of the `segments` on its own thread with the SAX callback
+ *  `cb`, passing each segment's `state` as the SAX data.
+ *
+ * Return value:
+ *  0 - every segment was parsed successfully.
+ *  1 - at least one segment could not be parsed.
+ */
+int xml_parse_segments(XMLSegment *segments, size_t n, mxml_sax_cb_t cb) {
+  pthread_t *threads;
+  Worker *workers;
+  size_t i, spawned;
+  int err = 0;
+
+  if (!(threads = malloc(n * sizeof(*threads)))) return 1;
+  if (!(workers = malloc(n * sizeof(*workers)))) {
+    free(threads);
+    return 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    workers[i].segment = &segments[i];
+    workers[i].cb = cb;
+    if (pthread_create(&threads[i], NULL, parse_segment, &workers[i])) break;
+  }
+  /* if we couldn't start a thread parse the remaining segments ourselves */
+  for (spawned = i; i < n; i++) parse_segment(&workers[i]);
+  for (i = 0; i < spawned; i++) pthread_join(threads[i], NULL);
+
+  for (i = 0; i < n; i++) {
+    if (!segments[i].tree) err = 1;
+  }
+
+  free(workers);
+  free(threads);
+  return err;
+}
+
+/**
+ * xml_destroy_segments
+ *
+ * Description:
+ *  Free the segments created by `xml_split` along with any trees parsed from
+ *  them. The `state` of each segment is left to the caller.
+ */
+void xml_destroy_segments(XMLSegment *segments, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (segments[i].xml) free(segments[i].xml);
+    if (segments[i].tree) mxmlDelete(segments[i].tree);
+  }
+  free(segments);
+}
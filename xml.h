@@ -0,0 +1,69 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XML_H_
+#define _XML_H_
+
+#include "mxml.h"
+
+#include "activity.h"
+
+/* attribute marking elements we invented to make a segment well formed */
+#define XML_SYNTHETIC "fitparse:synthetic"
+/* documents at least this large are split into segments parsed in parallel */
+#define XML_PARALLEL_SIZE (4 << 20)
+#define XML_SEGMENT_SIZE (1 << 20)
+#define XML_MAX_DEPTH 16
+
+/**
+ * XMLSegment
+ *
+ * Description:
+ *  A slice of an XML document beginning at a point element, wrapped in
+ *  synthetic open and close tags for the containers which enclose it so that
+ *  it can be parsed on its own.
+ *
+ * Fields:
+ *  xml - the well formed, NUL terminated text of the segment.
+ *  state - the format specific SAX state the segment is parsed into. Owned by
+ *          the caller.
+ *  tree - the tree returned by MXML for the segment.
+ */
+typedef struct {
+  char *xml;
+  void *state;
+  mxml_node_t *tree;
+} XMLSegment;
+
+XMLSegment *xml_split(const char *buf, size_t len, const char *point,
+                      const char **containers, size_t *n);
+int xml_parse_segments(XMLSegment *segments, size_t n, mxml_sax_cb_t cb);
+void xml_destroy_segments(XMLSegment *segments, size_t n);
+
+/**
+ * xml_synthetic
+ *
+ * Description:
+ *  Whether `node` is a container that `xml_split` added to a segment rather
+ *  than one that was in the original document. SAX callbacks use this to
+ *  avoid treating the start of a segment as the start of a lap or trkseg.
+ */
+static inline bool xml_synthetic(mxml_node_t *node) {
+  return mxmlElementGetAttr(node, XML_SYNTHETIC) != NULL;
+}
+
+#endif /* _XML_H_ */
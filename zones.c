@@ -0,0 +1,152 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "zones.h"
+
+/* Coggan's power zones as fractions of FTP */
+static const double POWER_ZONES[] = {0, 0.56, 0.76, 0.91, 1.06, 1.21, 1.51};
+/* heart rate zones as fractions of HR max */
+static const double HEART_RATE_ZONES[] = {0, 0.6, 0.7, 0.8, 0.9};
+
+/**
+ * zones_new
+ *
+ * Description:
+ *  Set up custom zones for `field`, eg. pace zones as speeds.
+ *
+ * Parameters:
+ *  z - the `Zones` to set up.
+ *  field - the `DataField` the zones are for.
+ *  lower - the lowest value in each zone, in increasing order.
+ *  count - the number of zones.
+ *
+ * Return value:
+ *  0 - successfully set up the zones.
+ *  1 - there are too many zones or they aren't in increasing order.
+ */
+int zones_new(Zones *z, DataField field, const double *lower, unsigned count) {
+  unsigned i;
+
+  if (!count || count > ZONES_MAX) return 1;
+  for (i = 1; i < count; i++) {
+    if (lower[i] <= lower[i - 1]) return 1;
+  }
+
+  z->field = field;
+  z->count = count;
+  memcpy(z->lower, lower, count * sizeof(*lower));
+  /* padding never matches, which lets the lookup check every slot */
+  for (i = count; i < ZONES_MAX; i++) z->lower[i] = HUGE_VAL;
+  return 0;
+}
+
+static int scaled_zones(Zones *z, DataField field, const double *fractions,
+                        unsigned count, double scale) {
+  double lower[ZONES_MAX];
+  unsigned i;
+
+  for (i = 0; i < count; i++) lower[i] = fractions[i] * scale;
+  return zones_new(z, field, lower, count);
+}
+
+/**
+ * zones_power
+ *
+ * Description:
+ *  Set up the 7 standard power zones from the athlete's FTP.
+ *
+ * Return value:
+ *  0 - successfully set up the zones.
+ *  1 - the athlete's FTP is unknown.
+ */
+int zones_power(Zones *z, Athlete *athlete) {
+  if (!athlete->ftp) return 1;
+  return scaled_zones(z, Power, POWER_ZONES, ARRAY_SIZE(POWER_ZONES),
+                      athlete->ftp);
+}
+
+/**
+ * zones_heart_rate
+ *
+ * Description:
+ *  Set up 5 heart rate zones from the athlete's HR max.
+ *
+ * Return value:
+ *  0 - successfully set up the zones.
+ *  1 - the athlete's HR max is unknown.
+ */
+int zones_heart_rate(Zones *z, Athlete *athlete) {
+  if (!athlete->hr_max) return 1;
+  return scaled_zones(z, HeartRate, HEART_RATE_ZONES,
+                      ARRAY_SIZE(HEART_RATE_ZONES), athlete->hr_max);
+}
+
+/**
+ * zones_histograms
+ *
+ * Description:
+ *  Work out the time spent in each zone over the whole `Activity` and for
+ *  each of its laps in a single pass. Each point counts for the time since the
+ *  previous point (up to `ZONES_MAX_GAP` seconds). The zone is found by
+ *  counting the lower bounds the value reaches rather than searching, and
+ *  points without the field are given no weight instead of being skipped, so
+ *  the loop has no data dependent branches.
+ *
+ * Parameters:
+ *  a - the `Activity` to bucket.
+ *  z - the `Zones` to bucket into.
+ *  total - set to the histogram for the whole `Activity`.
+ *  laps - optional array of `a->laps.size` histograms set to the histogram for
+ *         each lap.
+ */
+void zones_histograms(Activity *a, Zones *z, ZoneHistogram *total,
+                      ZoneHistogram *laps) {
+  DataPoint *dp;
+  ZoneHistogram *lap = NULL;
+  double v, ts, dt, prev = UNSET_FIELD;
+  size_t j, next = 0;
+  unsigned k, zone;
+
+  assert(a != NULL && z != NULL && total != NULL);
+
+  memset(total, 0, sizeof(*total));
+  if (laps) memset(laps, 0, a->laps.size * sizeof(*laps));
+
+  for (j = 0; j < a->num_points; j++) {
+    dp = &(a->data_points[j]);
+    if (laps && next < a->laps.size && j == a->laps.data[next]) {
+      lap = &(laps[next++]);
+    }
+
+    ts = dp->data[Timestamp];
+    if (!SET(ts)) continue;
+    dt = SET(prev) && ts > prev ? ts - prev : 0;
+    dt = dt < ZONES_MAX_GAP ? dt : ZONES_MAX_GAP;
+    prev = ts;
+
+    v = dp->data[z->field];
+    for (zone = 0, k = 1; k < ZONES_MAX; k++) zone += (v >= z->lower[k]);
+    dt = SET(v) ? dt : 0;
+
+    total->seconds[zone] += dt;
+    if (lap) lap->seconds[zone] += dt;
+  }
+}
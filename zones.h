@@ -0,0 +1,66 @@
+/*
+ *  Copyright (c) 2014 Kirk Scheibelhut <kjs@scheibo.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ZONES_H_
+#define _ZONES_H_
+
+#include "activity.h"
+#include "athlete.h"
+
+#define ZONES_MAX 10
+/* no sample counts for more than this many seconds, so that pauses in the
+ * recording don't end up in a zone */
+#define ZONES_MAX_GAP 5
+
+/**
+ * Zones
+ *
+ * Description:
+ *  Training zones for a single `DataField`, eg. power, heart rate or speed
+ *  for pace. Values below `lower[1]` are in the first zone.
+ *
+ * Fields:
+ *  field - the `DataField` the zones are for.
+ *  count - the number of zones, at most `ZONES_MAX`.
+ *  lower - the lowest value in each zone, in increasing order.
+ */
+typedef struct {
+  DataField field;
+  unsigned count;
+  double lower[ZONES_MAX];
+} Zones;
+
+/**
+ * ZoneHistogram
+ *
+ * Description:
+ *  The time spent in each of a set of `Zones`.
+ *
+ * Fields:
+ *  seconds - the time spent in each zone.
+ */
+typedef struct {
+  double seconds[ZONES_MAX];
+} ZoneHistogram;
+
+int zones_new(Zones *z, DataField field, const double *lower, unsigned count);
+int zones_power(Zones *z, Athlete *athlete);
+int zones_heart_rate(Zones *z, Athlete *athlete);
+void zones_histograms(Activity *a, Zones *z, ZoneHistogram *total,
+                      ZoneHistogram *laps);
+
+#endif /* _ZONES_H_ */